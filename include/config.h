@@ -9,6 +9,8 @@ static const char *notifier = "luft";
 #define STATUS_BAR_HEIGHT 1
 
 #define CLIENT_DATA_DIR "~/.local/share/zsm/zen"
+#define SERVER_DATA_DIR "~/.local/share/zsm/zmr"
+#define SERVER_METRICS_SOCKET SERVER_DATA_DIR "/metrics.sock"
 
 /* Keybindings */
 #define CLEAR_INPUT CTRLX
@@ -0,0 +1,65 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Logging shared by zmr and zen
+ * Each thread formats its lines into its own ring, a flusher thread drains
+ * every ring into the one file descriptor it holds, rotating the file once
+ * it grows past a size. Callers never block on the disk, a full ring loses
+ * lines and the flusher reports how many. Until log_open, and in programs
+ * which never call it, lines go straight to stderr.
+ */
+#define LOG_FATAL 0 /* Also written to stderr when logging to a file */
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_LINE_MAX 1024 /* Bytes of a line, longer ones are cut */
+#define LOG_RING_SIZE (64 * 1024) /* Bytes of lines a thread has buffered */
+#define LOG_FLUSH_INTERVAL 100 /* ms between flushes unless a ring fills up */
+#define LOG_BURST 20 /* Lines of a format a thread logs per second */
+#define LOG_LIMIT_SLOTS 64 /* Formats a thread counts lines of */
+#define LOG_ROTATE_SIZE (64 * 1024 * 1024) /* Default bytes before file is rotated */
+#define LOG_ROTATE_KEEP 3 /* Rotated files kept as path.1 to path.N */
+
+/* Lines of a format logged by a thread in one second */
+typedef struct {
+	const char *fmt;
+	time_t second;
+	int count;
+	int suppressed; /* Over LOG_BURST, reported with the next line let through */
+} log_limit_t;
+
+typedef struct log_ring_t {
+	struct log_ring_t *next; /* Every thread's ring, lock-free stack */
+	uint64_t head; /* Bytes written by thread */
+	uint64_t tail; /* Bytes taken by flusher */
+	uint64_t dropped; /* Lines lost to a full ring */
+	log_limit_t limits[LOG_LIMIT_SLOTS];
+	uint8_t data[LOG_RING_SIZE];
+} log_ring_t;
+
+/* Header of a line in a ring, its text follows */
+typedef struct {
+	uint32_t length;
+	int32_t level;
+	int64_t time;
+} log_entry_t;
+
+extern int log_level;
+
+/* Arguments aren't evaluated unless debug lines are logged */
+#define log_debug(...) do { \
+	if (log_level >= LOG_DEBUG) log_write(LOG_DEBUG, __VA_ARGS__); \
+} while (0)
+
+int log_open(const char *path, size_t rotate);
+void log_vwrite(int level, int errsv, const char *fmt, va_list args);
+void log_write(int level, const char *fmt, ...);
+void log_flush(void);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Compression of message content before it is encrypted
+ * The codec is the LZ4 block format, greedy with one hash probe per
+ * position, which is fast enough to not show next to the AEAD and simple
+ * enough for the web client to decode. Only clients see it, the relay
+ * handles the ciphertext as before. Clients from before it can't read it,
+ * zen only compresses with compress=1 in zen.conf.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 /* Block always ends with this many literals */
+#define LZ_MATCH_LIMIT 12 /* Last match starts at least this far from the end */
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_MAX_INPUT 65535 /* Positions are kept in 16 bits */
+
+/*
+ * Compressed content starts with a NUL, which text never does, then its
+ * flags and its length before compression. Anything else is plain text.
+ */
+#define CONTENT_MARK 0x00
+#define CONTENT_COMPRESSED 0x1
+#define CONTENT_HEADER_SIZE 4 /* Mark, flags, length as 16 bit little-endian */
+#define COMPRESS_THRESHOLD 256 /* Shorter content isn't worth compressing */
+
+size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+ssize_t lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+size_t compress_content(uint8_t *out, const uint8_t *text, size_t length);
+ssize_t expand_content(uint8_t *out, size_t capacity, const uint8_t *content, size_t length);
+
+#endif
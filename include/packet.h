@@ -20,6 +20,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sodium.h>
 #include <libgen.h>
@@ -35,6 +36,13 @@ enum {
     ZSM_TYP_DELETE_MESSAGE = 0x4,
     ZSM_TYP_ERROR = 0x5,
     ZSM_TYP_INFO = 0x6,
+    ZSM_TYP_CHANNEL = 0x16, /* Channel membership change */
+    ZSM_TYP_CHANNEL_MESSAGE = 0x17, /* Message fanned out to channel members */
+    ZSM_TYP_NODE = 0x18, /* Opens link between relay nodes */
+    ZSM_TYP_PRESENCE = 0x19, /* User connected to or left a relay node */
+    ZSM_TYP_ROUTE = 0x1A, /* Recipient of the next frame on a node link */
+    ZSM_TYP_PING = 0x1B, /* Keepalive, header only, answered with ZSM_TYP_PONG */
+    ZSM_TYP_PONG = 0x1C,
 
     /* Status */
     ZSM_STA_SUCCESS = 0x7,
@@ -64,11 +72,34 @@ enum {
 #define ADDITIONAL_SIZE crypto_box_MACBYTES /* 16 */
 #define MAX_MESSAGE_LENGTH MAX_DATA_LENGTH - MAX_NAME * 2 - NONCE_SIZE
 
+#define PACKET_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint32_t)) /* type, length */
+
+/*
+ * Protocol v2 frames start with ZSM_V2 instead of a type, then the length of
+ * their header, type, flags, length and message ID, the last two in network
+ * byte order. Data and signature follow as in v1.
+ * v1 frames keep the native-endian type + length header. Server advertises
+ * v2 in the unused signature of its challenge, a client answering it with a
+ * v2 AUTH frame is sent v2 frames from then on. Clients set ZSM_FLAG_ACK
+ * to have the server answer a frame with a status carrying its ID, so they
+ * can pipeline frames instead of waiting for each one.
+ */
+#define ZSM_V2 0xA2 /* Magic 0xA0 with version, never a v1 type */
+#define ZSM_VERSION 2 /* Newest version spoken */
+#define PACKET_V2_HEADER_SIZE 16
+#define PACKET_HEADER_MAX 32 /* Longer headers of later versions are refused */
+#define ZSM_FLAG_ACK 0x1 /* Sender wants a status once frame was handled */
+#define MAX_FRAME_SIZE (PACKET_HEADER_MAX + MAX_DATA_LENGTH + SIGN_SIZE)
+#define TIME_SIZE 8 /* Creation time ending message data, little-endian */
+
 typedef struct {
     uint8_t type;
     uint32_t length;
     uint8_t *data;
     uint8_t *signature;
+    uint8_t version; /* Frame format, 1 or ZSM_VERSION */
+    uint8_t flags; /* ZSM_FLAG_*, always 0 in v1 */
+    uint64_t id; /* Chosen by sender, 0 in v1 */
 } packet_t;
 
 #include "key.h"
@@ -78,7 +109,17 @@ void print_packet(packet_t *pkt);
 int recv_packet(packet_t *pkt, int fd);
 packet_t *create_packet(uint8_t type, uint32_t length, uint8_t *data, uint8_t *signature);
 int send_packet(packet_t *pkt, int fd);
+void clear_packet(packet_t *pkt);
 void free_packet(packet_t *pkt);
+int parse_frame(uint8_t *buf, size_t len, size_t *frame_len);
+void unpack_packet(packet_t *pkt, uint8_t *frame);
+int frame_version(uint8_t *frame);
+uint8_t frame_type(uint8_t *frame);
+size_t frame_header_size(uint8_t *frame);
+size_t pack_header(uint8_t *header, int version, uint8_t type, uint8_t flags, uint32_t length, uint64_t id);
+void pack_time(uint8_t *buf, time_t time);
+time_t unpack_time(uint8_t *buf);
+int check_packet(packet_t *pkt);
 int verify_packet(packet_t *pkt, int fd);
 uint8_t *create_signature(uint8_t *data, uint32_t length, uint8_t *sk);
 
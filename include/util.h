@@ -3,8 +3,7 @@
 
 #include <stdlib.h>
 
-#define LOG_ERROR 1
-#define LOG_INFO 2
+#include "log.h"
 
 #define PATH_MAX 4096
 
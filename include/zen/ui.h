@@ -9,6 +9,7 @@ typedef struct {
 	char bin_pk[PK_SIZE];
 	char bin_sk[SK_SIZE];
 	char server_address[256];
+	int compress; /* Compress long messages, only zen which expands them reads them */
 } config_t;
 
 enum modes {
@@ -0,0 +1,67 @@
+#ifndef CHANNEL_H_
+#define CHANNEL_H_
+
+#include "zmr/zmr.h"
+
+/*
+ * Group channels, one uploaded frame is fanned out to every member
+ * ZSM_TYP_CHANNEL frames manage membership: sender, channel id, op and the
+ * member it applies to. The first add creates the channel with sender as
+ * owner, only the owner adds members, members may remove themselves and the
+ * owner anyone. Channel is gone once its owner leaves.
+ * ZSM_TYP_CHANNEL_MESSAGE frames carry sender and channel id like a message
+ * carries sender and recipient, the rest is opaque to the server. Each member
+ * but the sender gets a queue entry referencing the same frame. Fan-out is
+ * done CHANNEL_BATCH members per round so a big channel can't hold up the
+ * other clients of a thread.
+ * Membership only lives in memory of one node, so channel frames are refused
+ * with ZSM_STA_INVALID_TYPE once peers are federated.
+ */
+#define CHANNEL_SHARDS 64
+#define CHANNEL_BUCKETS 256 /* Channel hash chains per shard */
+#define CHANNEL_MAX_MEMBERS 65536
+#define CHANNEL_BATCH 256 /* Members fanned out to per round */
+#define CHANNEL_FRAME_SIZE (MAX_NAME * 2 + 1 + PK_SIZE) /* Membership frame data */
+
+enum {
+	CHANNEL_ADD = 1,
+	CHANNEL_REMOVE = 2
+};
+
+/* Member list, replaced instead of changed while fan-outs hold it */
+typedef struct {
+	int refs; /* Updated atomically */
+	int count;
+	int size;
+	uint8_t pks[][PK_SIZE];
+} members_t;
+
+typedef struct channel_t {
+	uint8_t id[PK_SIZE];
+	uint8_t owner[PK_SIZE];
+	members_t *members;
+	struct channel_t *next; /* Hash chain */
+} channel_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	channel_t *buckets[CHANNEL_BUCKETS];
+	char pad[64];
+} channel_shard_t;
+
+/* Frame being fanned out to members, queued on sender's thread and taken
+ * from its pool */
+typedef struct fanout_t {
+	out_t *out; /* Holds the frame until every member got it */
+	client_t *client; /* Sender */
+	members_t *members;
+	int next; /* Member to go on with */
+	struct fanout_t *next_fanout;
+} fanout_t;
+
+void channel_init(void);
+void channel_manage(thread_t *thread, client_t *client, out_t *out);
+void channel_send(thread_t *thread, client_t *client, out_t *out);
+void channel_work(thread_t *thread);
+
+#endif
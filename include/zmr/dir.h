@@ -0,0 +1,53 @@
+#ifndef DIR_H_
+#define DIR_H_
+
+#include "zmr/zmr.h"
+
+/*
+ * Global directory of authenticated clients keyed on binary public key
+ * Lookups are lock-free, writers lock a single shard. Memory unlinked from the
+ * directory is only freed once every worker passed a quiescent state.
+ */
+#define DIR_SHARDS 64
+#define DIR_SHARD_SIZE 256 /* Initial slots per shard, power of 2 */
+#define DIR_TOMBSTONE ((client_t *) 1)
+#define DIR_OFFLINE UINT64_MAX
+
+typedef struct {
+	size_t size; /* Number of slots, power of 2 */
+	client_t *slots[]; /* NULL, DIR_TOMBSTONE or client */
+} dir_table_t;
+
+typedef struct {
+	pthread_mutex_t lock; /* Serialises writers */
+	dir_table_t *table; /* Published table, readers load it atomically */
+	size_t used; /* Live clients and tombstones */
+	size_t live;
+	char pad[64]; /* Keep shards on separate cache lines */
+} dir_shard_t;
+
+typedef struct retired_t {
+	void *ptr;
+	uint64_t epoch; /* Safe to free once all readers have seen this */
+	struct retired_t *next;
+} retired_t;
+
+typedef struct {
+	uint64_t seen; /* Epoch observed when going online, DIR_OFFLINE when idle */
+	retired_t *retired; /* Memory waiting for a grace period */
+	char pad[64];
+} dir_reader_t;
+
+void dir_init(int readers_count);
+int dir_add(int id, client_t *client);
+int dir_remove(int id, client_t *client);
+client_t *dir_lookup(uint8_t *pk);
+void dir_foreach(void (*fn)(client_t *client, void *arg), void *arg);
+void dir_online(int id);
+void dir_offline(int id);
+void dir_retire(int id, void *ptr);
+uint64_t dir_advance(void);
+uint64_t dir_grace(void);
+void dir_reclaim(int id, uint64_t grace);
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef FED_H_
+#define FED_H_
+
+#include "zmr/zmr.h"
+
+/*
+ * Federation of zmr nodes
+ * Every node connects out to each of its peers once for control and once per
+ * worker thread for data. The accepting node sends a ZSM_TYP_NODE frame with a
+ * random challenge, which the connecting node answers with one naming itself
+ * and the kind of link, keyed with the shared federation key over the
+ * challenge. A control link is answered the same way over the connecting
+ * node's nonce. Links are only taken from the addresses of peers, and without
+ * a key (-K) the federation port only listens on loopback.
+ * Control links carry ZSM_TYP_PRESENCE frames for every user connecting or
+ * leaving, and all users connected when the link comes up, which fill the
+ * peer's table of users connected to other nodes. Data links are owned by a
+ * worker like clients are, a forwarded frame is queued on the link as a
+ * ZSM_TYP_ROUTE frame naming its recipient followed by the frame itself.
+ * Frames which came over a link are never forwarded again and are rate limited
+ * per link. Frames stored in the mailbox of a user who then connects to
+ * another node are forwarded to it once its presence arrives, frames a dropped
+ * data link didn't write are stored and forwarded the same way.
+ * Order is kept per sending connection, as every frame of a connection goes
+ * over the data link of the thread owning it. Frames a user sends over several
+ * connections at once may take different links and arrive interleaved.
+ * Channels aren't federated, see channel.h.
+ */
+#define FED_MAX_PEERS 16
+#define FED_ROUTE_SHARDS 64
+#define FED_ROUTE_BUCKETS 256 /* Routes hash chains per shard */
+#define FED_RETRY_INTERVAL 1 /* Seconds between reconnecting lost links */
+#define FED_TIMEOUT 1 /* Seconds to connect and exchange ZSM_TYP_NODE */
+#define FED_CONTROL_LIMIT (16 * 1024 * 1024) /* Presence bytes waiting on a control link */
+#define FED_QUEUE_LIMIT (64 * 1024 * 1024) /* Bytes queued on a data link */
+#define FED_MAX_LINKS 256 /* Control links taken from other nodes */
+#define FED_MAX_DATA_LINKS 4096 /* Data links taken from other nodes */
+#define FED_MAX_ADDRS 8 /* Addresses of a peer links are taken from */
+#define FED_KEY_SIZE 32
+
+enum {
+	LINK_NONE, /* Client */
+	LINK_OUT, /* Data link to a peer, frames are only written */
+	LINK_IN /* Data link from a peer, frames are only read */
+};
+
+enum {
+	NODE_CHALLENGE = 0, /* Sent by the accepting node first */
+	NODE_CONTROL = 1,
+	NODE_DATA = 2
+};
+
+#define NODE_NONCE_SIZE 32
+#define NODE_MAC_SIZE 32
+/* Node id, link kind, nonce, keyed hash of the other node's nonce and these */
+#define NODE_FRAME_SIZE (sizeof(uint64_t) + 1 + NODE_NONCE_SIZE + NODE_MAC_SIZE)
+#define NODE_FRAME_LEN (PACKET_HEADER_SIZE + NODE_FRAME_SIZE + SIGN_SIZE)
+#define PRESENCE_FRAME_SIZE (1 + PK_SIZE) /* Online, user */
+
+/* Bytes read from or waiting to be written to a control link */
+typedef struct {
+	uint8_t *data;
+	size_t length;
+	size_t size;
+} fed_buf_t;
+
+typedef struct {
+	char *host;
+	char *port;
+	uint64_t node; /* Id the peer answered with, updated atomically */
+	int control; /* Outbound control link, -1 while down */
+	int connecting; /* Control link waits for the peer's ZSM_TYP_NODE frames */
+	fed_buf_t wbuf;
+	int *up; /* Data link of each worker is connected or being connected,
+			  * updated atomically */
+	struct sockaddr_storage addrs[FED_MAX_ADDRS]; /* Resolved when connecting */
+	int num_addrs;
+} peer_t;
+
+/*
+ * Link accepted from another node, a control link once it named itself, or
+ * link to a peer until its ZSM_TYP_NODE frames were exchanged
+ */
+typedef struct {
+	int fd;
+	uint64_t node;
+	fed_buf_t rbuf;
+	int pending; /* ZSM_TYP_NODE frames still awaited */
+	time_t deadline; /* Dropped if it is still pending by then */
+	uint8_t nonce[NODE_NONCE_SIZE]; /* Challenge the other node answers */
+	peer_t *peer; /* Peer link was opened to, NULL if it was accepted */
+	int kind; /* Of link opened to peer */
+	int tid; /* Worker taking data link opened to peer */
+} fed_link_t;
+
+/* User connected to another node */
+typedef struct route_t {
+	uint8_t pk[PK_SIZE];
+	uint64_t node;
+	struct route_t *next; /* Hash chain */
+} route_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	route_t *buckets[FED_ROUTE_BUCKETS];
+	char pad[64];
+} route_shard_t;
+
+/* User connecting or leaving, handed to the federation thread */
+typedef struct presence_t {
+	uint8_t pk[PK_SIZE];
+	int online;
+	struct presence_t *next;
+} presence_t;
+
+extern int num_peers;
+
+int fed_add_peer(char *address);
+int fed_load_key(char *path);
+int fed_init(int port);
+void fed_presence(uint8_t *pk, int online);
+int fed_forward(thread_t *thread, uint8_t *to, out_t *out);
+ssize_t fed_room(thread_t *thread, uint8_t *to);
+int link_frame(thread_t *thread, client_t *client, uint8_t *frame,
+		size_t frame_len);
+void link_started(thread_t *thread, client_t *client);
+void link_dropped(thread_t *thread, client_t *client);
+
+#endif
@@ -1,17 +1,37 @@
 #ifndef HT_H_
 #define HT_H_
 
-#include "zmr/zmr.h"
+#include "packet.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037u
+#define FNV_PRIME 1099511628211u
+
+/*
+ * Open addressing table of clients keyed on binary public key
+ * Linear probing over two parallel arrays: one byte hash tag per slot, probed
+ * first, and client pointers only dereferenced when the tag matches.
+ * Removal shifts the rest of the cluster back so no tombstones are left.
+ */
+#define HT_MIN_SIZE 64 /* Power of 2 */
+#define HT_EMPTY 0 /* Tag of a free slot, used tags have the top bit set */
 
-#define FNV_OFFSET_BASIS 2166136261u
-#define FNV_PRIME 16777619u
+typedef struct {
+	size_t size; /* Number of slots, power of 2 */
+	size_t count; /* Clients stored */
+	uint8_t *tags;
+	struct client_t **slots;
+} hashtable_t;
+
+/* Included after hashtable_t, thread_t embeds one */
+#include "zmr/zmr.h"
 
-void hashtable_init(client_t **hash_table);
-void hashtable_print(client_t **hash_table);
-int hashtable_add(client_t **hash_table, client_t *p);
-client_t *hashtable_search(client_t **hash_table, char *username);
-int hashtable_remove(client_t **hash_table, char *username);
-int hashtable_length(client_t **hash_table);
-void hashtable_free(client_t **hash_table);
+uint64_t pk_hash(uint8_t *pk);
+int hashtable_init(hashtable_t *table, size_t size);
+void hashtable_print(hashtable_t *table);
+int hashtable_add(hashtable_t *table, client_t *client);
+client_t *hashtable_search(hashtable_t *table, uint8_t *pk);
+int hashtable_remove(hashtable_t *table, client_t *client);
+size_t hashtable_length(hashtable_t *table);
+void hashtable_free(hashtable_t *table);
 
 #endif
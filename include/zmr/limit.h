@@ -0,0 +1,52 @@
+#ifndef LIMIT_H_
+#define LIMIT_H_
+
+#include "zmr/zmr.h"
+
+/*
+ * Rate limits of connections and of users across all their connections
+ * Packets and bytes per second are token buckets kept as the time they are
+ * full again (GCRA), a user's buckets are shared by its connections on any
+ * thread and updated with compare and swap. Frames are admitted before their
+ * signature is checked, a connection over a limit is not read until its
+ * buckets refilled so the sender is held back by TCP instead of losing frames.
+ * A rate of 0 is not limited.
+ */
+#define LIMIT_SHARDS 64
+#define LIMIT_BUCKETS 256 /* Users hash chains per shard */
+#define LIMIT_BURST 1 /* Seconds of rate a full bucket holds */
+#define LIMIT_PACKETS 2000 /* Default packets/s of a connection, -l changes it */
+#define LIMIT_BYTES (4 * 1024 * 1024) /* Default bytes/s of a connection */
+#define LIMIT_USER_PACKETS 4000 /* Default packets/s of a user, -L changes it */
+#define LIMIT_USER_BYTES (8 * 1024 * 1024)
+#define LIMIT_LINK_PACKETS 200000 /* Packets/s of a data link from another node */
+#define LIMIT_LINK_BYTES (256 * 1024 * 1024)
+#define LIMIT_USER_CONNECTIONS 16 /* Default connections of a user, -k changes it */
+
+/* User with at least one connection */
+typedef struct limit_t {
+	uint8_t pk[PK_SIZE];
+	int refs; /* Connections, changed under shard lock */
+	bucket_t bucket;
+	struct limit_t *next; /* Hash chain */
+} limit_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	limit_t *buckets[LIMIT_BUCKETS];
+	char pad[64];
+} limit_shard_t;
+
+extern uint64_t limit_packets;
+extern uint64_t limit_bytes;
+extern uint64_t user_packets;
+extern uint64_t user_bytes;
+extern int user_connections;
+
+void limit_init(void);
+int parse_limit(char *arg, uint64_t *packets, uint64_t *bytes);
+int limit_join(client_t *client);
+void limit_leave(client_t *client);
+uint64_t limit_admit(client_t *client, size_t length);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "zmr/zmr.h"
+
+/*
+ * Store-and-forward of frames for recipients which are not connected
+ * Frames are appended to a log of memory-mapped segment files, which a
+ * background thread msyncs in groups. An in-memory index keeps each
+ * recipient's frames in order, they are streamed once it authenticates.
+ * Segments whose frames were all delivered or expired are deleted, mostly
+ * delivered ones are compacted by copying what is left to the newest one.
+ * Only frames for offline recipients ever touch the mailbox.
+ */
+#define MAILBOX_SHARDS 64
+#define MAILBOX_BUCKETS 256 /* Recipients hash chains per shard */
+#define MAILBOX_SEGMENT_SIZE (16 * 1024 * 1024)
+#define MAILBOX_SYNC_INTERVAL 50 /* ms between group msyncs */
+#define MAILBOX_MAINTAIN_INTERVAL 60 /* Seconds between expiry and compaction */
+#define MAILBOX_TTL (7 * 24 * 60 * 60) /* Default seconds frames are kept */
+#define MAILBOX_COMPACT_RATIO 4 /* Compact sealed segment under 1/4 live */
+#define MAILBOX_BATCH (256 * 1024) /* Bytes queued to a client at a time */
+
+enum {
+	MAIL_FREE, /* Past last record of segment */
+	MAIL_STORED,
+	MAIL_DELIVERED /* Also set once record is expired or moved */
+};
+
+/* On-disk record header, frame follows it padded to 8 bytes */
+typedef struct {
+	uint32_t length; /* Frame bytes, written last */
+	uint32_t state;
+	int64_t time; /* When frame was stored */
+	uint64_t id; /* Increasing, restores order of moved records on restart */
+	uint8_t to[PK_SIZE];
+} mail_record_t;
+
+typedef struct segment_t {
+	uint64_t seq; /* Number in file name, segments are ordered by it */
+	int fd;
+	uint8_t *map;
+	size_t tail; /* Bytes appended */
+	size_t synced; /* Bytes known to be on disk */
+	int live; /* Records not yet delivered, updated atomically */
+	int records;
+	int sealed; /* No more appends, segment is full or from a previous run */
+	int expired;
+	int compacting; /* Live records are being moved out */
+	int64_t newest; /* Time of newest record */
+	struct segment_t *next;
+} segment_t;
+
+typedef struct mail_t {
+	segment_t *seg;
+	size_t offset; /* Record header inside segment */
+	struct mail_t *next;
+} mail_t;
+
+typedef struct mailbox_t {
+	uint8_t pk[PK_SIZE]; /* Recipient */
+	mail_t *head; /* Oldest frame first */
+	mail_t *tail;
+	struct mailbox_t *next; /* Hash chain */
+} mailbox_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	mailbox_t *buckets[MAILBOX_BUCKETS];
+	char pad[64];
+} mailbox_shard_t;
+
+int mailbox_init(char *dir, int64_t ttl);
+int mailbox_store(uint8_t *to, uint8_t *frame, size_t length);
+void mailbox_take(client_t *client);
+void mailbox_fill(thread_t *thread, client_t *client);
+void mailbox_sent(mail_t *mail);
+void mailbox_unsent(mail_t *mail);
+void mailbox_return(client_t *client);
+int mailbox_defer(uint8_t *to, uint8_t *frame, size_t length);
+void mailbox_remote(uint8_t *pk);
+void mailbox_forward(thread_t *thread);
+
+#endif
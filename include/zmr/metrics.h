@@ -0,0 +1,58 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+/*
+ * Counters and latency histograms of the relay
+ * Every thread only writes its own, with relaxed stores and no locked
+ * instructions, and the metrics thread sums them up when it is asked.
+ * Served in Prometheus text format on a Unix socket, zmrctl reads it.
+ */
+#define HIST_SUB_BITS 4 /* 16 buckets per power of 2, within 6.25% */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+#define METRICS_BACKLOG 16
+#define METRICS_SEND_TIMEOUT 1 /* Seconds a reader gets to take the text */
+
+/* Log-linear histogram of nanoseconds like HdrHistogram */
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct {
+	char pad_head[64]; /* Keep off the cache lines of other fields */
+	uint64_t connections; /* Taken over by thread */
+	uint64_t auths_ok;
+	uint64_t auths_failed;
+	uint64_t packets_in;
+	uint64_t packets_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t verify_failures;
+	uint64_t unknown_recipients; /* Not connected to any thread */
+	uint64_t mailbox_stored;
+	uint64_t fanout_frames; /* Queued for channel members */
+	uint64_t forwarded; /* Sent to users connected to other nodes */
+	uint64_t handshake_timeouts;
+	uint64_t idle_timeouts; /* Dropped for not answering a ping */
+	uint64_t throttled; /* Times a connection went over a rate limit */
+	uint64_t limit_rejects; /* Users already having too many connections */
+	uint64_t queued_frames; /* Gauge, frames in queues of thread's clients */
+	uint64_t queued_bytes; /* Gauge */
+	hist_t verify; /* Signature checks done on this thread */
+	hist_t lookup; /* Directory lookups of recipients */
+	hist_t relay; /* Frame received until written to recipient */
+	char pad_tail[64];
+} metrics_t;
+
+uint64_t now_ns(void);
+void metric_add(uint64_t *counter, uint64_t n);
+void metric_sub(uint64_t *counter, uint64_t n);
+void hist_record(hist_t *hist, uint64_t ns);
+int metrics_init(char *path);
+
+#endif
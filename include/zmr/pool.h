@@ -0,0 +1,38 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+/*
+ * Fixed-size block allocator owned by one thread
+ * Blocks are carved out of slabs which are never given back, so a pool only
+ * calls malloc while it grows towards its peak. Any thread may put a block
+ * back, those land on a lock-free stack the owner takes over in one go.
+ */
+#define POOL_SLAB_BYTES (256 * 1024) /* Aimed size of one slab */
+
+typedef struct pool_block_t {
+	struct pool_t *pool; /* Owner, NULL for blocks bigger than any pool */
+	struct pool_block_t *next;
+} pool_block_t;
+
+typedef struct pool_t {
+	size_t size; /* Usable bytes of a block */
+	size_t per_slab;
+	pool_block_t *free; /* Only touched by owner */
+	pool_block_t *returned; /* Put back by any thread, lock-free stack */
+	void *slabs; /* Every slab, first word links to the next one */
+	size_t slab_count;
+	size_t gets; /* Blocks handed out, updated by owner */
+	size_t puts; /* Blocks put back, updated atomically */
+} pool_t;
+
+extern size_t pool_mallocs; /* Oversized blocks, updated atomically */
+
+void pool_init(pool_t *pool, size_t size);
+void *pool_get(pool_t *pool);
+void *pool_malloc(size_t size);
+void pool_put(void *ptr);
+void pool_print(pool_t *pool, char *name);
+
+#endif
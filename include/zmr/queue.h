@@ -0,0 +1,29 @@
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+#include "zmr/zmr.h"
+
+/*
+ * Outbound queue of a connection, only flushed by the thread owning it
+ * Other threads hand frames over through the owner's inbox
+ */
+buf_t *buf_new(thread_t *thread, size_t size);
+void buf_hold(buf_t *buf);
+void buf_release(buf_t *buf);
+out_t *out_new(thread_t *thread, buf_t *buf, uint8_t *frame, size_t length);
+out_t *out_copy(thread_t *thread, uint8_t *frame, size_t length);
+out_t *out_convert(thread_t *thread, out_t *out, int version);
+void out_free(thread_t *thread, out_t *out);
+void queue_push(thread_t *thread, client_t *client, out_t *out);
+int queue_iov(client_t *client, struct iovec *iov, int max);
+void queue_sent(thread_t *thread, client_t *client, size_t bytes_sent);
+int queue_flush(thread_t *thread, client_t *client);
+void queue_clear(thread_t *thread, client_t *client);
+size_t queue_length(client_t *client);
+int out_push(out_t **stack, out_t *out);
+out_t *out_take(out_t **stack);
+void thread_wake(thread_t *thread);
+void inbox_push(thread_t *thread, client_t *client, out_t *out);
+out_t *inbox_take(thread_t *thread);
+
+#endif
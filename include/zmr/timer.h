@@ -0,0 +1,46 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel owned by one thread
+ * Time is counted in ticks of TIMER_TICK ms. Level 0 has a slot for each of
+ * the next WHEEL_SLOTS ticks, every further level covers WHEEL_SLOTS times
+ * the span of the one below with slots as wide as that whole level. Setting
+ * and cancelling a timeout is a list insert or unlink, when level 0 wraps
+ * the due slot of the level above is spread over the levels below.
+ */
+#define TIMER_TICK 100 /* ms */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* Spans 2^24 ticks, about 19 days */
+#define WHEEL_MAX_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define TIMER_SECONDS(s) ((uint64_t) (s) * 1000 / TIMER_TICK)
+
+struct timeout_t;
+
+typedef void (*timeout_fn)(void *arg, struct timeout_t *timeout);
+
+typedef struct timeout_t {
+	uint64_t expires; /* Tick it is due at */
+	timeout_fn fn; /* Called with the argument wheel is run with */
+	struct timeout_t *next;
+	struct timeout_t **pprev; /* Link pointing to it, NULL if not set */
+} timeout_t;
+
+typedef struct {
+	uint64_t now; /* Tick last run */
+	int count; /* Timeouts set */
+	timeout_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+uint64_t timer_ticks(void);
+void wheel_init(wheel_t *wheel);
+void timeout_init(timeout_t *timeout, timeout_fn fn);
+void timeout_set(wheel_t *wheel, timeout_t *timeout, uint64_t expires);
+void timeout_cancel(wheel_t *wheel, timeout_t *timeout);
+void wheel_run(wheel_t *wheel, uint64_t now, void *arg);
+int wheel_timeout(wheel_t *wheel);
+
+#endif
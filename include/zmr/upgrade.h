@@ -0,0 +1,68 @@
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+#include "zmr/zmr.h"
+#include "zmr/ws.h"
+
+/*
+ * Hot upgrade, SIGUSR2 replaces the running process by a fresh exec of its
+ * binary without dropping connections
+ * Workers stop reading authorised clients and park once nothing is in flight
+ * between threads, verifiers and the kernel. The main thread then execs the
+ * binary with the same arguments and hands it every listener and authorised
+ * connection over a unix socket with SCM_RIGHTS, along with the bytes each
+ * client sent that weren't handled and the ones queued for it. The new
+ * process waits for the old one to exit before opening the mailbox and
+ * federation, then resumes the clients without a handshake. If anything
+ * fails before the new process took over, workers carry on as before.
+ * Clients still in handshake and links to peers are closed and reconnect,
+ * channels live in memory and are lost.
+ */
+#define UPGRADE_ENV "ZMR_UPGRADE_FD" /* Socket the new process reads state from */
+#define UPGRADE_FD 3 /* Its number in the new process */
+#define UPGRADE_VERSION 3 /* Bumped when records change */
+#define UPGRADE_TIMEOUT 10 /* Seconds for workers to park and for the new process */
+#define UPGRADE_TICK 10 /* epoll_wait timeout (ms) while a thread waits to park */
+#define UPGRADE_CHUNK 65536 /* Bytes of buffered state per message */
+
+enum {
+	UPGRADE_HELLO, /* in_len is UPGRADE_VERSION */
+	UPGRADE_LISTENER, /* Carries listening socket, in_len is its LISTENER_* */
+	UPGRADE_CLIENT, /* Carries client socket, followed by its bytes */
+	UPGRADE_DONE
+};
+
+/* Listeners by what they are for, main thread's come first */
+#define LISTENER_CLIENTS 0 /* Unless workers have their own */
+#define LISTENER_WS 1
+#define LISTENER_THREAD(i) (2 + (i))
+
+/* Message header, bytes of a client follow in messages of UPGRADE_CHUNK */
+typedef struct {
+	uint32_t kind;
+	uint32_t in_len; /* Received but not handled */
+	uint32_t out_len; /* Queued but not written */
+	uint8_t pk[PK_SIZE];
+	uint32_t version; /* Protocol version client answered challenge in */
+	uint32_t websocket; /* Client is upgraded, ws holds its framing */
+	ws_t ws;
+} upgrade_record_t;
+
+/* State of a client handed over, until its new owner started it */
+typedef struct resume_t {
+	size_t in_len;
+	size_t out_len;
+	uint8_t data[]; /* Received bytes, then queued ones */
+} resume_t;
+
+extern int upgrading;
+
+void upgrade_init(char **argv);
+void upgrade_signal(int signal);
+int upgrade_receive(void);
+int upgrade_listener(int index);
+void upgrade_resume(void);
+int upgrade_wait(int *fds, int count);
+void upgrade_park(thread_t *thread);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "zmr/zmr.h"
+
+/*
+ * io_uring backend of worker threads, talks to the kernel ABI directly
+ * Each connection has one multishot receive armed, data lands in the thread's
+ * provided buffer ring. Queues are written with IORING_OP_WRITEV and all
+ * requests of a round are submitted with a single io_uring_enter.
+ */
+#define URING_ENTRIES 1024 /* Submission queue size */
+#define URING_BUFFERS 256 /* Provided buffers per thread, power of 2 */
+#define URING_BUFFER_SIZE 8192
+#define URING_BUFFER_GROUP 0
+#define URING_IOV (FLUSH_IOV * 64) /* iovecs of writes waiting for submit */
+
+enum {
+	URING_RECV,
+	URING_SEND,
+	URING_EVENT,
+	URING_TIMEOUT,
+	URING_ACCEPT,
+	URING_CANCEL
+};
+#define URING_KIND_MASK 7 /* Kind lives in low bits of 8 byte aligned pointer */
+
+typedef struct uring_t {
+	int fd;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail; /* Prepared but unpublished entries */
+	unsigned to_submit;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br; /* Provided buffer ring */
+	size_t br_len;
+	uint8_t *buffers;
+	unsigned short br_tail;
+	uint64_t event_count; /* Target of eventfd read */
+	struct __kernel_timespec tick;
+	int timeout_armed;
+	int accepting; /* Multishot accept armed */
+	struct iovec iov[URING_IOV]; /* Must stay valid until submitted */
+	int iov_used;
+} uring_t;
+
+int uring_init(thread_t *thread);
+void uring_free(thread_t *thread);
+int uring_flush(thread_t *thread, client_t *client);
+void uring_worker(thread_t *thread);
+void uring_pause(thread_t *thread, client_t *client);
+int uring_resume(thread_t *thread, client_t *client);
+void uring_freeze(thread_t *thread);
+void uring_thaw(thread_t *thread);
+
+#endif
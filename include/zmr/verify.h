@@ -0,0 +1,29 @@
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include "zmr/zmr.h"
+
+/*
+ * Pool of threads checking message signatures off the I/O threads
+ * A connection always uses the same verifier, which works through its jobs
+ * in order and hands them back to the connection's owner in that order.
+ * Jobs are queue entries still referencing the frame in the receive buffer,
+ * so a verified frame is queued for its recipient as is.
+ */
+typedef struct {
+	int id;
+	pthread_t thread;
+	int event_fd; /* Wakes verifier up when jobs are pushed */
+	out_t *jobs; /* Lock-free stack */
+	hist_t verify; /* Time of signature checks */
+	char pad[64]; /* Keep verifiers on separate cache lines */
+} verifier_t;
+
+extern verifier_t *verifiers;
+extern int num_verifiers;
+
+int verify_init(int count);
+void verify_push(client_t *client, out_t *out);
+out_t *verify_take(thread_t *thread);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef WS_H_
+#define WS_H_
+
+#include "zmr/zmr.h"
+
+/*
+ * WebSocket clients (RFC 6455) served by the same workers as native ones
+ * After the HTTP upgrade every binary message from the browser is unmasked
+ * in place into the byte stream of packets, so the rest of the relay never
+ * sees the framing. Every frame queued for the client goes out as one binary
+ * message. TLS is left to a proxy in front, wss:// terminates there.
+ */
+#define WS_PORT 0 /* Default, browsers connect to -w port */
+#define WS_HTTP_MAX 4096 /* Bytes of upgrade request */
+#define WS_HEADER_MAX 14 /* Frame header with 64 bit length and mask */
+#define WS_CONTROL_MAX 125 /* Payload of ping and close */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+enum {
+	WS_HTTP, /* Waiting for upgrade request */
+	WS_OPEN,
+	WS_CLOSING /* Close was answered, client is dropped once it is sent */
+};
+
+enum {
+	WS_OP_CONTINUATION = 0x0,
+	WS_OP_TEXT = 0x1,
+	WS_OP_BINARY = 0x2,
+	WS_OP_CLOSE = 0x8,
+	WS_OP_PING = 0x9,
+	WS_OP_PONG = 0xA
+};
+
+typedef struct ws_t {
+	int state;
+	char *http; /* Upgrade request so far, freed once open */
+	size_t http_len;
+	uint8_t head[WS_HEADER_MAX]; /* Header of frame split between reads */
+	int head_len;
+	int payload; /* Reading payload of frame rather than its header */
+	int opcode;
+	uint64_t left; /* Payload bytes of frame still to come */
+	uint8_t mask[4];
+	int mask_pos;
+	uint8_t control[WS_CONTROL_MAX]; /* Payload of control frame */
+	int control_len;
+} ws_t;
+
+extern int ws_port;
+
+int ws_attach(client_t *client);
+void ws_free(client_t *client);
+ssize_t ws_input(thread_t *thread, client_t *client, uint8_t *data, size_t length);
+out_t *ws_frame(thread_t *thread, client_t *client, out_t *out);
+
+#endif
@@ -1,26 +1,207 @@
 #ifndef ZMR_H_
 #define ZMR_H_
 
-#include "packet.h"
-#include "zmr/ht.h"
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
-#define TABLE_SIZE (MAX_CLIENTS_PER_THREAD * 2)
+#include "packet.h"
+#include "zmr/pool.h"
+#include "zmr/metrics.h"
+#include "zmr/timer.h"
 
 #define MAX_CONNECTION_QUEUE 128 /* for listen() */
 #define MAX_EVENTS 64 /* Max events can be returned simulataneouly by epoll */
-#define MAX_THREADS 8
-#define MAX_CLIENTS_PER_THREAD 1024
+#define MAX_CLIENTS_PER_THREAD 1024 /* Default, -c changes it */
+
+#define HANDSHAKE_TIMEOUT 10 /* Seconds a client has to answer the challenge */
+#define IDLE_TIMEOUT 300 /* Default seconds of silence before client is pinged, -i changes it */
+#define PING_TIMEOUT 30 /* Seconds a pinged client has to send anything */
+#define KEEPALIVE_PROBES 3 /* TCP keepalive probes of a silent v1 client */
+#define RATE_TICK 1000 /* epoll_wait timeout (ms) at most while packet rate is measured */
+#define FLUSH_IOV 64 /* Queued frames written by one writev */
+#define OUT_QUEUE_LIMIT (1024 * 1024) /* Default bytes queued before slow client is dropped */
+
+/*
+ * Load of a thread in packets per second, connections and queued bytes are
+ * converted to it. New connections go to the least loaded thread and a
+ * thread well above it hands some of its clients over.
+ */
+#define LOAD_CLIENT 10 /* An idle connection costs as much as this many packets/s */
+#define LOAD_QUEUE_UNIT 4096 /* Queued bytes costing as much as a packet/s */
+#define LOAD_MARGIN (LOAD_CLIENT * 8) /* Load above least loaded thread that is fine */
+#define LOAD_RATIO 150 /* Percent of least loaded thread's load making a hotspot */
+#define REBALANCE_INTERVAL 1 /* Seconds between packet rate updates and rebalancing */
+#define REBALANCE_HOT 2 /* Intervals thread has to stay a hotspot to hand clients over */
+#define REBALANCE_BATCH 64 /* Clients handed over at a time */
+#define MOVE_TICK 10 /* epoll_wait timeout (ms) while clients wait to be handed over */
+#define FORWARD_TICK 100 /* ms between batches of stored frames forwarded to another node */
+
+/* Per-connection receive buffer, room for a full frame plus pipelined ones */
+#define RECV_BUFFER_SIZE (MAX_FRAME_SIZE * 2)
+/* Frames built by server, challenge and status, come from a smaller pool */
+#define SMALL_BUFFER_SIZE 128
+
+enum {
+	CLIENT_CHALLENGE, /* Accepted, not taken over by its thread yet */
+	CLIENT_HANDSHAKE, /* Challenge sent, waiting for signed response */
+	CLIENT_AUTHORISED, /* Relaying packets */
+	CLIENT_MOVING, /* Being handed to thread tid, old owner only writes */
+	CLIENT_LINK, /* Data link between nodes */
+	CLIENT_CLOSED /* Dropped, waiting to be freed */
+};
+
+struct client_t;
+
+/* Token buckets of packets and bytes, as the time (ns) each is full again */
+typedef struct {
+	uint64_t packets;
+	uint64_t bytes;
+} bucket_t;
 
+/* Refcounted block of received bytes, frames are relayed straight from it */
 typedef struct {
+	int refs; /* Receiving client plus every queued frame inside it */
+	size_t size;
+	uint8_t data[];
+} buf_t;
+
+typedef struct out_t {
+	struct out_t *next;
+	struct client_t *client; /* Recipient while frame is in a thread's inbox */
+	buf_t *buf; /* Block holding the frame, referenced until it is written */
+	uint8_t *data; /* Complete frame inside buf */
+	size_t length;
+	size_t sent; /* Bytes of data already written */
+	int status; /* Result of signature check done by a verifier */
+	uint64_t stamp; /* When message was received, 0 for frames built by server */
+	struct mail_t *mail; /* Stored frame, only delivered once it was written */
+} out_t;
+
+typedef struct client_t {
 	int fd; /* File descriptor for client socket */
+	int tid; /* Thread owning connection, only it reads or writes fd, changed
+			  * atomically when client is handed over */
+	int state; /* Handshake state */
+	int version; /* Protocol version of frames queued for client */
 	char username[MAX_NAME * 2 + 1]; /* Username of client */
+	uint8_t pk[PK_SIZE]; /* Binary public key, key of the directory */
+	uint8_t challenge[CHALLENGE_SIZE]; /* Challenge client has to sign */
+	buf_t *rbuf; /* Received bytes, frames before rstart are handled */
+	size_t rstart;
+	size_t rlen;
+	timeout_t timer; /* Handshake deadline or idle check, in owner's wheel */
+	uint64_t active; /* Tick anything was last received */
+	uint64_t pinged; /* Tick ping was sent, 0 if client answered since */
+	bucket_t bucket; /* Rate limits of connection */
+	struct limit_t *limit; /* Rate limits shared by user's connections */
+	int throttled; /* Over a limit, not read until throttle goes off */
+	timeout_t throttle;
+	uint8_t *held; /* Received by io_uring while throttled, not handled yet */
+	size_t held_len;
+	int receiving; /* io_uring receive armed */
+	out_t *out_head; /* Frames waiting to be written */
+	out_t *out_tail;
+	size_t out_bytes;
+	int dirty; /* In thread's list of queues to flush */
+	struct client_t *dirty_next;
+	struct client_t *accept_next; /* Thread's list of accepted clients */
+	int ops; /* io_uring requests in flight, client is released once 0 */
+	int sending; /* io_uring write in flight */
+	struct mail_t *mail; /* Stored frames not queued yet, oldest first */
+	int verifier; /* Verifier checking its messages, -1 until first one */
+	int packets; /* Frames received since last rebalancing */
+	uint64_t moved; /* Directory epoch at which new owner was published */
+	struct client_t *move_next; /* Thread's list of clients being handed over */
+	out_t *parked; /* Frames new owner got before handover, in order */
+	out_t *parked_tail;
+	int link; /* LINK_NONE unless connection is a data link to or from a peer */
+	int peer; /* Peer of outbound link */
+	uint8_t route[PK_SIZE]; /* Recipient of the next frame on inbound link */
+	int routed;
+	struct client_t *auth_next; /* Thread's list of authorised clients */
+	struct client_t **auth_pprev;
+	struct resume_t *resume; /* Handed over by replaced process until started */
+	struct ws_t *ws; /* WebSocket framing, NULL for native clients */
 } client_t;
 
-typedef struct {
+#include "zmr/ht.h"
+
+enum {
+	BACKEND_EPOLL,
+	BACKEND_URING
+};
+
+struct uring_t;
+
+typedef struct thread_t {
+	int id; /* Index in threads */
+	int cpu; /* CPU thread is pinned to, -1 if not pinned */
 	int epoll_fd; /* epoll instance for each thread */
 	pthread_t thread; /* POSIX thread */
-	pthread_mutex_t message_lock;
-	client_t *table[TABLE_SIZE]; /* Active clients */
+	int num_clients; /* Connections owned by thread, updated atomically */
+	wheel_t wheel; /* Timeouts of clients */
+	client_t *accepted; /* New clients from accept loop, lock-free stack */
+	struct uring_t *ring; /* io_uring state, NULL with epoll backend */
+	int event_fd; /* Wakes thread up when frames are handed to it */
+	int listen_fd; /* Own SO_REUSEPORT listener, -1 if main thread accepts */
+	out_t *inbox; /* Frames from other threads, lock-free stack */
+	out_t *verified; /* Checked frames back from verifiers, lock-free stack */
+	client_t *dirty; /* Clients with new frames queued this round */
+	pool_t rbufs; /* Receive buffers */
+	pool_t smalls; /* Buffers of frames built by server */
+	pool_t outs; /* Queue entries */
+	pool_t fanout_pool; /* Channel fan-outs */
+	hashtable_t table; /* Active clients, allocated by thread itself */
+	client_t *authorised; /* Every authorised client, table only has the
+						   * newest connection of a user */
+	int frozen; /* Authorised clients aren't read during an upgrade */
+	int rate; /* Packets received per second, threads handing clients over add
+			   * theirs until it is measured again */
+	uint64_t rate_packets; /* packets_in at last rate update */
+	time_t rate_time;
+	int hot; /* Rate updates in a row thread was a hotspot */
+	client_t *moving; /* Clients handed to other threads after a grace period */
+	client_t *migrated; /* Clients handed over by other threads, lock-free stack */
+	struct fanout_t *fanouts; /* Channel frames being fanned out, oldest first */
+	struct fanout_t *fanouts_tail;
+	client_t **links; /* Outbound data link to each peer, NULL while down */
+	struct presence_t *forwards; /* Users with stored frames who connected to
+								  * another node, lock-free stack */
+	uint64_t forward_time; /* When last batch of them was forwarded */
+	metrics_t metrics; /* Only written by thread itself */
 } thread_t;
 
+extern thread_t *threads;
+extern int num_threads;
+extern int max_clients;
+extern size_t max_queue;
+extern int idle_timeout;
+
+void mark_dirty(thread_t *thread, client_t *client);
+void enqueue(thread_t *thread, client_t *client, out_t *out);
+void send_status(thread_t *thread, client_t *client, uint8_t status);
+void reply_status(thread_t *thread, client_t *client, uint8_t status, uint64_t id);
+void flush_client(thread_t *thread, client_t *client);
+int send_challenge(thread_t *thread, client_t *client);
+int route_to(thread_t *thread, uint8_t *to, out_t *out);
+void drop_client(thread_t *thread, client_t *client);
+void release_client(thread_t *thread, client_t *client);
+void start_client(thread_t *thread, client_t *client);
+int client_paused(thread_t *thread, client_t *client);
+void freeze_thread(thread_t *thread);
+void thaw_thread(thread_t *thread);
+int feed_client(thread_t *thread, client_t *client, uint8_t *data, size_t length);
+int append_client(thread_t *thread, client_t *client, uint8_t *data, size_t length);
+void throttle_client(thread_t *thread, client_t *client, uint64_t wait);
+client_t *take_accepted(thread_t *thread);
+long thread_load(thread_t *thread);
+int round_timeout(thread_t *thread);
+void start_round(thread_t *thread);
+client_t *new_client(int clientfd, int tid);
+client_t *accept_client(thread_t *thread, int clientfd);
+void accept_push(thread_t *thread, client_t *client);
+int pick_thread(int clientfd);
+void finish_round(thread_t *thread);
+void print_pools(void);
+
 #endif
@@ -0,0 +1,237 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/ht.h"
+
+/*
+ * Microbenchmark of the per-thread client table against the fixed size table
+ * keyed on hex usernames it replaced
+ */
+
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_ROUNDS 200
+#define OLD_TABLE_SIZE (MAX_CLIENTS_PER_THREAD * 2)
+
+/*
+ * Previous implementation, kept as the baseline
+ */
+static unsigned int old_hash(char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	int length = strnlen(name, MAX_NAME * 2 + 1);
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+
+	return hash % OLD_TABLE_SIZE;
+}
+
+static int old_add(client_t **hash_table, client_t *p)
+{
+	int index = old_hash(p->username);
+	int initial_index = index;
+
+	while (hash_table[index] != NULL) {
+		index = (index + 1) % OLD_TABLE_SIZE;
+		if (index == initial_index) return 1;
+	}
+
+	hash_table[index] = p;
+	return 0;
+}
+
+static client_t *old_search(client_t **hash_table, char *username)
+{
+	int index = old_hash(username);
+	int initial_index = index;
+
+	while (hash_table[index] != NULL) {
+		if (strncmp(hash_table[index]->username, username, MAX_NAME * 2 + 1) == 0)
+			return hash_table[index];
+		index = (index + 1) % OLD_TABLE_SIZE;
+		if (index == initial_index) break;
+	}
+
+	return NULL;
+}
+
+static int old_remove(client_t **hash_table, char *username)
+{
+	int index = old_hash(username);
+	int initial_index = index;
+
+	while (hash_table[index] != NULL) {
+		if (strncmp(hash_table[index]->username, username, MAX_NAME * 2 + 1) == 0) {
+			hash_table[index] = NULL;
+
+			int next_index = (index + 1) % OLD_TABLE_SIZE;
+			while (hash_table[next_index] != NULL) {
+				client_t *temp = hash_table[next_index];
+				hash_table[next_index] = NULL;
+				old_add(hash_table, temp);
+				next_index = (next_index + 1) % OLD_TABLE_SIZE;
+			}
+
+			return 1;
+		}
+		index = (index + 1) % OLD_TABLE_SIZE;
+		if (index == initial_index) break;
+	}
+
+	return 0;
+}
+
+static int old_length(client_t **hash_table)
+{
+	int length = 0;
+	for (int i = 0; i < OLD_TABLE_SIZE; i++) {
+		if (hash_table[i] != NULL) {
+			length++;
+		}
+	}
+	return length;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Keeps results alive so lookups aren't optimised out */
+static volatile size_t sink;
+
+typedef struct {
+	double add;
+	double hit;
+	double miss;
+	double length;
+	double remove;
+} result_t;
+
+static void run_old(client_t *clients, client_t *absent, int n, int rounds,
+		result_t *r)
+{
+	client_t **table = memalloc(OLD_TABLE_SIZE * sizeof(client_t *));
+	for (int round = 0; round < rounds; round++) {
+		for (int i = 0; i < OLD_TABLE_SIZE; i++)
+			table[i] = NULL;
+		double start = now();
+		for (int i = 0; i < n; i++)
+			old_add(table, &clients[i]);
+		r->add += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			sink += old_search(table, clients[i].username) != NULL;
+		r->hit += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			sink += old_search(table, absent[i].username) != NULL;
+		r->miss += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			sink += old_length(table);
+		r->length += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			old_remove(table, clients[i].username);
+		r->remove += now() - start;
+	}
+	free(table);
+}
+
+static void run_new(client_t *clients, client_t *absent, int n, int rounds,
+		result_t *r)
+{
+	hashtable_t table;
+	for (int round = 0; round < rounds; round++) {
+		/* Starts small so growing is part of the cost */
+		hashtable_init(&table, HT_MIN_SIZE);
+		double start = now();
+		for (int i = 0; i < n; i++)
+			hashtable_add(&table, &clients[i]);
+		r->add += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			sink += hashtable_search(&table, clients[i].pk) != NULL;
+		r->hit += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			sink += hashtable_search(&table, absent[i].pk) != NULL;
+		r->miss += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			sink += hashtable_length(&table);
+		r->length += now() - start;
+
+		start = now();
+		for (int i = 0; i < n; i++)
+			hashtable_remove(&table, &clients[i]);
+		r->remove += now() - start;
+		free(table.tags);
+		free(table.slots);
+	}
+}
+
+static void print_result(char *name, result_t *r, double ops)
+{
+	printf("%-4s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, r->add / ops,
+			r->hit / ops, r->miss / ops, r->length / ops, r->remove / ops);
+}
+
+int main(int argc, char **argv)
+{
+	int n = DEFAULT_CLIENTS;
+	int rounds = DEFAULT_ROUNDS;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+			default:
+				error(1, "Usage: %s [-n clients] [-r rounds]", argv[0]);
+		}
+	}
+	if (n <= 0 || rounds <= 0) {
+		error(1, "Clients and rounds must be positive");
+	}
+
+	/* Clients present in the table and ones looked up but never added */
+	client_t *clients = memalloc(n * 2 * sizeof(client_t));
+	if (!clients) return 1;
+	memset(clients, 0, n * 2 * sizeof(client_t));
+	for (int i = 0; i < n * 2; i++) {
+		randombytes_buf(clients[i].pk, PK_SIZE);
+		sodium_bin2hex(clients[i].username, sizeof(clients[i].username),
+				clients[i].pk, PK_SIZE);
+	}
+
+	result_t old = {0}, new = {0};
+	double ops = (double) n * rounds;
+	printf("clients %d rounds %d, ns per operation\n", n, rounds);
+	printf("%-4s %10s %10s %10s %10s %10s\n", "", "add", "hit", "miss",
+			"length", "remove");
+	/* Old table can't hold more than OLD_TABLE_SIZE clients */
+	if (n < OLD_TABLE_SIZE) {
+		run_old(clients, clients + n, n, rounds, &old);
+		print_result("old", &old, ops);
+	}
+	run_new(clients, clients + n, n, rounds, &new);
+	print_result("new", &new, ops);
+	free(clients);
+	return 0;
+}
@@ -0,0 +1,639 @@
+#include "packet.h"
+#include "key.h"
+#include "util.h"
+
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/*
+ * Load generator for zmr
+ * Simulated clients authenticate like zen and send signed messages to their
+ * peers, either at a fixed rate each or, with rate 0, as soon as one of
+ * their messages came back. Delivery latency is measured on the receiving
+ * side from the time stored when the message was sent.
+ *
+ * Signing is kept off the measured path: every client signs a ring of
+ * messages up front and sends them in turn. A slot is only reused once its
+ * message was delivered, data carries sender and slot so the receiver finds
+ * the send time.
+ *
+ * With channel peers clients are grouped into channels owned by the first
+ * client of each group, every message is fanned out to the rest of the group
+ * and each delivery counts on its own.
+ */
+
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_THREADS 4
+#define DEFAULT_SECONDS 10
+#define DEFAULT_PAYLOAD 256
+#define DEFAULT_RATE 10 /* Messages per second per client */
+#define DEFAULT_WINDOW 1 /* Messages in flight per client with rate 0 */
+#define DEFAULT_GROUP 8 /* Members of a channel */
+#define RING_SIZE 16 /* Presigned messages per client */
+#define SEND_FRAMES 8 /* Frames a client may have waiting for the socket */
+#define TICK_MS 1 /* Resolution of fixed rate sending */
+#define DRAIN_MS 500 /* Receiving goes on this long after sending stopped */
+#define MAX_EVENTS 256
+#define STAMP_SIZE (2 * sizeof(uint32_t)) /* Sender index and slot */
+#define CHANNEL_ADD 1 /* Membership op, as in zmr/channel.h */
+
+/* Log-linear latency histogram, same bucketing as zmr's metrics */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+enum {
+	PEERS_PAIR, /* Client 2k talks to 2k + 1 only */
+	PEERS_RANDOM, /* Every message of the ring goes to a random client */
+	PEERS_CHANNEL /* Every message goes to the channel of client's group */
+};
+
+typedef struct {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct {
+	int fd; /* -1 once connection failed */
+	uint32_t index;
+	keypair_t kp;
+	uint8_t *ring; /* RING_SIZE presigned frames of frame_len bytes */
+	uint64_t sent[RING_SIZE]; /* Send time of slot, 0 once delivered */
+	uint32_t pending[RING_SIZE]; /* Channel members yet to get slot */
+	uint32_t next; /* Slot sent next */
+	uint64_t scheduled; /* Messages due so far at fixed rate */
+	double phase; /* Spreads sends of clients over a period */
+	uint8_t *rbuf;
+	size_t rlen;
+	uint8_t *wbuf;
+	size_t wstart;
+	size_t wlen;
+} bench_client_t;
+
+typedef struct {
+	pthread_t thread;
+	int id;
+	int epoll_fd;
+	int first; /* Clients [first, first + count) belong to worker */
+	int count;
+	hist_t latency;
+	uint64_t sent;
+	uint64_t delivered;
+	uint64_t skipped; /* Slot still in flight or socket full */
+	uint64_t errors;
+} worker_t;
+
+static char *host = "127.0.0.1";
+static int ports[2] = { PORT, PORT }; /* First and second client of each pair */
+static int num_clients = DEFAULT_CLIENTS;
+static int seconds = DEFAULT_SECONDS;
+static size_t payload = DEFAULT_PAYLOAD;
+static double rate = DEFAULT_RATE;
+static int window = DEFAULT_WINDOW;
+static int peers = PEERS_PAIR;
+static int group = DEFAULT_GROUP;
+static size_t frame_len;
+static bench_client_t *clients;
+static pthread_barrier_t ready;
+static uint64_t start_ns; /* Set once every client is connected */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t value)
+{
+	if (value < 2 * HIST_SUB) return value;
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+static uint64_t hist_value(int bucket)
+{
+	if (bucket < 2 * HIST_SUB) return bucket;
+	int shift = bucket / HIST_SUB - 1;
+	uint64_t sub = bucket % HIST_SUB + HIST_SUB;
+	return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(hist_t *hist, uint64_t ns)
+{
+	hist->buckets[hist_bucket(ns)]++;
+	hist->count++;
+	if (ns > hist->max) hist->max = ns;
+}
+
+static uint64_t hist_quantile(hist_t *hist, double q)
+{
+	if (hist->count == 0) return 0;
+	uint64_t rank = (uint64_t) (q * hist->count + 0.5);
+	if (rank == 0) rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			uint64_t value = hist_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+/*
+ * Owner of the channel client is a member of, its key is the channel id
+ */
+static bench_client_t *group_owner(bench_client_t *client)
+{
+	return &clients[client->index - client->index % group];
+}
+
+/*
+ * Connect and answer server's challenge like authenticate_server() in zen
+ */
+static int bench_connect(bench_client_t *client)
+{
+	client->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (client->fd < 0) return -1;
+	int nodelay = 1;
+	setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(ports[client->index % 2]);
+	inet_pton(AF_INET, host, &server_addr.sin_addr);
+	if (connect(client->fd, (struct sockaddr *) &server_addr,
+				sizeof(server_addr)) < 0) {
+		return -1;
+	}
+
+	packet_t pkt;
+	if (recv_packet(&pkt, client->fd) != ZSM_STA_SUCCESS) return -1;
+	if (pkt.type != ZSM_TYP_AUTH || pkt.length != CHALLENGE_SIZE) {
+		clear_packet(&pkt);
+		return -1;
+	}
+	uint8_t sig[SIGN_SIZE], pk[SIGN_SIZE];
+	crypto_sign_detached(sig, NULL, pkt.data, CHALLENGE_SIZE, client->kp.sk);
+	clear_packet(&pkt);
+
+	/* Public key padded to size of signature like zen does */
+	memset(pk, 0, sizeof(pk));
+	memcpy(pk, client->kp.pk, PK_SIZE);
+	pkt.type = ZSM_TYP_AUTH;
+	pkt.length = SIGN_SIZE;
+	pkt.data = pk;
+	pkt.signature = sig;
+	if (send_packet(&pkt, client->fd) != ZSM_STA_SUCCESS) return -1;
+
+	if (recv_packet(&pkt, client->fd) != ZSM_STA_SUCCESS) return -1;
+	clear_packet(&pkt);
+	if (pkt.type != ZSM_STA_AUTHORISED) return -1;
+
+	int flags = fcntl(client->fd, F_GETFL, 0);
+	return fcntl(client->fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Create channel of owner's group by adding every other member, waiting for
+ * each to be answered
+ */
+static int bench_channel(bench_client_t *owner)
+{
+	uint8_t data[MAX_NAME * 2 + 1 + PK_SIZE];
+	memcpy(data, owner->kp.pk, MAX_NAME);
+	memcpy(data + MAX_NAME, owner->kp.pk, MAX_NAME);
+	data[MAX_NAME * 2] = CHANNEL_ADD;
+	for (int i = 1; i < group; i++) {
+		memcpy(data + MAX_NAME * 2 + 1, clients[owner->index + i].kp.pk, PK_SIZE);
+		packet_t pkt;
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.type = ZSM_TYP_CHANNEL;
+		pkt.length = sizeof(data);
+		pkt.data = data;
+		pkt.signature = create_signature(data, sizeof(data), owner->kp.sk);
+		if (!pkt.signature) return -1;
+		int status = send_packet(&pkt, owner->fd);
+		free(pkt.signature);
+		if (status != ZSM_STA_SUCCESS) return -1;
+
+		if (recv_packet(&pkt, owner->fd) != ZSM_STA_SUCCESS) return -1;
+		clear_packet(&pkt);
+		if (pkt.type != ZSM_STA_SUCCESS) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sign every message of client's ring
+ */
+static int bench_ring(bench_client_t *client, unsigned int *seed)
+{
+	uint32_t length = MAX_NAME * 2 + payload;
+	client->ring = memalloc(RING_SIZE * frame_len);
+	if (!client->ring) return -1;
+
+	for (uint32_t slot = 0; slot < RING_SIZE; slot++) {
+		uint32_t peer = client->index ^ 1;
+		if (peers == PEERS_RANDOM) {
+			do {
+				peer = rand_r(seed) % num_clients;
+			} while (peer == client->index);
+		}
+		uint8_t *frame = client->ring + slot * frame_len;
+		uint8_t *data = frame + PACKET_HEADER_SIZE;
+		frame[0] = peers == PEERS_CHANNEL ? ZSM_TYP_CHANNEL_MESSAGE :
+			ZSM_TYP_MESSAGE;
+		memcpy(&frame[sizeof(uint8_t)], &length, sizeof(length));
+		memcpy(data, client->kp.pk, MAX_NAME);
+		/* Channel message carries channel id where the recipient goes */
+		memcpy(data + MAX_NAME, peers == PEERS_CHANNEL ?
+				group_owner(client)->kp.pk : clients[peer].kp.pk, MAX_NAME);
+		memcpy(data + MAX_NAME * 2, &client->index, sizeof(uint32_t));
+		memcpy(data + MAX_NAME * 2 + sizeof(uint32_t), &slot, sizeof(uint32_t));
+		randombytes_buf(data + MAX_NAME * 2 + STAMP_SIZE, payload - STAMP_SIZE);
+
+		uint8_t *signature = create_signature(data, length, client->kp.sk);
+		if (!signature) return -1;
+		memcpy(data + length, signature, SIGN_SIZE);
+		free(signature);
+	}
+	return 0;
+}
+
+static void bench_close(worker_t *worker, bench_client_t *client)
+{
+	if (client->fd < 0) return;
+	worker->errors++;
+	close(client->fd);
+	client->fd = -1;
+}
+
+/*
+ * Write as much of client's pending frames as socket takes
+ */
+static void bench_flush(worker_t *worker, bench_client_t *client)
+{
+	while (client->fd >= 0 && client->wstart < client->wlen) {
+		ssize_t n = send(client->fd, client->wbuf + client->wstart,
+				client->wlen - client->wstart, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) bench_close(worker, client);
+			return;
+		}
+		client->wstart += n;
+	}
+	client->wstart = client->wlen = 0;
+}
+
+/*
+ * Send next message of ring, skipped if it is still in flight from the
+ * previous round or too much is waiting for the socket
+ */
+static void bench_send(worker_t *worker, bench_client_t *client)
+{
+	uint32_t slot = client->next % RING_SIZE;
+	if (client->fd < 0 ||
+			__atomic_load_n(&client->sent[slot], __ATOMIC_ACQUIRE) != 0 ||
+			client->wlen + frame_len > SEND_FRAMES * frame_len) {
+		worker->skipped++;
+		return;
+	}
+	if (client->wstart > 0) {
+		memmove(client->wbuf, client->wbuf + client->wstart,
+				client->wlen - client->wstart);
+		client->wlen -= client->wstart;
+		client->wstart = 0;
+	}
+	memcpy(client->wbuf + client->wlen, client->ring + slot * frame_len, frame_len);
+	client->wlen += frame_len;
+	if (peers == PEERS_CHANNEL) {
+		__atomic_store_n(&client->pending[slot], group - 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&client->sent[slot], now_ns(), __ATOMIC_RELEASE);
+	client->next++;
+	worker->sent++;
+	bench_flush(worker, client);
+}
+
+/*
+ * Take latency of one received frame, with rate 0 answer it
+ */
+static void bench_frame(worker_t *worker, bench_client_t *client,
+		uint8_t *frame, int sending)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, frame);
+	int type = peers == PEERS_CHANNEL ? ZSM_TYP_CHANNEL_MESSAGE :
+		ZSM_TYP_MESSAGE;
+	if (pkt.type != type || pkt.length < MAX_NAME * 2 + STAMP_SIZE) {
+		worker->errors++;
+		return;
+	}
+	uint32_t index, slot;
+	memcpy(&index, pkt.data + MAX_NAME * 2, sizeof(uint32_t));
+	memcpy(&slot, pkt.data + MAX_NAME * 2 + sizeof(uint32_t), sizeof(uint32_t));
+	if (index >= (uint32_t) num_clients || slot >= RING_SIZE) {
+		worker->errors++;
+		return;
+	}
+	uint64_t sent;
+	if (peers == PEERS_CHANNEL) {
+		/* Slot is free again once the last member got it */
+		sent = __atomic_load_n(&clients[index].sent[slot], __ATOMIC_ACQUIRE);
+		if (sent != 0 && __atomic_sub_fetch(&clients[index].pending[slot], 1,
+					__ATOMIC_ACQ_REL) == 0) {
+			__atomic_store_n(&clients[index].sent[slot], 0, __ATOMIC_RELEASE);
+		}
+	} else {
+		sent = __atomic_exchange_n(&clients[index].sent[slot], 0,
+				__ATOMIC_ACQ_REL);
+	}
+	if (sent == 0) {
+		worker->errors++;
+		return;
+	}
+	hist_record(&worker->latency, now_ns() - sent);
+	worker->delivered++;
+	if (sending && rate == 0) bench_send(worker, client);
+}
+
+/*
+ * Read everything socket has and handle the complete frames
+ */
+static void bench_read(worker_t *worker, bench_client_t *client, int sending)
+{
+	while (client->fd >= 0) {
+		ssize_t n = recv(client->fd, client->rbuf + client->rlen,
+				frame_len * 2 - client->rlen, 0);
+		if (n == 0) {
+			bench_close(worker, client);
+			return;
+		} else if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) bench_close(worker, client);
+			return;
+		}
+		client->rlen += n;
+
+		size_t start = 0, length;
+		int status;
+		while ((status = parse_frame(client->rbuf + start, client->rlen - start,
+						&length)) == ZSM_STA_SUCCESS) {
+			bench_frame(worker, client, client->rbuf + start, sending);
+			start += length;
+		}
+		if (status != ZSM_STA_READING_SOCKET) {
+			bench_close(worker, client);
+			return;
+		}
+		memmove(client->rbuf, client->rbuf + start, client->rlen - start);
+		client->rlen -= start;
+	}
+}
+
+void *bench_worker(void *arg)
+{
+	worker_t *worker = arg;
+	unsigned int seed = worker->id + time(NULL);
+	int failed = 0;
+
+	for (int i = worker->first; i < worker->first + worker->count; i++) {
+		bench_client_t *client = &clients[i];
+		client->rbuf = memalloc(frame_len * 2);
+		client->wbuf = memalloc(SEND_FRAMES * frame_len);
+		client->phase = (double) rand_r(&seed) / RAND_MAX;
+		if (!client->rbuf || !client->wbuf || bench_ring(client, &seed) != 0 ||
+				bench_connect(client) != 0 || (peers == PEERS_CHANNEL &&
+					group_owner(client) == client && bench_channel(client) != 0)) {
+			failed++;
+			if (client->fd >= 0) close(client->fd);
+			client->fd = -1;
+			continue;
+		}
+		struct epoll_event event;
+		event.data.ptr = client;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+	}
+	worker->errors += failed;
+	/* Messages to clients not connected yet would go to the mailbox */
+	pthread_barrier_wait(&ready);
+	pthread_barrier_wait(&ready);
+
+	uint64_t end = start_ns + (uint64_t) seconds * 1000000000;
+	uint64_t drained = end + (uint64_t) DRAIN_MS * 1000000;
+	if (rate == 0) {
+		for (int i = worker->first; i < worker->first + worker->count; i++) {
+			for (int j = 0; j < window; j++)
+				bench_send(worker, &clients[i]);
+		}
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	while (1) {
+		uint64_t now = now_ns();
+		if (now >= drained) break;
+		int sending = now < end;
+		if (sending && rate > 0) {
+			double elapsed = (now - start_ns) / 1e9;
+			for (int i = worker->first; i < worker->first + worker->count; i++) {
+				bench_client_t *client = &clients[i];
+				uint64_t due = (uint64_t) (elapsed * rate + client->phase);
+				while (client->scheduled < due) {
+					client->scheduled++;
+					bench_send(worker, client);
+				}
+			}
+		}
+
+		int timeout = sending && rate > 0 ? TICK_MS : DRAIN_MS / 10;
+		int nfds = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+		for (int i = 0; i < nfds; i++) {
+			bench_client_t *client = events[i].data.ptr;
+			if (events[i].events & EPOLLOUT) bench_flush(worker, client);
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				bench_read(worker, client, sending);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Clients may need more descriptors than the default soft limit
+ */
+static void raise_fd_limit(void)
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+	if (limit.rlim_cur < (rlim_t) num_clients + 64) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int num_workers = DEFAULT_THREADS;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:g:h:n:p:P:r:s:t:w:")) != -1) {
+		switch (opt) {
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			case 'g':
+				group = atoi(optarg);
+				break;
+			case 'h':
+				host = optarg;
+				break;
+			case 'n':
+				num_clients = atoi(optarg);
+				break;
+			case 'p':
+				if (strcmp(optarg, "pair") == 0) {
+					peers = PEERS_PAIR;
+				} else if (strcmp(optarg, "random") == 0) {
+					peers = PEERS_RANDOM;
+				} else if (strcmp(optarg, "channel") == 0) {
+					peers = PEERS_CHANNEL;
+				} else {
+					error(1, "Unknown peers %s, use pair, random or channel", optarg);
+				}
+				break;
+			case 'P':
+				/* Second port puts the peers of a pair on another node */
+				if (sscanf(optarg, "%d:%d", &ports[0], &ports[1]) == 1) {
+					ports[1] = ports[0];
+				}
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 's':
+				payload = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				num_workers = atoi(optarg);
+				break;
+			case 'w':
+				window = atoi(optarg);
+				break;
+			default:
+				error(1, "Usage: %s [-h host] [-P port[:peer_port]] [-n clients] "
+						"[-t threads] [-d seconds] [-s payload] [-r rate_per_client|0] "
+						"[-w window] [-p pair|random|channel] [-g channel_members]", argv[0]);
+		}
+	}
+	if (sodium_init() < 0) {
+		error(1, "Error initializing libsodium");
+	}
+	if (num_clients < 2 || num_clients % 2 != 0) {
+		error(1, "Number of clients must be even and at least 2");
+	}
+	if (ports[0] <= 0 || ports[0] > 65535 || ports[1] <= 0 || ports[1] > 65535) {
+		error(1, "Ports must be between 1 and 65535");
+	}
+	if (num_workers <= 0 || seconds <= 0 || rate < 0) {
+		error(1, "Threads and seconds must be positive, rate not negative");
+	}
+	if (peers == PEERS_CHANNEL && (group < 2 || num_clients % group != 0)) {
+		error(1, "Channel members must be at least 2 and divide clients");
+	}
+	if (window <= 0 || window > RING_SIZE) {
+		error(1, "Window must be between 1 and %d", RING_SIZE);
+	}
+	if (rate == 0 && peers != PEERS_PAIR) {
+		/* Answers go back to the peer, which is only fixed in pairs */
+		error(1, "Rate 0 needs pair peers");
+	}
+	if (payload < STAMP_SIZE || payload > MAX_DATA_LENGTH - MAX_NAME * 2) {
+		error(1, "Payload must be between %zu and %d bytes", STAMP_SIZE,
+				MAX_DATA_LENGTH - MAX_NAME * 2);
+	}
+	frame_len = PACKET_HEADER_SIZE + MAX_NAME * 2 + payload + SIGN_SIZE;
+	if (num_workers > num_clients / 2) num_workers = num_clients / 2;
+	raise_fd_limit();
+
+	clients = memalloc(num_clients * sizeof(bench_client_t));
+	worker_t *workers = memalloc(num_workers * sizeof(worker_t));
+	if (!clients || !workers) return 1;
+	memset(clients, 0, num_clients * sizeof(bench_client_t));
+	memset(workers, 0, num_workers * sizeof(worker_t));
+	/* Every key is needed before rings addressed to them are signed */
+	for (int i = 0; i < num_clients; i++) {
+		clients[i].index = i;
+		clients[i].fd = -1;
+		crypto_sign_keypair(clients[i].kp.pk, clients[i].kp.sk);
+	}
+
+	pthread_barrier_init(&ready, NULL, num_workers + 1);
+	int pairs = num_clients / 2;
+	for (int i = 0; i < num_workers; i++) {
+		/* Both clients of a pair belong to the same worker */
+		workers[i].id = i;
+		workers[i].first = (int) ((long) pairs * i / num_workers) * 2;
+		workers[i].count = (int) ((long) pairs * (i + 1) / num_workers) * 2 -
+			workers[i].first;
+		workers[i].epoll_fd = epoll_create1(0);
+		if (workers[i].epoll_fd < 0) {
+			error(1, "Error on creating epoll instance");
+		}
+		if (pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]) != 0) {
+			error(1, "Error on creating bench thread");
+		}
+	}
+	pthread_barrier_wait(&ready);
+	start_ns = now_ns();
+	pthread_barrier_wait(&ready);
+
+	hist_t *latency = memalloc(sizeof(hist_t));
+	if (!latency) return 1;
+	memset(latency, 0, sizeof(hist_t));
+	uint64_t sent = 0, delivered = 0, skipped = 0, errors = 0;
+	for (int i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		sent += workers[i].sent;
+		delivered += workers[i].delivered;
+		skipped += workers[i].skipped;
+		errors += workers[i].errors;
+		for (int j = 0; j < HIST_BUCKETS; j++)
+			latency->buckets[j] += workers[i].latency.buckets[j];
+		latency->count += workers[i].latency.count;
+		if (workers[i].latency.max > latency->max)
+			latency->max = workers[i].latency.max;
+	}
+	for (int i = 0; i < num_clients; i++) {
+		if (clients[i].fd >= 0) close(clients[i].fd);
+		free(clients[i].ring);
+		free(clients[i].rbuf);
+		free(clients[i].wbuf);
+	}
+
+	if (peers == PEERS_CHANNEL) {
+		printf("clients %d payload %zu rate %g/s channels of %d: ", num_clients,
+				payload, rate, group);
+	} else if (rate > 0) {
+		printf("clients %d payload %zu rate %g/s %s: ", num_clients, payload,
+				rate, peers == PEERS_PAIR ? "pair" : "random");
+	} else {
+		printf("clients %d payload %zu window %d: ", num_clients, payload, window);
+	}
+	printf("%.0f messages/s, sent %llu delivered %llu skipped %llu errors %llu\n",
+			delivered / (double) seconds, (unsigned long long) sent,
+			(unsigned long long) delivered, (unsigned long long) skipped,
+			(unsigned long long) errors);
+	printf("latency us p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+			hist_quantile(latency, 0.5) / 1e3, hist_quantile(latency, 0.99) / 1e3,
+			hist_quantile(latency, 0.999) / 1e3, latency->max / 1e3);
+	free(latency);
+	free(workers);
+	free(clients);
+	return errors > 0;
+}
@@ -0,0 +1,494 @@
+#include "packet.h"
+#include "key.h"
+#include "util.h"
+#include "lz.h"
+#include "zmr/zmr.h"
+#include "zmr/ht.h"
+
+#include <sys/socket.h>
+
+/*
+ * Microbenchmarks of the hot paths of libzsm and zmr
+ * Every benchmark is run for a fixed time a few times and the median is
+ * kept. Results are written as JSON, one benchmark per line, and can be
+ * compared against such a file to flag regressions.
+ */
+
+#define DEFAULT_MIN_TIME 0.2 /* Seconds a benchmark runs per repetition */
+#define DEFAULT_REPEAT 5
+#define DEFAULT_THRESHOLD 10 /* Percent slower than baseline to be a regression */
+#define MAX_RESULTS 128
+#define TABLE_SLOTS 4096
+/* Longest content of a message zen can send */
+#define MAX_CONTENT (MAX_DATA_LENGTH - MAX_NAME * 2 - NONCE_SIZE - ADDITIONAL_SIZE - \
+		TIME_SIZE)
+
+typedef struct {
+	char name[64];
+	double ns; /* Median time of one operation */
+	uint64_t ops; /* Operations timed in that repetition */
+} result_t;
+
+/* Runs count operations, state is what the benchmark set up */
+typedef void (*bench_fn)(void *state, uint64_t count);
+
+static double min_time = DEFAULT_MIN_TIME;
+static int repeat = DEFAULT_REPEAT;
+static result_t results[MAX_RESULTS];
+static int num_results = 0;
+static char *filter = NULL;
+
+/* Keeps results alive so work isn't optimised out */
+static volatile size_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(double *) a, y = *(double *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Time fn, doubling the batch until a batch takes min_time
+ */
+static void run(char *name, bench_fn fn, void *state)
+{
+	if (filter && !strstr(name, filter)) return;
+	if (num_results == MAX_RESULTS) {
+		error(0, "Too many benchmarks, %s skipped", name);
+		return;
+	}
+
+	uint64_t count = 1;
+	double elapsed;
+	while (1) {
+		double start = now();
+		fn(state, count);
+		elapsed = now() - start;
+		if (elapsed >= min_time * 1e9 / 10 || count >= (1ull << 40)) break;
+		count *= 2;
+	}
+	/* Batch taking about min_time */
+	count = count * (min_time * 1e9 / elapsed) + 1;
+
+	double times[repeat];
+	for (int i = 0; i < repeat; i++) {
+		double start = now();
+		fn(state, count);
+		times[i] = (now() - start) / count;
+	}
+	qsort(times, repeat, sizeof(double), compare_double);
+
+	result_t *result = &results[num_results++];
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->ns = times[repeat / 2];
+	result->ops = count;
+	fprintf(stderr, "%-32s %12.1f ns\n", name, result->ns);
+}
+
+/*
+ * Packet codec over a socketpair
+ */
+typedef struct {
+	int fds[2];
+	packet_t *pkt;
+	uint8_t *frame; /* Same packet serialised, for parse_frame */
+	size_t frame_len;
+} codec_t;
+
+static void bench_roundtrip(void *state, uint64_t count)
+{
+	codec_t *codec = state;
+	for (uint64_t i = 0; i < count; i++) {
+		packet_t pkt;
+		if (send_packet(codec->pkt, codec->fds[0]) != ZSM_STA_SUCCESS ||
+				recv_packet(&pkt, codec->fds[1]) != ZSM_STA_SUCCESS) {
+			error(1, "Packet roundtrip failed");
+		}
+		sink += pkt.length;
+		clear_packet(&pkt);
+	}
+}
+
+static void bench_create(void *state, uint64_t count)
+{
+	codec_t *codec = state;
+	for (uint64_t i = 0; i < count; i++) {
+		uint8_t *data = memalloc(codec->pkt->length);
+		uint8_t *signature = memalloc(SIGN_SIZE);
+		memcpy(data, codec->pkt->data, codec->pkt->length);
+		memcpy(signature, codec->pkt->signature, SIGN_SIZE);
+		packet_t *pkt = create_packet(ZSM_TYP_MESSAGE, codec->pkt->length,
+				data, signature);
+		sink += pkt->length;
+		free_packet(pkt);
+	}
+}
+
+static void bench_parse(void *state, uint64_t count)
+{
+	codec_t *codec = state;
+	for (uint64_t i = 0; i < count; i++) {
+		size_t frame_len;
+		packet_t pkt;
+		if (parse_frame(codec->frame, codec->frame_len, &frame_len) != ZSM_STA_SUCCESS)
+			error(1, "Frame parsing failed");
+		unpack_packet(&pkt, codec->frame);
+		sink += pkt.length;
+	}
+}
+
+static void bench_sign(void *state, uint64_t count)
+{
+	codec_t *codec = state;
+	keypair_t *kp = (keypair_t *) (codec + 1);
+	for (uint64_t i = 0; i < count; i++) {
+		uint8_t *signature = create_signature(codec->pkt->data,
+				codec->pkt->length, kp->sk);
+		sink += signature[0];
+		free(signature);
+	}
+}
+
+static void bench_check(void *state, uint64_t count)
+{
+	codec_t *codec = state;
+	for (uint64_t i = 0; i < count; i++) {
+		if (check_packet(codec->pkt) != ZSM_STA_SUCCESS)
+			error(1, "Signature check failed");
+	}
+}
+
+static void bench_codec(size_t length)
+{
+	codec_t *codec = memalloc(sizeof(codec_t) + sizeof(keypair_t));
+	if (!codec) return;
+	keypair_t *kp = (keypair_t *) (codec + 1);
+	/* Socket buffer holds the largest packet, one thread can do both ends */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, codec->fds) != 0) {
+		error(1, "Error creating socketpair");
+	}
+	crypto_sign_keypair(kp->pk, kp->sk);
+
+	uint8_t *data = memalloc(length);
+	randombytes_buf(data, length);
+	memcpy(data, kp->pk, MAX_NAME);
+	codec->pkt = create_packet(ZSM_TYP_MESSAGE, length, data,
+			create_signature(data, length, kp->sk));
+
+	codec->frame_len = PACKET_HEADER_SIZE + length + SIGN_SIZE;
+	codec->frame = memalloc(codec->frame_len);
+	uint32_t length32 = length;
+	codec->frame[0] = ZSM_TYP_MESSAGE;
+	memcpy(&codec->frame[sizeof(uint8_t)], &length32, sizeof(length32));
+	memcpy(codec->frame + PACKET_HEADER_SIZE, data, length);
+	memcpy(codec->frame + PACKET_HEADER_SIZE + length, codec->pkt->signature,
+			SIGN_SIZE);
+
+	char name[64];
+	snprintf(name, sizeof(name), "packet_roundtrip/%zu", length);
+	run(name, bench_roundtrip, codec);
+	snprintf(name, sizeof(name), "packet_create_free/%zu", length);
+	run(name, bench_create, codec);
+	snprintf(name, sizeof(name), "frame_parse/%zu", length);
+	run(name, bench_parse, codec);
+	snprintf(name, sizeof(name), "sign/%zu", length);
+	run(name, bench_sign, codec);
+	snprintf(name, sizeof(name), "verify/%zu", length);
+	run(name, bench_check, codec);
+
+	close(codec->fds[0]);
+	close(codec->fds[1]);
+	free_packet(codec->pkt);
+	free(codec->frame);
+	free(codec);
+}
+
+/*
+ * Client table at a fixed load factor, it never grows or shrinks here
+ */
+typedef struct {
+	hashtable_t table;
+	client_t *clients; /* First count are in table, the rest are missing */
+	size_t count;
+	size_t next;
+} table_t;
+
+static void bench_search_hit(void *state, uint64_t count)
+{
+	table_t *t = state;
+	for (uint64_t i = 0; i < count; i++) {
+		sink += hashtable_search(&t->table, t->clients[t->next].pk) != NULL;
+		if (++t->next == t->count) t->next = 0;
+	}
+}
+
+static void bench_search_miss(void *state, uint64_t count)
+{
+	table_t *t = state;
+	for (uint64_t i = 0; i < count; i++) {
+		sink += hashtable_search(&t->table, t->clients[t->count + t->next].pk) != NULL;
+		if (++t->next == t->count) t->next = 0;
+	}
+}
+
+/* Remove and add back, so load factor stays the same */
+static void bench_remove_add(void *state, uint64_t count)
+{
+	table_t *t = state;
+	for (uint64_t i = 0; i < count; i++) {
+		hashtable_remove(&t->table, &t->clients[t->next]);
+		hashtable_add(&t->table, &t->clients[t->next]);
+		if (++t->next == t->count) t->next = 0;
+	}
+}
+
+static void bench_table(int percent)
+{
+	table_t t;
+	t.count = TABLE_SLOTS * percent / 100;
+	t.next = 0;
+	t.clients = memalloc(t.count * 2 * sizeof(client_t));
+	if (!t.clients || hashtable_init(&t.table, TABLE_SLOTS) != 0) {
+		error(1, "Error allocating table");
+	}
+	memset(t.clients, 0, t.count * 2 * sizeof(client_t));
+	for (size_t i = 0; i < t.count * 2; i++) {
+		randombytes_buf(t.clients[i].pk, PK_SIZE);
+		if (i < t.count) hashtable_add(&t.table, &t.clients[i]);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "hashtable_search_hit/%d%%", percent);
+	run(name, bench_search_hit, &t);
+	snprintf(name, sizeof(name), "hashtable_search_miss/%d%%", percent);
+	run(name, bench_search_miss, &t);
+	snprintf(name, sizeof(name), "hashtable_remove_add/%d%%", percent);
+	run(name, bench_remove_add, &t);
+
+	free(t.table.tags);
+	free(t.table.slots);
+	free(t.clients);
+}
+
+/*
+ * XChaCha20-Poly1305 of message content as send_message and receive_worker
+ * do it
+ */
+typedef struct {
+	size_t length;
+	uint8_t key[SHARED_KEY_SIZE];
+	uint8_t nonce[NONCE_SIZE];
+	uint8_t content[MAX_CONTENT];
+	uint8_t encrypted[MAX_CONTENT + ADDITIONAL_SIZE];
+	uint8_t decrypted[MAX_CONTENT];
+} aead_t;
+
+static void bench_encrypt(void *state, uint64_t count)
+{
+	aead_t *a = state;
+	for (uint64_t i = 0; i < count; i++) {
+		crypto_aead_xchacha20poly1305_ietf_encrypt(a->encrypted, NULL, a->content,
+				a->length, NULL, 0, NULL, a->nonce, a->key);
+		sink += a->encrypted[0];
+	}
+}
+
+static void bench_decrypt(void *state, uint64_t count)
+{
+	aead_t *a = state;
+	for (uint64_t i = 0; i < count; i++) {
+		if (crypto_aead_xchacha20poly1305_ietf_decrypt(a->decrypted, NULL, NULL,
+					a->encrypted, a->length + ADDITIONAL_SIZE, NULL, 0, a->nonce,
+					a->key) != 0) {
+			error(1, "Decryption failed");
+		}
+		sink += a->decrypted[0];
+	}
+}
+
+static void bench_aead(size_t length)
+{
+	aead_t *a = memalloc(sizeof(aead_t));
+	if (!a) return;
+	a->length = length;
+	randombytes_buf(a->key, sizeof(a->key));
+	randombytes_buf(a->nonce, sizeof(a->nonce));
+	randombytes_buf(a->content, length);
+	crypto_aead_xchacha20poly1305_ietf_encrypt(a->encrypted, NULL, a->content,
+			length, NULL, 0, NULL, a->nonce, a->key);
+
+	char name[64];
+	snprintf(name, sizeof(name), "aead_encrypt/%zu", length);
+	run(name, bench_encrypt, a);
+	snprintf(name, sizeof(name), "aead_decrypt/%zu", length);
+	run(name, bench_decrypt, a);
+	free(a);
+}
+
+/*
+ * Compression of content as send_message and receive_worker do it, on text
+ * repeating itself like logs do
+ */
+typedef struct {
+	size_t length;
+	size_t compressed_len;
+	uint8_t content[MAX_CONTENT];
+	uint8_t compressed[MAX_CONTENT];
+	uint8_t expanded[MAX_CONTENT];
+} compress_t;
+
+static void bench_compress(void *state, uint64_t count)
+{
+	compress_t *c = state;
+	for (uint64_t i = 0; i < count; i++) {
+		sink += compress_content(c->compressed, c->content, c->length);
+	}
+}
+
+static void bench_expand(void *state, uint64_t count)
+{
+	compress_t *c = state;
+	for (uint64_t i = 0; i < count; i++) {
+		if (expand_content(c->expanded, sizeof(c->expanded), c->compressed,
+					c->compressed_len) != (ssize_t) c->length) {
+			error(1, "Decompression failed");
+		}
+		sink += c->expanded[0];
+	}
+}
+
+static void bench_lz(size_t length)
+{
+	compress_t *c = memalloc(sizeof(compress_t));
+	if (!c) return;
+	c->length = length;
+	for (size_t i = 0; i < length; ) {
+		i += snprintf((char *) c->content + i, length - i,
+				"[INFO] request %zu served in %zu us\n", i % 97, i % 13);
+		if (i >= length) break;
+	}
+	c->compressed_len = compress_content(c->compressed, c->content, length);
+	if (c->compressed_len == 0) error(1, "Content didn't compress");
+
+	char name[64];
+	snprintf(name, sizeof(name), "lz_compress/%zu", length);
+	run(name, bench_compress, c);
+	snprintf(name, sizeof(name), "lz_expand/%zu", length);
+	run(name, bench_expand, c);
+	free(c);
+}
+
+static void write_results(FILE *out)
+{
+	fprintf(out, "{\"benchmarks\": [\n");
+	for (int i = 0; i < num_results; i++) {
+		fprintf(out, "{\"name\": \"%s\", \"ns_per_op\": %.3f, \"ops\": %llu}%s\n",
+				results[i].name, results[i].ns,
+				(unsigned long long) results[i].ops,
+				i + 1 < num_results ? "," : "");
+	}
+	fprintf(out, "]}\n");
+}
+
+/*
+ * Compare with results written earlier by write_results
+ * Returns number of benchmarks slower than baseline by more than threshold
+ */
+static int compare_results(char *path, double threshold)
+{
+	FILE *in = fopen(path, "r");
+	if (!in) {
+		error(1, "Cannot open baseline %s", path);
+	}
+	int regressions = 0;
+	char line[256];
+	fprintf(stderr, "\n%-32s %12s %12s %8s\n", "", "baseline", "now", "change");
+	while (fgets(line, sizeof(line), in)) {
+		char name[64];
+		double ns;
+		if (sscanf(line, "{\"name\": \"%63[^\"]\", \"ns_per_op\": %lf", name, &ns) != 2)
+			continue;
+		for (int i = 0; i < num_results; i++) {
+			if (strcmp(results[i].name, name) != 0) continue;
+			double change = (results[i].ns - ns) / ns * 100;
+			int regressed = change > threshold;
+			regressions += regressed;
+			fprintf(stderr, "%-32s %12.1f %12.1f %+7.1f%%%s\n", name, ns,
+					results[i].ns, change, regressed ? " REGRESSION" : "");
+		}
+	}
+	fclose(in);
+	return regressions;
+}
+
+int main(int argc, char **argv)
+{
+	char *output = NULL;
+	char *baseline = NULL;
+	double threshold = DEFAULT_THRESHOLD;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:f:o:r:t:x:")) != -1) {
+		switch (opt) {
+			case 'b':
+				baseline = optarg;
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'r':
+				repeat = atoi(optarg);
+				break;
+			case 't':
+				min_time = atof(optarg);
+				break;
+			case 'x':
+				threshold = atof(optarg);
+				break;
+			default:
+				error(1, "Usage: %s [-o results.json] [-b baseline.json] "
+						"[-x threshold_percent] [-f name_filter] [-t seconds] "
+						"[-r repetitions]", argv[0]);
+		}
+	}
+	if (repeat <= 0 || min_time <= 0) {
+		error(1, "Repetitions and time must be positive");
+	}
+	if (sodium_init() < 0) {
+		error(1, "Error initializing libsodium");
+	}
+
+	size_t sizes[] = { 64, 1024, MAX_DATA_LENGTH };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_codec(sizes[i]);
+	int loads[] = { 25, 50, 70 };
+	for (size_t i = 0; i < sizeof(loads) / sizeof(loads[0]); i++)
+		bench_table(loads[i]);
+	size_t contents[] = { 64, 1024, MAX_CONTENT };
+	for (size_t i = 0; i < sizeof(contents) / sizeof(contents[0]); i++)
+		bench_aead(contents[i]);
+	size_t texts[] = { 1024, MAX_CONTENT };
+	for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++)
+		bench_lz(texts[i]);
+
+	FILE *out = stdout;
+	if (output && !(out = fopen(output, "w"))) {
+		error(1, "Cannot write %s", output);
+	}
+	write_results(out);
+	if (out != stdout) fclose(out);
+
+	if (baseline && compare_results(baseline, threshold) > 0) {
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,362 @@
+#include <sys/eventfd.h>
+
+#include "packet.h"
+#include "util.h"
+#include "log.h"
+
+int log_level = LOG_INFO;
+
+static __thread log_ring_t *ring; /* Calling thread's, NULL until it logs */
+static log_ring_t *rings; /* Every thread's, never freed */
+static int started = 0; /* Flusher is running, lines go to rings */
+static int wake_fd = -1; /* Wakes flusher before its interval is up */
+static int out_fd = STDERR_FILENO;
+static char *out_path; /* NULL when logging to stderr */
+static size_t out_size; /* Bytes in file, it is rotated past rotate_size */
+static size_t rotate_size;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static char time_text[32]; /* Formatted time_cached, only used by flusher */
+static time_t time_cached = -1;
+
+static const char *level_name(int level)
+{
+	switch (level) {
+		case LOG_FATAL:
+			return "FATAL";
+		case LOG_ERROR:
+			return "ERROR";
+		case LOG_DEBUG:
+			return "DEBUG";
+		default:
+			return "INFO";
+	}
+}
+
+/*
+ * Write all of buf to fd, giving up on errors other than EINTR
+ */
+static void write_all(int fd, const char *buf, size_t length)
+{
+	while (length > 0) {
+		ssize_t n = write(fd, buf, length);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		buf += n;
+		length -= n;
+	}
+}
+
+/*
+ * Format line as [LEVEL] date time text into out
+ * Returns its length, which is 0 if it didn't fit
+ */
+static size_t format_line(char *out, size_t size, int level, time_t time,
+		const char *text, size_t length, char *time_buf)
+{
+	if (!time_buf) {
+		/* Flusher caches the time, others format it every time */
+		static __thread char buf[32];
+		struct tm tm;
+		localtime_r(&time, &tm);
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+		time_buf = buf;
+	}
+	int prefix = snprintf(out, size, "[%s] %s ", level_name(level), time_buf);
+	if (prefix < 0 || (size_t) prefix + length + 1 > size) return 0;
+	memcpy(out + prefix, text, length);
+	out[prefix + length] = '\n';
+	return prefix + length + 1;
+}
+
+/*
+ * Format text of a line, with the error of errsv if it isn't 0
+ */
+static size_t format_text(char *text, size_t size, int errsv, const char *fmt,
+		va_list args)
+{
+	int length = vsnprintf(text, size, fmt, args);
+	if (length < 0) return 0;
+	if ((size_t) length >= size) length = size - 1;
+	if (errsv != 0) {
+		int n = snprintf(text + length, size - length, ": %s", strerror(errsv));
+		length = n < 0 || (size_t) n >= size - length ? size - 1 : length + n;
+	}
+	return length;
+}
+
+/*
+ * Copy bytes into ring at offset pos, wrapping around its end
+ */
+static void ring_put(log_ring_t *r, uint64_t pos, const void *src, size_t length)
+{
+	size_t start = pos % LOG_RING_SIZE;
+	size_t first = LOG_RING_SIZE - start < length ? LOG_RING_SIZE - start : length;
+	memcpy(r->data + start, src, first);
+	memcpy(r->data, (const uint8_t *) src + first, length - first);
+}
+
+static void ring_get(log_ring_t *r, uint64_t pos, void *dst, size_t length)
+{
+	size_t start = pos % LOG_RING_SIZE;
+	size_t first = LOG_RING_SIZE - start < length ? LOG_RING_SIZE - start : length;
+	memcpy(dst, r->data + start, first);
+	memcpy((uint8_t *) dst + first, r->data, length - first);
+}
+
+/*
+ * Ring of calling thread, allocated and published on its first line
+ */
+static log_ring_t *thread_ring(void)
+{
+	if (ring) return ring;
+	/* Not memalloc, it logs */
+	log_ring_t *r = malloc(sizeof(log_ring_t));
+	if (!r) return NULL;
+	memset(r, 0, sizeof(log_ring_t));
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	ring = r;
+	return r;
+}
+
+/*
+ * Append line to ring of calling thread, it is lost if the ring is full
+ */
+static void ring_push(log_ring_t *r, int level, time_t time, const char *text,
+		size_t length)
+{
+	log_entry_t entry = { length, level, time };
+	size_t need = sizeof(entry) + length;
+	/* Only this thread moves head */
+	uint64_t head = r->head;
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (head - tail + need > LOG_RING_SIZE) {
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ring_put(r, head, &entry, sizeof(entry));
+	ring_put(r, head + sizeof(entry), text, length);
+	__atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+
+	/* Errors are written right away, others wait for the interval unless
+	 * the ring is filling up */
+	if (level <= LOG_ERROR || head + need - tail > LOG_RING_SIZE / 2) {
+		uint64_t one = 1;
+		if (write(wake_fd, &one, sizeof(one)) < 0) errno = 0;
+	}
+}
+
+/*
+ * Whether line of fmt is one too many for this second
+ * Lines held back are reported once a line of the same format gets through
+ */
+static int ring_limited(log_ring_t *r, int level, const char *fmt, time_t now)
+{
+	log_limit_t *limit = &r->limits[((uintptr_t) fmt >> 4) % LOG_LIMIT_SLOTS];
+	if (limit->fmt != fmt || limit->second != now) {
+		if (limit->suppressed > 0) {
+			char text[LOG_LINE_MAX];
+			int length = snprintf(text, sizeof(text),
+					"%d more lines like \"%s\" were not logged",
+					limit->suppressed, limit->fmt);
+			if (length >= (int) sizeof(text)) length = sizeof(text) - 1;
+			if (length > 0) ring_push(r, level, now, text, length);
+		}
+		limit->fmt = fmt;
+		limit->second = now;
+		limit->count = 0;
+		limit->suppressed = 0;
+	}
+	if (++limit->count <= LOG_BURST) return 0;
+	limit->suppressed++;
+	return 1;
+}
+
+/*
+ * Log line of level, errsv is an errno whose message is appended, or 0
+ */
+void log_vwrite(int level, int errsv, const char *fmt, va_list args)
+{
+	if (level > log_level) return;
+	time_t now = time(NULL);
+	char text[LOG_LINE_MAX];
+	log_ring_t *r = NULL;
+	if (__atomic_load_n(&started, __ATOMIC_ACQUIRE)) r = thread_ring();
+	if (!r || (level == LOG_FATAL && out_path)) {
+		/* Nothing is buffered before log_open, user sees why the program
+		 * stopped */
+		char line[LOG_LINE_MAX + 64];
+		va_list copy;
+		va_copy(copy, args);
+		size_t length = format_text(text, sizeof(text), errsv, fmt, copy);
+		va_end(copy);
+		size_t line_len = format_line(line, sizeof(line), level, now, text,
+				length, NULL);
+		write_all(STDERR_FILENO, line, line_len);
+		if (r) ring_push(r, level, now, text, length);
+		return;
+	}
+	if (level > LOG_FATAL && ring_limited(r, level, fmt, now)) return;
+	size_t length = format_text(text, sizeof(text), errsv, fmt, args);
+	ring_push(r, level, now, text, length);
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	log_vwrite(level, 0, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Move file to path.1, shifting older ones up, and start a new one
+ */
+static void log_rotate(void)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	for (int i = LOG_ROTATE_KEEP - 1; i > 0; i--) {
+		snprintf(from, sizeof(from), "%s.%d", out_path, i);
+		snprintf(to, sizeof(to), "%s.%d", out_path, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", out_path);
+	rename(out_path, to);
+	int fd = open(out_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		close(out_fd);
+		out_fd = fd;
+	}
+	/* Keeps writing to the rotated file if a new one can't be made */
+	out_size = 0;
+	errno = 0;
+}
+
+/*
+ * Write out what every ring has, caller holds drain_lock
+ * Lines of a thread stay in order, ones of different threads are grouped
+ * by thread within a flush
+ */
+static void log_drain(void)
+{
+	static char out[LOG_RING_SIZE];
+	size_t used = 0;
+	log_ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (; r; r = r->next) {
+		uint64_t tail = r->tail;
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		char text[LOG_LINE_MAX + 128];
+		while (tail < head) {
+			log_entry_t entry;
+			ring_get(r, tail, &entry, sizeof(entry));
+			/* Writers cut lines already, text can't take more anyway */
+			size_t length = entry.length < LOG_LINE_MAX ? entry.length :
+				LOG_LINE_MAX;
+			ring_get(r, tail + sizeof(entry), text, length);
+			tail += sizeof(entry) + entry.length;
+
+			if (entry.time != time_cached) {
+				time_t time = entry.time;
+				struct tm tm;
+				localtime_r(&time, &tm);
+				strftime(time_text, sizeof(time_text), "%Y-%m-%d %H:%M:%S", &tm);
+				time_cached = entry.time;
+			}
+			if (used + LOG_LINE_MAX + 64 > sizeof(out)) {
+				write_all(out_fd, out, used);
+				out_size += used;
+				used = 0;
+			}
+			used += format_line(out + used, sizeof(out) - used, entry.level,
+					entry.time, text, length, time_text);
+		}
+		/* Thread may reuse the bytes now */
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		uint64_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0) {
+			if (used + LOG_LINE_MAX + 64 > sizeof(out)) {
+				write_all(out_fd, out, used);
+				out_size += used;
+				used = 0;
+			}
+			int length = snprintf(text, sizeof(text),
+					"%llu lines were lost, a thread logged faster than they "
+					"could be written", (unsigned long long) dropped);
+			used += format_line(out + used, sizeof(out) - used, LOG_ERROR,
+					time(NULL), text, length, NULL);
+		}
+	}
+	if (used > 0) {
+		write_all(out_fd, out, used);
+		out_size += used;
+	}
+	if (out_path && rotate_size > 0 && out_size >= rotate_size) log_rotate();
+}
+
+static void *log_flusher(void *arg)
+{
+	(void) arg;
+	while (1) {
+		struct pollfd pfd = { wake_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, LOG_FLUSH_INTERVAL) > 0) {
+			uint64_t count;
+			if (read(wake_fd, &count, sizeof(count)) < 0) errno = 0;
+		}
+		pthread_mutex_lock(&drain_lock);
+		log_drain();
+		pthread_mutex_unlock(&drain_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Start flusher, writing to path or to stderr if it is NULL
+ * File is rotated once it grows past rotate bytes, 0 never rotates it
+ * Returns non-zero if it couldn't start, lines keep going to stderr then
+ */
+int log_open(const char *path, size_t rotate)
+{
+	if (started) return 0;
+	if (path) {
+		int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			error(0, "Error opening log file %s", path);
+			return -1;
+		}
+		struct stat st;
+		out_size = fstat(fd, &st) == 0 ? st.st_size : 0;
+		out_path = strdup(path);
+		out_fd = fd;
+	}
+	rotate_size = rotate;
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_t thread;
+	if (wake_fd < 0 || pthread_create(&thread, NULL, log_flusher, NULL) != 0) {
+		error(0, "Error starting log flusher");
+		return -1;
+	}
+	pthread_detach(thread);
+	__atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Write out buffered lines now, before the process exits
+ * May run in a signal handler on the flusher itself, so it only waits a
+ * little for the lock and gives up if the flusher keeps it
+ */
+void log_flush(void)
+{
+	if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) return;
+	for (int i = 0; i < 100; i++) {
+		if (pthread_mutex_trylock(&drain_lock) == 0) {
+			log_drain();
+			pthread_mutex_unlock(&drain_lock);
+			return;
+		}
+		struct timespec wait = { 0, 1000000 };
+		nanosleep(&wait, NULL);
+	}
+}
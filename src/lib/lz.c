@@ -0,0 +1,184 @@
+#include <string.h>
+
+#include "lz.h"
+
+static uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Write rest of a length which didn't fit in the token
+ */
+static uint8_t *put_length(uint8_t *p, size_t n)
+{
+	while (n >= 255) {
+		*p++ = 255;
+		n -= 255;
+	}
+	*p++ = n;
+	return p;
+}
+
+/*
+ * Write literals from anchor with match after them, match_len 0 ends block
+ * Returns NULL if it doesn't fit before end
+ */
+static uint8_t *put_sequence(uint8_t *p, uint8_t *end, const uint8_t *literals,
+		size_t lit_len, size_t offset, size_t match_len)
+{
+	if ((size_t) (end - p) < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1)
+		return NULL;
+	uint8_t *token = p++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15) p = put_length(p, lit_len - 15);
+	memcpy(p, literals, lit_len);
+	p += lit_len;
+	if (match_len == 0) return p;
+
+	*p++ = offset;
+	*p++ = offset >> 8;
+	match_len -= LZ_MIN_MATCH;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15) p = put_length(p, match_len - 15);
+	return p;
+}
+
+/*
+ * Compress src into LZ4 block in dst
+ * Returns length of block, 0 if it doesn't fit in capacity
+ */
+size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+	if (length > LZ_MAX_INPUT) return 0;
+	uint16_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	uint8_t *p = dst, *end = dst + capacity;
+	size_t anchor = 0, i = 0;
+	/* Skip faster through data which doesn't compress */
+	size_t misses = 0;
+	while (i + LZ_MATCH_LIMIT < length) {
+		uint32_t seq = load32(src + i);
+		uint32_t h = lz_hash(seq);
+		size_t ref = table[h];
+		table[h] = i;
+		if (ref >= i || i - ref > LZ_MAX_OFFSET || load32(src + ref) != seq) {
+			i += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+		size_t match_len = LZ_MIN_MATCH;
+		while (i + match_len < length - LZ_LAST_LITERALS &&
+				src[ref + match_len] == src[i + match_len]) {
+			match_len++;
+		}
+		p = put_sequence(p, end, src + anchor, i - anchor, i - ref, match_len);
+		if (!p) return 0;
+		i += match_len;
+		anchor = i;
+	}
+	p = put_sequence(p, end, src + anchor, length - anchor, 0, 0);
+	return p ? (size_t) (p - dst) : 0;
+}
+
+/*
+ * Read rest of a length which didn't fit in the token
+ * Returns -1 if block ends before it
+ */
+static int get_length(const uint8_t *src, size_t length, size_t *in, size_t *n)
+{
+	uint8_t byte;
+	do {
+		if (*in >= length) return -1;
+		byte = src[(*in)++];
+		*n += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+/*
+ * Decompress LZ4 block src into dst
+ * Returns length of output, -1 if block is malformed or doesn't fit
+ */
+ssize_t lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+	size_t in = 0, out = 0;
+	while (in < length) {
+		uint8_t token = src[in++];
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && get_length(src, length, &in, &lit_len) != 0)
+			return -1;
+		if (lit_len > length - in || lit_len > capacity - out) return -1;
+		memcpy(dst + out, src + in, lit_len);
+		in += lit_len;
+		out += lit_len;
+		/* Last sequence has no match */
+		if (in == length) break;
+
+		if (length - in < 2) return -1;
+		size_t offset = src[in] | (size_t) src[in + 1] << 8;
+		in += 2;
+		if (offset == 0 || offset > out) return -1;
+		size_t match_len = token & 15;
+		if (match_len == 15 && get_length(src, length, &in, &match_len) != 0)
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > capacity - out) return -1;
+		if (offset >= match_len) {
+			memcpy(dst + out, dst + out - offset, match_len);
+		} else {
+			/* Match overlaps what it copies, byte by byte repeats it */
+			for (size_t k = 0; k < match_len; k++) {
+				dst[out + k] = dst[out - offset + k];
+			}
+		}
+		out += match_len;
+	}
+	return out;
+}
+
+/*
+ * Compress content of message into out, which holds length bytes
+ * Returns length of compressed content, 0 if text should be sent as it is
+ */
+size_t compress_content(uint8_t *out, const uint8_t *text, size_t length)
+{
+	if (length < COMPRESS_THRESHOLD || length > LZ_MAX_INPUT) return 0;
+	size_t compressed = lz_compress(text, length, out + CONTENT_HEADER_SIZE,
+			length - CONTENT_HEADER_SIZE);
+	if (compressed == 0) return 0;
+	out[0] = CONTENT_MARK;
+	out[1] = CONTENT_COMPRESSED;
+	out[2] = length;
+	out[3] = length >> 8;
+	return CONTENT_HEADER_SIZE + compressed;
+}
+
+/*
+ * Turn decrypted content back into text, copied as it is unless compressed
+ * Returns length of text, -1 if it is malformed or longer than capacity
+ */
+ssize_t expand_content(uint8_t *out, size_t capacity, const uint8_t *content,
+		size_t length)
+{
+	if (length == 0 || content[0] != CONTENT_MARK) {
+		if (length > capacity) return -1;
+		memcpy(out, content, length);
+		return length;
+	}
+	if (length < CONTENT_HEADER_SIZE || !(content[1] & CONTENT_COMPRESSED))
+		return -1;
+	size_t expected = content[2] | (size_t) content[3] << 8;
+	if (expected > capacity) return -1;
+	ssize_t n = lz_decompress(content + CONTENT_HEADER_SIZE,
+			length - CONTENT_HEADER_SIZE, out, expected);
+	return n == (ssize_t) expected ? n : -1;
+}
@@ -8,7 +8,10 @@
 void print_packet(packet_t *pkt)
 {
 	printf("Packet:\n");
+	printf("Version: %d\n", pkt->version);
 	printf("Type: %d\n", pkt->type);
+	printf("Flags: %d\n", pkt->flags);
+	printf("ID: %llu\n", (unsigned long long) pkt->id);
 	printf("Length: %d\n", pkt->length);
 	if (pkt->length > 0) {
 		printf("Data:\n");
@@ -17,9 +20,145 @@ void print_packet(packet_t *pkt)
 		print_bin(pkt->signature, SIGN_SIZE);
 	}
 }
+
+static uint32_t load_be32(const uint8_t *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+		(uint32_t) p[2] << 8 | p[3];
+}
+
+static uint64_t load_be64(const uint8_t *p)
+{
+	return (uint64_t) load_be32(p) << 32 | load_be32(p + 4);
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Version of frame from its first byte, which is enough to tell them apart
+ */
+int frame_version(uint8_t *frame)
+{
+	return frame[0] == ZSM_V2 ? 2 : 1;
+}
+
+/*
+ * Header of complete frame is as long as it says, v1 ones have a fixed size
+ */
+size_t frame_header_size(uint8_t *frame)
+{
+	return frame[0] == ZSM_V2 ? frame[1] : PACKET_HEADER_SIZE;
+}
+
+uint8_t frame_type(uint8_t *frame)
+{
+	return frame[0] == ZSM_V2 ? frame[2] : frame[0];
+}
+
+/*
+ * Write header of frame in version, flags and id are only kept by v2
+ * Returns its size
+ */
+size_t pack_header(uint8_t *header, int version, uint8_t type, uint8_t flags,
+		uint32_t length, uint64_t id)
+{
+	if (version < 2) {
+		header[0] = type;
+		memcpy(&header[sizeof(type)], &length, sizeof(length));
+		return PACKET_HEADER_SIZE;
+	}
+	header[0] = ZSM_V2;
+	header[1] = PACKET_V2_HEADER_SIZE;
+	header[2] = type;
+	header[3] = flags;
+	store_be32(&header[4], length);
+	store_be32(&header[8], id >> 32);
+	store_be32(&header[12], id);
+	return PACKET_V2_HEADER_SIZE;
+}
+
+/*
+ * Write creation time of message as web client does, whatever time_t is here
+ */
+void pack_time(uint8_t *buf, time_t time)
+{
+	uint64_t t = (uint64_t) (int64_t) time;
+	for (int i = 0; i < TIME_SIZE; i++) {
+		buf[i] = t >> (i * 8);
+	}
+}
+
+time_t unpack_time(uint8_t *buf)
+{
+	uint64_t t = 0;
+	for (int i = 0; i < TIME_SIZE; i++) {
+		t |= (uint64_t) buf[i] << (i * 8);
+	}
+	return (time_t) (int64_t) t;
+}
+
+/*
+ * Fill type, length, version, flags and id of pkt from header
+ * Returns ZSM_STA_INVALID_LENGTH if it is malformed
+ */
+static int unpack_header(packet_t *pkt, uint8_t *header)
+{
+	if (header[0] != ZSM_V2) {
+		pkt->version = 1;
+		pkt->type = header[0];
+		memcpy(&pkt->length, &header[sizeof(pkt->type)], sizeof(pkt->length));
+		pkt->flags = 0;
+		pkt->id = 0;
+		return ZSM_STA_SUCCESS;
+	}
+	/* Later versions may add fields, they are skipped */
+	if (header[1] < PACKET_V2_HEADER_SIZE || header[1] > PACKET_HEADER_MAX) {
+		return ZSM_STA_INVALID_LENGTH;
+	}
+	pkt->version = 2;
+	pkt->type = header[2];
+	pkt->flags = header[3];
+	pkt->length = load_be32(&header[4]);
+	pkt->id = load_be64(&header[8]);
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Read exactly length bytes, TCP may split them across several segments
+ * Returns number of bytes read, less than length on error or closed connection
+ */
+static size_t recv_all(int fd, uint8_t *buf, size_t length)
+{
+	size_t bytes_read = 0;
+	while (bytes_read < length) {
+		ssize_t n = recv(fd, buf + bytes_read, length - bytes_read, 0);
+		if (n == 0) break;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* Non-blocking socket, wait for the rest */
+				struct pollfd pfd = { .fd = fd, .events = POLLIN };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			break;
+		}
+		bytes_read += n;
+	}
+	return bytes_read;
+}
+
 /*
- * Requires manually free packet data
- * pkt: packet to fill data in (must be created via create_packet)
+ * Data and signature are allocated for pkt, caller releases them with
+ * clear_packet, or free_packet if pkt came from create_packet
+ * Previous contents of pkt are overwritten, not freed
+ * pkt: packet to fill data in
  * fd: file descriptor to read data from
  */
 int recv_packet(packet_t *pkt, int fd)
@@ -27,29 +166,37 @@ int recv_packet(packet_t *pkt, int fd)
 	int status = ZSM_STA_SUCCESS;
 	size_t bytes_read = 0;
 
-	/* Buffer to store header (type, length) */
-	size_t header_len = sizeof(pkt->type) + sizeof(pkt->length);
-	uint8_t header[header_len];
+	/* Buffer to store header, v1 one is (type, length) */
+	uint8_t header[PACKET_HEADER_MAX];
 	
-	/* Read the entire packet header in one system call */
-	if ((bytes_read = recv(fd, header, header_len, 0)) != header_len) {
+	if ((bytes_read = recv_all(fd, header, PACKET_HEADER_SIZE)) != PACKET_HEADER_SIZE) {
 		status = (bytes_read == 0) ? ZSM_STA_CLOSED_CONNECTION : ZSM_STA_READING_SOCKET;
 		error(0, "Error reading packet header from socket, bytes_read(%d)!=header_len(%d), status => %d", 
-				bytes_read, header_len, status);
+				bytes_read, PACKET_HEADER_SIZE, status);
 		return status;
 	}
 
-	/* Unpack the header */
-	memcpy(&pkt->type, &header[0], sizeof(pkt->type));
-	memcpy(&pkt->length, &header[sizeof(pkt->type)], sizeof(pkt->length));
-
-	
-	/* Validate the packet type and length */
-	if (pkt->type > 0xFF || pkt->type < 0x0) {
-		status = ZSM_STA_INVALID_TYPE;
-		error(0, "Invalid packet type: %d", pkt->type);
+	pkt->type = 0;
+	pkt->data = NULL;
+	pkt->signature = NULL;
+	/* v2 header says how long it is */
+	size_t header_len = frame_header_size(header);
+	if (header[0] == ZSM_V2 && (header_len < PACKET_V2_HEADER_SIZE ||
+				header_len > PACKET_HEADER_MAX)) {
+		status = ZSM_STA_INVALID_LENGTH;
 		goto failure;
 	}
+	if (header_len > PACKET_HEADER_SIZE) {
+		size_t rest = header_len - PACKET_HEADER_SIZE;
+		if ((bytes_read = recv_all(fd, header + PACKET_HEADER_SIZE, rest)) != rest) {
+			status = (bytes_read == 0) ? ZSM_STA_CLOSED_CONNECTION : ZSM_STA_READING_SOCKET;
+			error(0, "Error reading packet header from socket, status => %d", status);
+			return status;
+		}
+	}
+
+	/* Unpack the header */
+	unpack_header(pkt, header);
 
 	if (pkt->length > MAX_DATA_LENGTH) {
 		status = ZSM_STA_TOO_LONG;
@@ -67,28 +214,24 @@ int recv_packet(packet_t *pkt, int fd)
 			goto failure;
 		}
 		
-		size_t payload_len = pkt->length + SIGN_SIZE;
-		uint8_t payload[payload_len];
-
-		/* Read data and signature from the socket in one sys call */
-		if ((bytes_read = recv(fd, payload, payload_len, 0)) != payload_len) {
+		/* Read data and signature straight into the packet */
+		if ((bytes_read = recv_all(fd, pkt->data, pkt->length)) != pkt->length ||
+				(bytes_read = recv_all(fd, pkt->signature, SIGN_SIZE)) != SIGN_SIZE) {
 			status = (bytes_read == 0) ? ZSM_STA_CLOSED_CONNECTION : ZSM_STA_READING_SOCKET;
 			error(0, "Error reading from socket, status => %d", status);
-			free(pkt->data);
-			free(pkt->signature);
-			goto failure;
+			clear_packet(pkt);
+			return status;
 		}
 		
-		/* Unpack paylaod */
-		memcpy(pkt->data, payload, pkt->length);
-		memcpy(pkt->signature, payload + pkt->length, SIGN_SIZE);
 		/* Null terminate data so it can be print */
 		pkt->data[pkt->length] = '\0';
 	}
 	return status;
 
 failure:;
+	clear_packet(pkt);
 	packet_t *error_pkt = create_packet(status, 0, NULL, NULL);
+	error_pkt->version = header[0] == ZSM_V2 ? 2 : 1;
 
 	/* should we send or not send ? */
 	if (send_packet(error_pkt, fd) != ZSM_STA_SUCCESS) {
@@ -101,7 +244,8 @@ failure:;
 
 /*
  * Creates a packet for receive or send
- * Requires heap allocated data
+ * Packet takes ownership of data and signature, which must be heap allocated
+ * or NULL, free_packet releases all of them
  */
 packet_t *create_packet(uint8_t type, uint32_t length, uint8_t *data, uint8_t *signature)
 {
@@ -110,96 +254,151 @@ packet_t *create_packet(uint8_t type, uint32_t length, uint8_t *data, uint8_t *s
 	pkt->length = length;
 	pkt->data = data;
 	pkt->signature = signature;
+	pkt->version = 1;
+	pkt->flags = 0;
+	pkt->id = 0;
 	return pkt;
 }
 
+/*
+ * Write all of buf, waiting for the socket if it is non-blocking and full
+ * Returns number of bytes written, less than length on error
+ */
+static size_t send_all(int fd, uint8_t *buf, size_t length)
+{
+	size_t bytes_sent = 0;
+	while (bytes_sent < length) {
+		ssize_t n = send(fd, buf + bytes_sent, length - bytes_sent, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			break;
+		}
+		bytes_sent += n;
+	}
+	return bytes_sent;
+}
+
 /*
  * Sends packet to fd
- * Requires heap allocated data
- * Close file descriptor and free data on failure
+ * Caller keeps ownership of packet and fd, even on failure
  */
 int send_packet(packet_t *pkt, int fd)
 {
 	int status = ZSM_STA_SUCCESS;
 	size_t bytes_sent = 0;
 
-	/* Buffer to store header (type, length) */
-	size_t header_len = sizeof(pkt->type) + sizeof(pkt->length);
-	uint8_t header[header_len];
+	/* Buffer to store header, v1 one is (type, length) */
+	uint8_t header[PACKET_HEADER_MAX];
 
 	/* Pack the header */
-	memcpy(&header[0], &pkt->type, sizeof(pkt->type));
-	memcpy(&header[sizeof(pkt->type)], &pkt->length, sizeof(pkt->length));
+	size_t header_len = pack_header(header, pkt->version, pkt->type,
+			pkt->flags, pkt->length, pkt->id);
 
-	 /* Send the packet header in one system call */
-	if ((bytes_sent = send(fd, header, header_len, 0)) != header_len) {
+	if ((bytes_sent = send_all(fd, header, header_len)) != header_len) {
 		status = ZSM_STA_WRITING_SOCKET;
 		error(0, "Error writing packet header to socket, bytes_sent(%d)!=header_len(%d), status => %d", 
 				bytes_sent, header_len, status);
-		goto failure;
+		return status;
 	}
 
 	if (pkt->type != ZSM_TYP_INFO && pkt->type != ZSM_TYP_ERROR && pkt->length > 0 && pkt->data != NULL) {
-		/* Buffer to store payload (data + signature) */
-		size_t payload_len = pkt->length + SIGN_SIZE;
-		uint8_t payload[payload_len];
-
-		/* Pack the payload */
-		memcpy(payload, pkt->data, pkt->length);
-		memcpy(payload + pkt->length, pkt->signature, SIGN_SIZE);
-		
-		/* Send the payload (data + signature) in one system call */
-		if ((bytes_sent = send(fd, payload, payload_len, 0)) != payload_len) {
+		/* Send data and signature without packing them into another buffer */
+		if ((bytes_sent = send_all(fd, pkt->data, pkt->length)) != pkt->length ||
+				(bytes_sent = send_all(fd, pkt->signature, SIGN_SIZE)) != SIGN_SIZE) {
 			status = ZSM_STA_WRITING_SOCKET;
-			error(0, "Error writing packet body to socket, bytes_sent(%d)!=payload_len(%d), status => %d", 
-					bytes_sent, payload_len, status);
-			goto failure;
+			error(0, "Error writing packet body to socket, status => %d", status);
+			return status;
 		}
 	}
 	return status;
+}
 
-failure:
-	/* Or we could resend it? */
-	status = ZSM_STA_WRITING_SOCKET;
-	error(0, "Error writing to socket");
-	free_packet(pkt);
-	close(fd);
-	return status;
+/*
+ * Free data and signature owned by packet, packet itself can be reused
+ * Not for packets filled by unpack_packet, they point into a frame
+ */
+void clear_packet(packet_t *pkt)
+{
+	free(pkt->data);
+	free(pkt->signature);
+	pkt->data = NULL;
+	pkt->signature = NULL;
 }
 
 /*
- * Free allocated memory in packet
+ * Free packet from create_packet along with everything it owns
  */
 void free_packet(packet_t *pkt)
 {
-	if (pkt->type != ZSM_TYP_AUTH && pkt->type != ZSM_TYP_ERROR) {
-		if (pkt->signature != NULL) {
-			free(pkt->signature);
-		}
+	clear_packet(pkt);
+	free(pkt);
+}
+
+/*
+ * Check if buf starts with a complete frame and store its size in frame_len
+ * Returns ZSM_STA_READING_SOCKET if more bytes are needed
+ */
+int parse_frame(uint8_t *buf, size_t len, size_t *frame_len)
+{
+	if (len < PACKET_HEADER_SIZE) return ZSM_STA_READING_SOCKET;
+	size_t header_len = frame_header_size(buf);
+	if (len < header_len) return ZSM_STA_READING_SOCKET;
+
+	packet_t pkt;
+	if (unpack_header(&pkt, buf) != ZSM_STA_SUCCESS) {
+		error(0, "Invalid header length: %d", header_len);
+		return ZSM_STA_INVALID_LENGTH;
 	}
-	if (pkt->data != NULL) {
-		free(pkt->data);
+	if (pkt.length > MAX_DATA_LENGTH) {
+		error(0, "Data too long: %d", pkt.length);
+		return ZSM_STA_TOO_LONG;
 	}
-	free(pkt);
+
+	/* Same rule as recv_packet for which packets carry data and signature */
+	*frame_len = header_len;
+	if (pkt.type != ZSM_TYP_INFO && pkt.length > 0)
+		*frame_len += pkt.length + SIGN_SIZE;
+
+	return len < *frame_len ? ZSM_STA_READING_SOCKET : ZSM_STA_SUCCESS;
 }
 
 /*
- * Wrapper for recv_packet to verify packet
- * Reads packet from fd, stores in pkt
+ * Fill pkt from a complete frame, data and signature point into frame
+ * so pkt must not be freed with free_packet or clear_packet
  */
-int verify_packet(packet_t *pkt, int fd)
+void unpack_packet(packet_t *pkt, uint8_t *frame)
 {
-	int status = recv_packet(pkt, fd);
-	if (status != ZSM_STA_SUCCESS) {
-		return status;
+	unpack_header(pkt, frame);
+	size_t header_len = frame_header_size(frame);
+	if (pkt->type != ZSM_TYP_INFO && pkt->length > 0) {
+		pkt->data = frame + header_len;
+		pkt->signature = frame + header_len + pkt->length;
+	} else {
+		pkt->data = NULL;
+		pkt->signature = NULL;
 	}
-	if (pkt->type != ZSM_TYP_MESSAGE) {
+}
+
+/*
+ * Check message is signed by its author
+ */
+int check_packet(packet_t *pkt)
+{
+	if (pkt->type != ZSM_TYP_MESSAGE && pkt->type != ZSM_TYP_CHANNEL &&
+			pkt->type != ZSM_TYP_CHANNEL_MESSAGE) {
 		/* Handle if wrong type */
 		return ZSM_STA_INVALID_TYPE;
 	}
+	if (pkt->length < MAX_NAME * 2) {
+		return ZSM_STA_INVALID_LENGTH;
+	}
 
-	uint8_t from[MAX_NAME];
-	memcpy(from, pkt->data, MAX_NAME);
+	uint8_t *from = pkt->data;
 
 	/* Verify data confidentiality by signature */
 	/* Verify data integrity by hash */
@@ -209,14 +408,30 @@ int verify_packet(packet_t *pkt, int fd)
 	if (crypto_sign_verify_detached(pkt->signature, hash, HASH_SIZE, from) != 0) {
 		/* Not match */
 		error(0, "Cannot verify data integrity");
-		packet_t *error_pkt = create_packet(ZSM_STA_ERROR_INTEGRITY, 0, NULL, NULL);
-		send_packet(error_pkt, fd);
-		free_packet(error_pkt);
 		return ZSM_STA_ERROR_INTEGRITY;
 	}
 	return ZSM_STA_SUCCESS;
 }
 
+/*
+ * Wrapper for recv_packet to verify packet
+ * Reads packet from fd, stores in pkt
+ */
+int verify_packet(packet_t *pkt, int fd)
+{
+	int status = recv_packet(pkt, fd);
+	if (status != ZSM_STA_SUCCESS) {
+		return status;
+	}
+
+	status = check_packet(pkt);
+	if (status == ZSM_STA_ERROR_INTEGRITY) {
+		packet_t *error_pkt = create_packet(ZSM_STA_ERROR_INTEGRITY, 0, NULL, NULL);
+		send_packet(error_pkt, fd);
+		free_packet(error_pkt);
+	}
+	return status;
+}
 
 /*
  * Create signature for packet
@@ -13,27 +13,17 @@ void error(int fatal, const char *fmt, ...)
 
 	/* to preserve errno */
 	int errsv = errno;
+	if (errsv == EEXIST) errsv = 0;
 
-	/* Determine the length of the formatted error message */
-	va_list args_copy;
-	va_copy(args_copy, args);
-	size_t error_len = vsnprintf(NULL, 0, fmt, args_copy);
-	va_end(args_copy);
+	int level = fatal ? LOG_FATAL : errsv != 0 ? LOG_ERROR : LOG_INFO;
+	log_vwrite(level, errsv, fmt, args);
+	if (errsv != 0) errno = 0;
 
-	/* 7 for [zsm], space and null */
-	char errorstr[error_len + 1];
-	vsnprintf(errorstr, error_len + 1, fmt, args);
-	fprintf(stderr, "[zsm] ");
-
-	if (errsv != 0 && errsv != EEXIST) {
-		perror(errorstr);
-		errno = 0;
-	} else {
-		fprintf(stderr, "%s\n", errorstr);
-	}
-	
 	va_end(args);
-	if (fatal) exit(1);
+	if (fatal) {
+		log_flush();
+		exit(1);
+	}
 }
 
 void *memalloc(size_t size)
@@ -122,37 +112,15 @@ void mkdir_p(const char *file)
 	return;
 }
 
+/*
+ * Log line of type LOG_ERROR, LOG_INFO or LOG_DEBUG, buffered once
+ * log_open was called
+ */
 void write_log(int type, const char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-
-	char client_log[PATH_MAX];
-	char *data_dir = replace_home(CLIENT_DATA_DIR);
-	if (access(data_dir, W_OK) != 0) {
-		/* If data dir doesn't exist, create it */
-		mkdir_p(data_dir);
-	}
-	snprintf(client_log, PATH_MAX, "%s/zen.log", data_dir);
-	free(data_dir);
-
-	FILE *log = fopen(client_log, "a");
-	if (log != NULL) {
-		time_t now = time(NULL);
-		struct tm *t = localtime(&now);
-		/* either info or error */
-		int type_len = type == LOG_INFO ? 4 : 5;
-		char logtype[4 + type_len];
-		snprintf(logtype, 4 + type_len, "[%s] ", type == LOG_INFO ? "INFO" : "ERROR");
-		char time[21];
-		strftime(time, 21, "%Y-%m-%d %H:%M:%S ", t);
-		char details[4 + type_len + 21];
-		snprintf(details, 4 + type_len + 21, "%s%s", logtype, time);
-		fprintf(log, "%s", details);
-		vfprintf(log, fmt, args);
-		fprintf(log, "\n");
-		fclose(log);
-	}
+	log_vwrite(type, 0, fmt, args);
 	va_end(args);
 }
 
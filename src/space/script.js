@@ -1,5 +1,11 @@
 const MAX_NAME = 32;
 const ZSM_STA_AUTHORISED = 20;
+const ZSM_TYP_PING = 27;
+const ZSM_TYP_PONG = 28;
+// Header of content zen compressed before encrypting it, see include/lz.h
+const CONTENT_MARK = 0;
+const CONTENT_COMPRESSED = 1;
+const CONTENT_HEADER_SIZE = 4;
 
 const keypair = { pk: "", sk: "" };
 let serverAddress = "";
@@ -20,6 +26,57 @@ function create_signature(data, sk) {
 	return signature;
 }
 
+// Read rest of a length which didn't fit in LZ4 token
+function lz_length(src, pos, length) {
+	let byte;
+	do {
+		if (pos.i >= src.length) throw new Error("Malformed compressed content");
+		byte = src[pos.i++];
+		length += byte;
+	} while (byte == 255);
+	return length;
+}
+
+// Decompress LZ4 block into size bytes
+function lz_decompress(src, size) {
+	const dst = new Uint8Array(size);
+	const pos = { i: 0 };
+	let out = 0;
+	while (pos.i < src.length) {
+		const token = src[pos.i++];
+		let literals = token >> 4;
+		if (literals == 15) literals = lz_length(src, pos, literals);
+		if (pos.i + literals > src.length || out + literals > size)
+			throw new Error("Malformed compressed content");
+		dst.set(src.subarray(pos.i, pos.i + literals), out);
+		pos.i += literals;
+		out += literals;
+		// Last sequence has no match
+		if (pos.i == src.length) break;
+
+		if (pos.i + 2 > src.length) throw new Error("Malformed compressed content");
+		const offset = src[pos.i] | (src[pos.i + 1] << 8);
+		pos.i += 2;
+		let match = token & 15;
+		if (match == 15) match = lz_length(src, pos, match);
+		match += 4;
+		if (offset == 0 || offset > out || out + match > size)
+			throw new Error("Malformed compressed content");
+		// Match may overlap what it copies
+		for (let k = 0; k < match; k++, out++) dst[out] = dst[out - offset];
+	}
+	if (out != size) throw new Error("Malformed compressed content");
+	return dst;
+}
+
+// Turn decrypted content back into text bytes, it is as it is unless compressed
+function expand_content(content) {
+	if (content.length == 0 || content[0] != CONTENT_MARK) return content;
+	if (content.length < CONTENT_HEADER_SIZE || !(content[1] & CONTENT_COMPRESSED))
+		throw new Error("Unknown content encoding");
+	return lz_decompress(content.subarray(CONTENT_HEADER_SIZE), content[2] | (content[3] << 8));
+}
+
 // Parse Uint8Array to a packet object
 function parse_packet(bytes) {
 	const type = bytes[0];
@@ -46,7 +103,7 @@ function parse_packet(bytes) {
 	let timestamp = encrypted.slice(encrypted.length - 8, encrypted.length);
 	encrypted = encrypted.slice(0, encrypted.length - 8);
 
-	let decrypted = new TextDecoder().decode(sodium.crypto_aead_xchacha20poly1305_ietf_decrypt(null, encrypted, null, nonce, sharedKey));
+	let decrypted = new TextDecoder().decode(expand_content(sodium.crypto_aead_xchacha20poly1305_ietf_decrypt(null, encrypted, null, nonce, sharedKey)));
 	return {
 		type,
 		length,
@@ -252,7 +309,10 @@ function saveMessage(from, to, message, time) {
 
 async function authenticate() {
 	try {
-		const ws = new WebSocket("wss://" + serverAddress);
+		// zmr speaks WebSocket itself on its -w port, pages served over https
+		// reach it through a TLS proxy
+		const scheme = location.protocol === "https:" ? "wss://" : "ws://";
+		const ws = new WebSocket(scheme + serverAddress);
 		// DOM elements
 		const inputField = document.getElementById("message-input");
 		const sendButton = document.getElementById("send-button");
@@ -327,6 +387,11 @@ async function authenticate() {
 				}
 				if (state == "authenticated") {
 					const bytes = new Uint8Array(await event.data.arrayBuffer());
+					if (bytes[0] == ZSM_TYP_PING) {
+						// Server drops clients which don't answer
+						ws.send(new Uint8Array([ZSM_TYP_PONG, 0, 0, 0, 0]));
+						return;
+					}
 					const packet = parse_packet(bytes);
 					saveMessage(packet.from, sodium.to_hex(keypair.pk), packet.data, packet.time);
 					// Notify user of incoming message
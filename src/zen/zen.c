@@ -2,10 +2,16 @@
 #include "packet.h"
 #include "key.h"
 #include "util.h"
+#include "lz.h"
 #include "zen/ui.h"
 #include "zen/db.h"
 
 config_t config;
+/* UI and receive thread both write to server */
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Version spoken with server, v2 has messages acknowledged by ID */
+int protocol = 1;
+uint64_t last_id; /* ID of last message sent, under send_lock */
 
 /*
  * Authenticate with server by signing a challenge
@@ -15,39 +21,48 @@ int authenticate_server(int *sockfd)
 	/* create empty packet */
 	packet_t *pkt = create_packet(0, 0, NULL, NULL);
 	int status = recv_packet(pkt, *sockfd);
-	free(pkt->signature);
 
 	if (status != ZSM_STA_SUCCESS) {
+		free_packet(pkt);
 		return status;
 	}
-	if (pkt->type != ZSM_TYP_AUTH) {
+	if (pkt->type != ZSM_TYP_AUTH || pkt->length != CHALLENGE_SIZE) {
+		free_packet(pkt);
 		return ZSM_STA_INVALID_TYPE;
 	}
 	uint8_t *challenge = pkt->data;
+	/* Server advertises v2 in the otherwise empty signature */
+	if (pkt->signature[0] == ZSM_V2) protocol = ZSM_VERSION;
 
 	uint8_t *sig = memalloc(SIGN_SIZE);
 	uint8_t sk[SK_SIZE];
 	sodium_hex2bin(sk, SK_SIZE, config.private_key, SK_SIZE * 2, NULL, NULL, NULL);
 	crypto_sign_detached(sig, NULL, challenge, CHALLENGE_SIZE, sk);
 
-	free(pkt->data);
+	clear_packet(pkt);
 
-	uint8_t *pk = memalloc(PK_SIZE);
+	/* Public key padded to the packet length of SIGN_SIZE */
+	uint8_t *pk = memalloc(SIGN_SIZE);
+	memset(pk, 0, SIGN_SIZE);
 	sodium_hex2bin(pk, PK_SIZE, config.public_key, PK_SIZE * 2, NULL, NULL, NULL);
 
 	pkt->type = ZSM_TYP_AUTH;
+	pkt->version = protocol;
 	pkt->length = SIGN_SIZE;
 	pkt->data = pk;
 	pkt->signature = sig;
 
 	if ((status = send_packet(pkt, *sockfd)) != ZSM_STA_SUCCESS) {
-		/* fd already closed */
+		close(*sockfd);
 		error(0, "Could not authenticate with server, status: %d", status);
 		free_packet(pkt);
 		return ZSM_STA_ERROR_AUTHENTICATE;
 	}
 
+	/* Packet still owns pk and sig until they are released here */
+	clear_packet(pkt);
 	if ((status = recv_packet(pkt, *sockfd)) != ZSM_STA_SUCCESS) {
+		free_packet(pkt);
 		return status;
 	};
 	status = pkt->type;
@@ -95,6 +110,17 @@ void send_message(uint8_t *recipient, uint8_t *content, int sockfd)
 
 	size_t content_len = strlen(content);
 
+	/* Long content is compressed before it is encrypted, as ciphertext
+	 * doesn't compress. Older clients would show it as garbage, so it is
+	 * only done once compress=1 is set in zen.conf */
+	uint8_t compressed[content_len + 1];
+	size_t compressed_len = config.compress ?
+		compress_content(compressed, content, content_len) : 0;
+	if (compressed_len > 0) {
+		content = compressed;
+		content_len = compressed_len;
+	}
+
 	uint32_t cipher_len = content_len + ADDITIONAL_SIZE;
 	uint8_t nonce[NONCE_SIZE], encrypted[cipher_len];
 	
@@ -105,21 +131,28 @@ void send_message(uint8_t *recipient, uint8_t *content, int sockfd)
 	crypto_aead_xchacha20poly1305_ietf_encrypt(encrypted, NULL, content,
 			content_len, NULL, 0, NULL, nonce, shared_key);
 
-	size_t data_len = MAX_NAME * 2 + NONCE_SIZE + cipher_len + sizeof(time_t);
+	size_t data_len = MAX_NAME * 2 + NONCE_SIZE + cipher_len + TIME_SIZE;
 	uint8_t *data = memalloc(data_len);
 
-	time_t creation = time(NULL);
 	/* Construct data */
 	memcpy(data, kp_from->pk, MAX_NAME);
 	memcpy(data + MAX_NAME, recipient_bin, MAX_NAME);
 	memcpy(data + MAX_NAME * 2, nonce, NONCE_SIZE);
 	memcpy(data + MAX_NAME * 2 + NONCE_SIZE, encrypted, cipher_len);
-	memcpy(data + MAX_NAME * 2 + NONCE_SIZE + cipher_len, &creation, sizeof(time_t));
+	pack_time(data + MAX_NAME * 2 + NONCE_SIZE + cipher_len, time(NULL));
 
 	uint8_t *signature = create_signature(data, data_len, kp_from->sk);
 	packet_t *pkt = create_packet(ZSM_TYP_MESSAGE, data_len, data, signature);
-
-	if (send_packet(pkt, sockfd) != ZSM_STA_SUCCESS) {
+	int status;
+
+	/* Not waiting for the server, its status is matched by ID when it comes */
+	pkt->version = protocol;
+	pkt->flags = protocol > 1 ? ZSM_FLAG_ACK : 0;
+	pthread_mutex_lock(&send_lock);
+	if (protocol > 1) pkt->id = ++last_id;
+	status = send_packet(pkt, sockfd);
+	pthread_mutex_unlock(&send_lock);
+	if (status != ZSM_STA_SUCCESS) {
 		close(sockfd);
 		write_log(LOG_ERROR, "Failed to send message");
 	}
@@ -128,6 +161,23 @@ void send_message(uint8_t *recipient, uint8_t *content, int sockfd)
 	free(kp_from);
 }
 
+/*
+ * Answer keepalive ping of server, which drops clients staying silent
+ */
+void send_pong(int sockfd, uint64_t id)
+{
+	packet_t *pkt = create_packet(ZSM_TYP_PONG, 0, NULL, NULL);
+	pkt->version = protocol;
+	pkt->id = id;
+	pthread_mutex_lock(&send_lock);
+	int status = send_packet(pkt, sockfd);
+	pthread_mutex_unlock(&send_lock);
+	if (status != ZSM_STA_SUCCESS) {
+		write_log(LOG_ERROR, "Failed to answer ping");
+	}
+	free_packet(pkt);
+}
+
 /*
  * For receiving packets from server
  */
@@ -151,23 +201,43 @@ void *receive_worker(void *arg)
 				deinit();
 				pthread_exit(NULL);
 			}
+			if (pkt.type == ZSM_TYP_PING) {
+				send_pong(*sockfd, pkt.id);
+				clear_packet(&pkt);
+				continue;
+			}
+			if (pkt.id != 0 && pkt.length == 0) {
+				/* Status of message sent earlier */
+				if (pkt.type == ZSM_STA_SUCCESS) {
+					log_debug("Message %llu was delivered",
+							(unsigned long long) pkt.id);
+				} else {
+					write_log(LOG_ERROR, "Message %llu failed, status %d",
+							(unsigned long long) pkt.id, pkt.type);
+				}
+				clear_packet(&pkt);
+				continue;
+			}
 			error(0, "Error verifying packet");
+			clear_packet(&pkt);
+			continue;
 		}
 		pthread_mutex_lock(&message_lock);
-		size_t cipher_len = pkt.length - NONCE_SIZE - MAX_NAME * 2 - sizeof(time_t);
+		size_t cipher_len = pkt.length - NONCE_SIZE - MAX_NAME * 2 - TIME_SIZE;
 		size_t data_len = cipher_len - ADDITIONAL_SIZE;
 
 		uint8_t nonce[NONCE_SIZE], encrypted[cipher_len], from[MAX_NAME],
-		to[MAX_NAME], decrypted[data_len + 1], to_hex[PK_SIZE * 2 + 1],
-		from_hex[PK_SIZE * 2 + 1];
+		to[MAX_NAME], decrypted[data_len + 1], text[MAX_MESSAGE_LENGTH + 1],
+		to_hex[PK_SIZE * 2 + 1], from_hex[PK_SIZE * 2 + 1];
 		time_t creation;
+		ssize_t text_len;
 
 		/* Deconstruct data */
 		memcpy(from, pkt.data, MAX_NAME);
 		memcpy(to, pkt.data + MAX_NAME, MAX_NAME);
 		memcpy(nonce, pkt.data + MAX_NAME * 2, NONCE_SIZE);
 		memcpy(encrypted, pkt.data + MAX_NAME * 2 + NONCE_SIZE, cipher_len);
-		memcpy(&creation, pkt.data + MAX_NAME * 2 + NONCE_SIZE + cipher_len, sizeof(time_t));
+		creation = unpack_time(pkt.data + MAX_NAME * 2 + NONCE_SIZE + cipher_len);
 
 		sodium_bin2hex(to_hex, sizeof(to_hex), to, PK_SIZE);
 		sodium_bin2hex(from_hex, sizeof(from_hex), from, PK_SIZE);
@@ -202,18 +272,21 @@ void *receive_worker(void *arg)
 				save_receivekey(from_hex, shared_key);
 			}
 		}
+		/* Everything needed was copied out of it */
+		clear_packet(&pkt);
 		if (shared_key) {
-			/* We don't need it anymore */
-			free(pkt.data);
 			if (crypto_aead_xchacha20poly1305_ietf_decrypt(decrypted, NULL, NULL,
 						encrypted, cipher_len, NULL, 0, nonce, shared_key) != 0) {
 				write_log(LOG_ERROR, "Unable to decrypt data from %s", from_hex);
+			} else if ((text_len = expand_content(text, MAX_MESSAGE_LENGTH,
+							decrypted, data_len)) < 0) {
+				write_log(LOG_ERROR, "Unable to decompress data from %s", from_hex);
 			} else {
-				/* Terminate decrypted data so we don't print random bytes */
-				decrypted[data_len] = '\0';
-				write_log(LOG_INFO, "Decrypted: %s", decrypted);
-				save_message(from_hex, to_hex, decrypted, creation);
-				show_notification(from_hex, decrypted);
+				/* Terminate text so we don't print random bytes */
+				text[text_len] = '\0';
+				write_log(LOG_INFO, "Decrypted: %s", text);
+				save_message(from_hex, to_hex, text, creation);
+				show_notification(from_hex, text);
 				update_current_user(from_hex);
 				show_chat(from_hex);
 			}
@@ -249,6 +322,8 @@ int read_config(const char *file_path)
 				strncpy(config.private_key, value, sizeof(config.private_key) - 1);
 			} else if (strcmp(key, "server_address") == 0) {
 				strncpy(config.server_address, value, sizeof(config.server_address) - 1);
+			} else if (strcmp(key, "compress") == 0) {
+				config.compress = atoi(value);
 			} else {
 				error(0, "Unknown key: %s", key);
 			}
@@ -262,6 +337,16 @@ int read_config(const char *file_path)
 
 int main(int argc, char **argv)
 {
+	/* Lines are buffered and written to CLIENT_DATA_DIR/zen.log by a
+	 * flusher, ncurses owns the terminal */
+	char log_path[PATH_MAX];
+	char *data_dir = replace_home(CLIENT_DATA_DIR);
+	snprintf(log_path, PATH_MAX, "%s/zen.log", data_dir);
+	/* Without HOME the literal itself comes back */
+	if (getenv("HOME")) free(data_dir);
+	mkdir_p(log_path);
+	log_open(log_path, LOG_ROTATE_SIZE);
+
 	if (argc == 2 && !strncmp(argv[1], "create-key", 10)) {
 		keypair_t *kp = create_keypair();
 		printf("Created keypair!\n");
@@ -361,5 +446,6 @@ int main(int argc, char **argv)
 
 	close(sockfd);
 	free(server);
+	log_flush();
 	return 0;
 }
@@ -0,0 +1,306 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/ht.h"
+#include "zmr/queue.h"
+#include "zmr/channel.h"
+#include "zmr/fed.h"
+
+static channel_shard_t shards[CHANNEL_SHARDS];
+
+static channel_shard_t *channel_shard(uint8_t *id)
+{
+	return &shards[pk_hash(id) % CHANNEL_SHARDS];
+}
+
+/*
+ * Find channel, link is pointed at the chain entry referencing it
+ * Shard lock must be held
+ */
+static channel_t *channel_find(channel_shard_t *shard, uint8_t *id,
+		channel_t ***link)
+{
+	channel_t **ch = &shard->buckets[(pk_hash(id) / CHANNEL_SHARDS) %
+		CHANNEL_BUCKETS];
+	for (; *ch; ch = &(*ch)->next) {
+		if (memcmp((*ch)->id, id, PK_SIZE) == 0) break;
+	}
+	if (link) *link = ch;
+	return *ch;
+}
+
+static void members_release(members_t *members)
+{
+	if (__atomic_sub_fetch(&members->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(members);
+	}
+}
+
+/*
+ * Binary search of sorted member list, pos is set to where pk is or belongs
+ */
+static int members_find(members_t *members, uint8_t *pk, int *pos)
+{
+	int low = 0, high = members->count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		int cmp = memcmp(members->pks[mid], pk, PK_SIZE);
+		if (cmp == 0) {
+			*pos = mid;
+			return 1;
+		} else if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	*pos = low;
+	return 0;
+}
+
+/*
+ * Member list of channel which may be changed in place and has room for size
+ * members, a copy if fan-outs still hold the current one
+ * Shard lock must be held, returns NULL if it couldn't be allocated
+ */
+static members_t *members_writable(channel_t *ch, int size)
+{
+	members_t *old = ch->members;
+	int held = old && __atomic_load_n(&old->refs, __ATOMIC_ACQUIRE) > 1;
+	if (old && !held && old->size >= size) return old;
+
+	int capacity = old ? old->size : 16;
+	if (capacity < size) capacity = capacity * 2 > size ? capacity * 2 : size;
+	members_t *members = memalloc(sizeof(members_t) + capacity * PK_SIZE);
+	if (!members) return NULL;
+	members->refs = 1;
+	members->size = capacity;
+	members->count = 0;
+	if (old) {
+		members->count = old->count;
+		memcpy(members->pks, old->pks, old->count * PK_SIZE);
+		members_release(old);
+	}
+	ch->members = members;
+	return members;
+}
+
+/*
+ * Apply membership change of sender to channel id
+ * Returns status to answer sender with
+ */
+static int channel_update(uint8_t *id, int op, uint8_t *member, uint8_t *sender)
+{
+	channel_shard_t *shard = channel_shard(id);
+	pthread_mutex_lock(&shard->lock);
+	channel_t **link;
+	channel_t *ch = channel_find(shard, id, &link);
+	int status = ZSM_STA_SUCCESS;
+	int pos;
+
+	if (op == CHANNEL_ADD) {
+		if (!ch) {
+			ch = memalloc(sizeof(channel_t));
+			if (!ch) {
+				status = ZSM_STA_MEMORY_ALLOCATION;
+				goto out;
+			}
+			memcpy(ch->id, id, PK_SIZE);
+			memcpy(ch->owner, sender, PK_SIZE);
+			ch->members = NULL;
+			ch->next = NULL;
+			if (!members_writable(ch, 1)) {
+				free(ch);
+				status = ZSM_STA_MEMORY_ALLOCATION;
+				goto out;
+			}
+			memcpy(ch->members->pks[0], sender, PK_SIZE);
+			ch->members->count = 1;
+			*link = ch;
+			error(0, "Created channel");
+		} else if (memcmp(ch->owner, sender, PK_SIZE) != 0) {
+			status = ZSM_STA_UNAUTHORISED;
+			goto out;
+		}
+		if (members_find(ch->members, member, &pos)) goto out;
+		if (ch->members->count >= CHANNEL_MAX_MEMBERS) {
+			status = ZSM_STA_TOO_LONG;
+			goto out;
+		}
+		members_t *members = members_writable(ch, ch->members->count + 1);
+		if (!members) {
+			status = ZSM_STA_MEMORY_ALLOCATION;
+			goto out;
+		}
+		memmove(members->pks[pos + 1], members->pks[pos],
+				(members->count - pos) * PK_SIZE);
+		memcpy(members->pks[pos], member, PK_SIZE);
+		members->count++;
+	} else if (op == CHANNEL_REMOVE) {
+		if (!ch) {
+			status = ZSM_STA_UNKNOWN_USER;
+			goto out;
+		}
+		if (memcmp(ch->owner, sender, PK_SIZE) != 0 &&
+				memcmp(member, sender, PK_SIZE) != 0) {
+			status = ZSM_STA_UNAUTHORISED;
+			goto out;
+		}
+		if (memcmp(ch->owner, member, PK_SIZE) == 0) {
+			/* Fan-outs already started keep their member list */
+			*link = ch->next;
+			members_release(ch->members);
+			free(ch);
+			error(0, "Deleted channel");
+			goto out;
+		}
+		if (!members_find(ch->members, member, &pos)) goto out;
+		members_t *members = members_writable(ch, ch->members->count);
+		if (!members) {
+			status = ZSM_STA_MEMORY_ALLOCATION;
+			goto out;
+		}
+		memmove(members->pks[pos], members->pks[pos + 1],
+				(members->count - pos - 1) * PK_SIZE);
+		members->count--;
+	} else {
+		status = ZSM_STA_INVALID_TYPE;
+	}
+
+out:
+	pthread_mutex_unlock(&shard->lock);
+	return status;
+}
+
+/*
+ * Handle verified membership frame of client and answer it
+ */
+void channel_manage(thread_t *thread, client_t *client, out_t *out)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, out->data);
+
+	int status;
+	if (num_peers > 0) {
+		/* Membership would only be known to this node */
+		status = ZSM_STA_INVALID_TYPE;
+	} else if (pkt.length != CHANNEL_FRAME_SIZE) {
+		status = ZSM_STA_INVALID_LENGTH;
+	} else if (memcmp(pkt.data, client->pk, PK_SIZE) != 0) {
+		/* Membership is granted to the authenticated key only */
+		status = ZSM_STA_UNAUTHORISED;
+	} else {
+		status = channel_update(pkt.data + MAX_NAME, pkt.data[MAX_NAME * 2],
+				pkt.data + MAX_NAME * 2 + 1, client->pk);
+	}
+	reply_status(thread, client, status, pkt.id);
+	out_free(thread, out);
+}
+
+/*
+ * Start fanning verified channel frame of client out to members
+ * Sender has to be a member, the frame is held until every member got it
+ */
+void channel_send(thread_t *thread, client_t *client, out_t *out)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, out->data);
+	if (num_peers > 0) {
+		reply_status(thread, client, ZSM_STA_INVALID_TYPE, pkt.id);
+		out_free(thread, out);
+		return;
+	}
+	if (memcmp(pkt.data, client->pk, PK_SIZE) != 0) {
+		reply_status(thread, client, ZSM_STA_UNAUTHORISED, pkt.id);
+		out_free(thread, out);
+		return;
+	}
+
+	uint8_t *id = pkt.data + MAX_NAME;
+	channel_shard_t *shard = channel_shard(id);
+	pthread_mutex_lock(&shard->lock);
+	channel_t *ch = channel_find(shard, id, NULL);
+	int pos;
+	members_t *members = NULL;
+	if (ch && members_find(ch->members, client->pk, &pos)) {
+		members = ch->members;
+		__atomic_add_fetch(&members->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (!members) {
+		reply_status(thread, client, ch ? ZSM_STA_UNAUTHORISED :
+				ZSM_STA_UNKNOWN_USER, pkt.id);
+		out_free(thread, out);
+		return;
+	}
+
+	fanout_t *fanout = pool_get(&thread->fanout_pool);
+	if (!fanout) {
+		members_release(members);
+		out_free(thread, out);
+		return;
+	}
+	/* Accepted once fan-out started, members may still be offline */
+	if (pkt.flags & ZSM_FLAG_ACK)
+		reply_status(thread, client, ZSM_STA_SUCCESS, pkt.id);
+	fanout->out = out;
+	fanout->client = client;
+	fanout->members = members;
+	fanout->next = 0;
+	fanout->next_fanout = NULL;
+	/* Sender is neither freed nor handed over until its frame went out */
+	client->ops++;
+	if (thread->fanouts_tail)
+		thread->fanouts_tail->next_fanout = fanout;
+	else
+		thread->fanouts = fanout;
+	thread->fanouts_tail = fanout;
+}
+
+/*
+ * Queue frames of pending fan-outs for up to CHANNEL_BATCH members, oldest
+ * fan-out first
+ */
+void channel_work(thread_t *thread)
+{
+	int budget = CHANNEL_BATCH;
+	while (thread->fanouts && budget > 0) {
+		fanout_t *fanout = thread->fanouts;
+		members_t *members = fanout->members;
+		out_t *frame = fanout->out;
+		while (fanout->next < members->count && budget > 0) {
+			uint8_t *pk = members->pks[fanout->next++];
+			budget--;
+			if (memcmp(pk, fanout->client->pk, PK_SIZE) == 0) continue;
+			/* Every member's entry references the one uploaded frame */
+			out_t *out = out_new(thread, frame->buf, frame->data, frame->length);
+			if (!out) continue;
+			out->stamp = frame->stamp;
+			metric_add(&thread->metrics.fanout_frames, 1);
+			route_to(thread, pk, out);
+		}
+		if (fanout->next < members->count) break;
+
+		thread->fanouts = fanout->next_fanout;
+		if (!thread->fanouts) thread->fanouts_tail = NULL;
+		client_t *client = fanout->client;
+		client->ops--;
+		if (client->state == CLIENT_CLOSED && client->ops == 0) {
+			release_client(thread, client);
+		}
+		members_release(members);
+		out_free(thread, frame);
+		pool_put(fanout);
+	}
+}
+
+void channel_init(void)
+{
+	for (int i = 0; i < CHANNEL_SHARDS; i++) {
+		if (pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+			error(1, "Error on initializing mutex");
+		}
+		for (int b = 0; b < CHANNEL_BUCKETS; b++)
+			shards[i].buckets[b] = NULL;
+	}
+}
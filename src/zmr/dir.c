@@ -0,0 +1,258 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/ht.h"
+#include "zmr/dir.h"
+
+static dir_shard_t shards[DIR_SHARDS];
+static dir_reader_t *readers;
+static int num_readers;
+static uint64_t epoch = 0;
+
+static dir_table_t *dir_table_new(size_t size)
+{
+	dir_table_t *table = memalloc(sizeof(dir_table_t) + size * sizeof(client_t *));
+	if (!table) return NULL;
+	table->size = size;
+	for (size_t i = 0; i < size; i++)
+		table->slots[i] = NULL;
+	return table;
+}
+
+void dir_init(int readers_count)
+{
+	for (int i = 0; i < DIR_SHARDS; i++) {
+		if (pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+			error(1, "Error on initializing mutex");
+		}
+		shards[i].table = dir_table_new(DIR_SHARD_SIZE);
+		if (!shards[i].table) {
+			error(1, "Error allocating directory");
+		}
+		shards[i].used = 0;
+		shards[i].live = 0;
+	}
+	num_readers = readers_count;
+	readers = memalloc(num_readers * sizeof(dir_reader_t));
+	if (!readers) {
+		error(1, "Error allocating directory");
+	}
+	for (int i = 0; i < num_readers; i++) {
+		readers[i].seen = DIR_OFFLINE;
+		readers[i].retired = NULL;
+	}
+}
+
+/*
+ * Copy live clients into a new table and publish it, dropping tombstones
+ * Grows the table when it is more than half full of live clients
+ * Shard lock must be held
+ */
+static int dir_rebuild(int id, dir_shard_t *shard)
+{
+	dir_table_t *old = shard->table;
+	size_t size = shard->live * 2 >= old->size ? old->size * 2 : old->size;
+	dir_table_t *table = dir_table_new(size);
+	if (!table) return 1;
+
+	for (size_t i = 0; i < old->size; i++) {
+		client_t *client = old->slots[i];
+		if (client == NULL || client == DIR_TOMBSTONE) continue;
+		size_t index = (pk_hash(client->pk) / DIR_SHARDS) & (size - 1);
+		while (table->slots[index] != NULL)
+			index = (index + 1) & (size - 1);
+		table->slots[index] = client;
+	}
+	__atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+	shard->used = shard->live;
+	/* Lock-free readers may still be probing the old table */
+	dir_retire(id, old);
+	return 0;
+}
+
+/*
+ * Register client under its public key, replacing an older connection of the
+ * same user. id is the calling worker, needed to retire replaced tables.
+ */
+int dir_add(int id, client_t *client)
+{
+	uint64_t hash = pk_hash(client->pk);
+	dir_shard_t *shard = &shards[hash % DIR_SHARDS];
+
+	pthread_mutex_lock(&shard->lock);
+	/* Keep at least a quarter of the slots empty so probing terminates early */
+	if ((shard->used + 1) * 4 > shard->table->size * 3) {
+		if (dir_rebuild(id, shard) != 0) {
+			pthread_mutex_unlock(&shard->lock);
+			return 1;
+		}
+	}
+
+	dir_table_t *table = shard->table;
+	size_t mask = table->size - 1;
+	size_t index = (hash / DIR_SHARDS) & mask;
+	client_t **free_slot = NULL;
+
+	while (table->slots[index] != NULL) {
+		client_t *slot = table->slots[index];
+		if (slot == DIR_TOMBSTONE) {
+			if (!free_slot) free_slot = &table->slots[index];
+		} else if (memcmp(slot->pk, client->pk, PK_SIZE) == 0) {
+			/* Same user logged in again, newest connection receives messages */
+			__atomic_store_n(&table->slots[index], client, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&shard->lock);
+			return 0;
+		}
+		index = (index + 1) & mask;
+	}
+	if (!free_slot) {
+		free_slot = &table->slots[index];
+		shard->used++;
+	}
+	__atomic_store_n(free_slot, client, __ATOMIC_RELEASE);
+	shard->live++;
+	pthread_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+/*
+ * Unregister client, does nothing if another connection took over its name
+ * Caller has to retire client instead of freeing it
+ */
+int dir_remove(int id, client_t *client)
+{
+	uint64_t hash = pk_hash(client->pk);
+	dir_shard_t *shard = &shards[hash % DIR_SHARDS];
+	int removed = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	dir_table_t *table = shard->table;
+	size_t mask = table->size - 1;
+	size_t index = (hash / DIR_SHARDS) & mask;
+
+	for (size_t probes = 0; probes < table->size && table->slots[index] != NULL;
+			probes++) {
+		if (table->slots[index] == client) {
+			__atomic_store_n(&table->slots[index], DIR_TOMBSTONE, __ATOMIC_RELEASE);
+			shard->live--;
+			removed = 1;
+			break;
+		}
+		index = (index + 1) & mask;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return removed;
+}
+
+/*
+ * Find client by binary public key without taking any lock
+ * Returned client stays valid until the calling worker goes offline
+ */
+client_t *dir_lookup(uint8_t *pk)
+{
+	uint64_t hash = pk_hash(pk);
+	dir_shard_t *shard = &shards[hash % DIR_SHARDS];
+	dir_table_t *table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+	size_t mask = table->size - 1;
+	size_t index = (hash / DIR_SHARDS) & mask;
+
+	for (size_t probes = 0; probes < table->size; probes++) {
+		client_t *slot = __atomic_load_n(&table->slots[index], __ATOMIC_ACQUIRE);
+		if (slot == NULL) break;
+		if (slot != DIR_TOMBSTONE && memcmp(slot->pk, pk, PK_SIZE) == 0)
+			return slot;
+		index = (index + 1) & mask;
+	}
+	return NULL;
+}
+
+/*
+ * Call fn on every registered client, a shard at a time under its lock
+ * Clients can't be retired meanwhile, fn must not touch the directory
+ */
+void dir_foreach(void (*fn)(client_t *client, void *arg), void *arg)
+{
+	for (int i = 0; i < DIR_SHARDS; i++) {
+		dir_shard_t *shard = &shards[i];
+		pthread_mutex_lock(&shard->lock);
+		dir_table_t *table = shard->table;
+		for (size_t j = 0; j < table->size; j++) {
+			client_t *client = table->slots[j];
+			if (client && client != DIR_TOMBSTONE) fn(client, arg);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/*
+ * Worker is about to touch the directory
+ */
+void dir_online(int id)
+{
+	__atomic_store_n(&readers[id].seen, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Worker holds no directory references, eg. while blocked in epoll_wait
+ */
+void dir_offline(int id)
+{
+	__atomic_store_n(&readers[id].seen, DIR_OFFLINE, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Free ptr once no worker can still be reading it
+ */
+void dir_retire(int id, void *ptr)
+{
+	retired_t *r = memalloc(sizeof(retired_t));
+	if (!r) {
+		/* Leaking is better than freeing memory other workers may read */
+		return;
+	}
+	r->ptr = ptr;
+	r->epoch = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+	r->next = readers[id].retired;
+	readers[id].retired = r;
+}
+
+/*
+ * Start a new epoch, once dir_grace() reaches it no worker can still act on
+ * what it read before the call
+ */
+uint64_t dir_advance(void)
+{
+	return __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Oldest epoch any worker may still be reading under
+ */
+uint64_t dir_grace(void)
+{
+	uint64_t min = DIR_OFFLINE;
+	for (int i = 0; i < num_readers; i++) {
+		uint64_t seen = __atomic_load_n(&readers[i].seen, __ATOMIC_SEQ_CST);
+		if (seen < min) min = seen;
+	}
+	return min;
+}
+
+/*
+ * Free retired memory of worker id retired no later than grace,
+ * grace must come from dir_grace()
+ */
+void dir_reclaim(int id, uint64_t grace)
+{
+	retired_t **r = &readers[id].retired;
+	while (*r) {
+		if ((*r)->epoch <= grace) {
+			retired_t *done = *r;
+			*r = done->next;
+			free(done->ptr);
+			free(done);
+		} else {
+			r = &(*r)->next;
+		}
+	}
+}
@@ -0,0 +1,1012 @@
+#define _GNU_SOURCE /* accept4 */
+
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/ht.h"
+#include "zmr/dir.h"
+#include "zmr/queue.h"
+#include "zmr/mailbox.h"
+#include "zmr/fed.h"
+
+peer_t peers[FED_MAX_PEERS];
+int num_peers = 0;
+static int enabled = 0;
+static uint64_t node_id; /* Random, a restarted node is a new one */
+static int listen_fd = -1;
+static int event_fd = -1;
+static int epoll_fd = -1;
+static presence_t *presences; /* Lock-free stack */
+static fed_link_t **links; /* Accepted and pending links */
+static int num_links = 0;
+static int num_accepted = 0; /* Of links, taken from other nodes */
+static int data_links = 0; /* Taken from other nodes, updated atomically */
+static uint8_t fed_key[FED_KEY_SIZE]; /* All zero unless -K gave one */
+static int keyed = 0;
+static route_shard_t shards[FED_ROUTE_SHARDS];
+static pthread_t fed_thread;
+
+/*
+ * Build frame with fake signature as server frames have
+ * Returns length of frame
+ */
+static size_t fed_frame(uint8_t *frame, uint8_t type, uint8_t *data,
+		uint32_t length)
+{
+	frame[0] = type;
+	memcpy(&frame[sizeof(uint8_t)], &length, sizeof(length));
+	memcpy(&frame[PACKET_HEADER_SIZE], data, length);
+	memset(&frame[PACKET_HEADER_SIZE + length], 0, SIGN_SIZE);
+	return PACKET_HEADER_SIZE + length + SIGN_SIZE;
+}
+
+static route_shard_t *route_shard(uint8_t *pk)
+{
+	return &shards[pk_hash(pk) % FED_ROUTE_SHARDS];
+}
+
+/*
+ * Chain entry where route of pk is or belongs
+ * Shard lock must be held
+ */
+static route_t **route_find(route_shard_t *shard, uint8_t *pk)
+{
+	route_t **route = &shard->buckets[(pk_hash(pk) / FED_ROUTE_SHARDS) %
+		FED_ROUTE_BUCKETS];
+	while (*route && memcmp((*route)->pk, pk, PK_SIZE) != 0)
+		route = &(*route)->next;
+	return route;
+}
+
+/*
+ * Record user as connected to node, or as gone from it
+ */
+static void route_update(uint8_t *pk, uint64_t node, int online)
+{
+	route_shard_t *shard = route_shard(pk);
+	pthread_mutex_lock(&shard->lock);
+	route_t **link = route_find(shard, pk);
+	if (online) {
+		if (!*link) {
+			*link = memalloc(sizeof(route_t));
+			if (*link) {
+				memcpy((*link)->pk, pk, PK_SIZE);
+				(*link)->next = NULL;
+			}
+		}
+		/* Newest connection of a user wins like in the directory */
+		if (*link) (*link)->node = node;
+	} else if (*link && (*link)->node == node) {
+		route_t *route = *link;
+		*link = route->next;
+		free(route);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Drop every route to node, once no control link from it is left
+ */
+static void route_forget(uint64_t node)
+{
+	for (int i = 0; i < FED_ROUTE_SHARDS; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		for (int b = 0; b < FED_ROUTE_BUCKETS; b++) {
+			route_t **link = &shards[i].buckets[b];
+			while (*link) {
+				route_t *route = *link;
+				if (route->node == node) {
+					*link = route->next;
+					free(route);
+				} else {
+					link = &route->next;
+				}
+			}
+		}
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
+
+/*
+ * Node user is connected to, 0 if none is known
+ */
+static uint64_t route_lookup(uint8_t *pk)
+{
+	route_shard_t *shard = route_shard(pk);
+	pthread_mutex_lock(&shard->lock);
+	route_t *route = *route_find(shard, pk);
+	uint64_t node = route ? route->node : 0;
+	pthread_mutex_unlock(&shard->lock);
+	return node;
+}
+
+/*
+ * This thread's data link to the node user is connected to, NULL if no node
+ * with a link up has the user
+ */
+static client_t *fed_link(thread_t *thread, uint8_t *to)
+{
+	if (!enabled) return NULL;
+	uint64_t node = route_lookup(to);
+	if (!node) return NULL;
+	for (int i = 0; i < num_peers; i++) {
+		if (__atomic_load_n(&peers[i].node, __ATOMIC_RELAXED) != node) continue;
+		client_t *link = thread->links[i];
+		if (!link || link->state == CLIENT_CLOSED) return NULL;
+		return link;
+	}
+	return NULL;
+}
+
+/*
+ * Queue frame for a user connected to another node on this thread's data
+ * link to that node
+ * Returns 1 if frame was taken, 0 if no node with a link up has the user
+ */
+int fed_forward(thread_t *thread, uint8_t *to, out_t *out)
+{
+	client_t *link = fed_link(thread, to);
+	if (!link) return 0;
+
+	uint8_t frame[PACKET_HEADER_SIZE + PK_SIZE + SIGN_SIZE];
+	out_t *route = out_copy(thread, frame,
+			fed_frame(frame, ZSM_TYP_ROUTE, to, PK_SIZE));
+	if (!route) return 0;
+	/* Both are queued by this thread only, nothing comes in between */
+	enqueue(thread, link, route);
+	enqueue(thread, link, out);
+	metric_add(&thread->metrics.forwarded, 1);
+	return 1;
+}
+
+/*
+ * Bytes of frames for user which fit on this thread's data link before it is
+ * half full, the rest is left for live traffic
+ * Returns -1 if no node has the user, 0 while its link is full or down
+ */
+ssize_t fed_room(thread_t *thread, uint8_t *to)
+{
+	client_t *link = fed_link(thread, to);
+	if (!link) return enabled && route_lookup(to) ? 0 : -1;
+	if (link->out_bytes >= FED_QUEUE_LIMIT / 2) return 0;
+	return FED_QUEUE_LIMIT / 2 - link->out_bytes;
+}
+
+/*
+ * Handle frame read from a data link
+ * A ZSM_TYP_ROUTE frame names the recipient of the frame after it, which is
+ * delivered as is from the receive buffer
+ */
+int link_frame(thread_t *thread, client_t *client, uint8_t *frame,
+		size_t frame_len)
+{
+	/* Peer never writes to links this node opened */
+	if (client->link != LINK_IN) return ZSM_STA_SUCCESS;
+
+	packet_t pkt;
+	unpack_packet(&pkt, frame);
+	if (pkt.type == ZSM_TYP_ROUTE) {
+		if (pkt.length != PK_SIZE) return ZSM_STA_INVALID_LENGTH;
+		memcpy(client->route, pkt.data, PK_SIZE);
+		client->routed = 1;
+		return ZSM_STA_SUCCESS;
+	}
+	if (!client->routed) {
+		error(0, "Frame without recipient on link");
+		return ZSM_STA_INVALID_TYPE;
+	}
+	client->routed = 0;
+
+	out_t *out = out_new(thread, client->rbuf, frame, frame_len);
+	if (!out) return ZSM_STA_SUCCESS;
+	/* Origin node checked signature already, marks frame as not to be
+	 * forwarded again */
+	out->client = client;
+	out->stamp = now_ns();
+	route_to(thread, client->route, out);
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Data link was handed to thread
+ */
+void link_started(thread_t *thread, client_t *client)
+{
+	client->state = CLIENT_LINK;
+	if (client->link == LINK_OUT) {
+		thread->links[client->peer] = client;
+	}
+}
+
+/*
+ * Data link was dropped, federation thread connects a new one later
+ * Frames it didn't write all of are routed again, which stores them until
+ * they can be forwarded once more
+ */
+void link_dropped(thread_t *thread, client_t *client)
+{
+	if (client->link == LINK_IN) {
+		__atomic_sub_fetch(&data_links, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (client->link != LINK_OUT) return;
+	peer_t *peer = &peers[client->peer];
+	error(0, "Data link of thread %d to %s:%s is down", thread->id, peer->host,
+			peer->port);
+	if (thread->links[client->peer] == client) {
+		thread->links[client->peer] = NULL;
+	}
+	__atomic_store_n(&peer->up[thread->id], 0, __ATOMIC_RELAXED);
+
+	uint8_t *to = NULL, *last = NULL;
+	for (out_t *out = client->out_head; out; out = out->next) {
+		packet_t pkt;
+		unpack_packet(&pkt, out->data);
+		if (pkt.type == ZSM_TYP_ROUTE) {
+			to = pkt.data;
+			continue;
+		}
+		if (to && out->sent < out->length) {
+			/* Queue still references frame until it is cleared */
+			out_t *again = out_new(thread, out->buf, out->data, out->length);
+			if (again && route_to(thread, to, again) == ZSM_STA_SUCCESS &&
+					(!last || memcmp(last, to, PK_SIZE) != 0)) {
+				mailbox_remote(to);
+				last = to;
+			}
+		}
+		to = NULL;
+	}
+}
+
+/*
+ * Hand user connecting or leaving to federation thread, which tells peers
+ */
+void fed_presence(uint8_t *pk, int online)
+{
+	if (!enabled) return;
+	presence_t *presence = memalloc(sizeof(presence_t));
+	if (!presence) return;
+	memcpy(presence->pk, pk, PK_SIZE);
+	presence->online = online;
+
+	presence_t *head = __atomic_load_n(&presences, __ATOMIC_RELAXED);
+	do {
+		presence->next = head;
+	} while (!__atomic_compare_exchange_n(&presences, &head, presence, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (head == NULL) {
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+			error(0, "Error waking up federation thread");
+		}
+	}
+}
+
+static int buf_append(fed_buf_t *buf, uint8_t *data, size_t length)
+{
+	if (buf->length + length > buf->size) {
+		size_t size = buf->size ? buf->size : 4096;
+		while (size < buf->length + length) size *= 2;
+		uint8_t *grown = realloc(buf->data, size);
+		if (!grown) return -1;
+		buf->data = grown;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->length, data, length);
+	buf->length += length;
+	return 0;
+}
+
+/*
+ * Write as much of buf as socket takes
+ * Returns -1 once link is broken
+ */
+static int buf_flush(int fd, fed_buf_t *buf)
+{
+	size_t sent = 0;
+	while (sent < buf->length) {
+		ssize_t n = send(fd, buf->data + sent, buf->length - sent,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			errno = 0;
+			break;
+		} else if (n <= 0) {
+			return -1;
+		}
+		sent += n;
+	}
+	memmove(buf->data, buf->data + sent, buf->length - sent);
+	buf->length -= sent;
+	return 0;
+}
+
+/*
+ * Keyed hash of the other node's nonce followed by node frame data
+ */
+static void node_mac(uint8_t *mac, uint8_t *theirs, uint8_t *data)
+{
+	uint8_t msg[NODE_NONCE_SIZE + NODE_FRAME_SIZE - NODE_MAC_SIZE];
+	memcpy(msg, theirs, NODE_NONCE_SIZE);
+	memcpy(msg + NODE_NONCE_SIZE, data, NODE_FRAME_SIZE - NODE_MAC_SIZE);
+	crypto_generichash(mac, NODE_MAC_SIZE, msg, sizeof(msg), fed_key,
+			FED_KEY_SIZE);
+}
+
+/*
+ * Send whole ZSM_TYP_NODE frame of kind with nonce, answering theirs unless
+ * it is a challenge. Socket has timeouts set or is freshly accepted.
+ */
+static int node_send(int fd, int kind, uint8_t *nonce, uint8_t *theirs)
+{
+	uint8_t data[NODE_FRAME_SIZE];
+	uint8_t frame[NODE_FRAME_LEN];
+	memcpy(data, &node_id, sizeof(node_id));
+	data[sizeof(node_id)] = kind;
+	memcpy(data + sizeof(node_id) + 1, nonce, NODE_NONCE_SIZE);
+	uint8_t *mac = data + NODE_FRAME_SIZE - NODE_MAC_SIZE;
+	if (theirs) {
+		node_mac(mac, theirs, data);
+	} else {
+		memset(mac, 0, NODE_MAC_SIZE);
+	}
+	size_t length = fed_frame(frame, ZSM_TYP_NODE, data, NODE_FRAME_SIZE);
+	return send(fd, frame, length, MSG_NOSIGNAL | MSG_DONTWAIT) ==
+		(ssize_t) length ? 0 : -1;
+}
+
+/*
+ * Check ZSM_TYP_NODE frame, answering ours unless it is a challenge
+ * Returns kind of link or -1, node and nonce of the other node are stored
+ */
+static int node_check(uint8_t *frame, uint8_t *ours, uint64_t *node,
+		uint8_t *nonce)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, frame);
+	if (pkt.type != ZSM_TYP_NODE || pkt.length != NODE_FRAME_SIZE) return -1;
+	int kind = pkt.data[sizeof(*node)];
+	if (ours) {
+		uint8_t mac[NODE_MAC_SIZE];
+		node_mac(mac, ours, pkt.data);
+		if (sodium_memcmp(mac, pkt.data + NODE_FRAME_SIZE - NODE_MAC_SIZE,
+					NODE_MAC_SIZE) != 0) return -1;
+	} else if (kind != NODE_CHALLENGE) {
+		return -1;
+	}
+	memcpy(node, pkt.data, sizeof(*node));
+	memcpy(nonce, pkt.data + sizeof(*node) + 1, NODE_NONCE_SIZE);
+	return *node != 0 ? kind : -1;
+}
+
+/*
+ * Set socket of established link non-blocking, frames are small and
+ * shouldn't wait for more
+ */
+static int link_socket(int fd)
+{
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct timeval none = { 0, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Watch pending link for its ZSM_TYP_NODE frames until deadline
+ */
+static int link_watch(fed_link_t *link)
+{
+	link->pending = link->peer && link->kind == NODE_CONTROL ? 2 : 1;
+	link->deadline = time(NULL) + FED_TIMEOUT;
+	struct epoll_event event;
+	event.data.ptr = link;
+	event.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, link->fd, &event) == -1) return -1;
+	links[num_links++] = link;
+	return 0;
+}
+
+/*
+ * Open link of kind to peer, for worker tid if it is a data link
+ * The link is handed over once the peer's challenge was answered, a control
+ * link once the peer answered too
+ */
+static int fed_connect(peer_t *peer, int kind, int tid)
+{
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(peer->host, peer->port, &hints, &res) != 0) return -1;
+	/* Links are only taken from where peers are */
+	peer->num_addrs = 0;
+	for (struct addrinfo *ai = res; ai && peer->num_addrs < FED_MAX_ADDRS;
+			ai = ai->ai_next) {
+		memcpy(&peer->addrs[peer->num_addrs++], ai->ai_addr, ai->ai_addrlen);
+	}
+
+	int fd = -1;
+	struct timeval timeout = { FED_TIMEOUT, 0 };
+	for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) continue;
+		/* Bounds connect */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		/* Peer is down, tried again later */
+		errno = 0;
+		return -1;
+	}
+
+	fed_link_t *link = memalloc(sizeof(fed_link_t));
+	if (!link || link_socket(fd) != 0) {
+		free(link);
+		close(fd);
+		errno = 0;
+		return -1;
+	}
+	memset(link, 0, sizeof(fed_link_t));
+	link->fd = fd;
+	link->peer = peer;
+	link->kind = kind;
+	link->tid = tid;
+	randombytes_buf(link->nonce, sizeof(link->nonce));
+	if (link_watch(link) != 0) {
+		free(link);
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Connect data links of workers to peer which are down, once its control
+ * link is up
+ */
+static void fed_connect_data(peer_t *peer)
+{
+	for (int t = 0; t < num_threads && peer->control >= 0; t++) {
+		if (__atomic_load_n(&peer->up[t], __ATOMIC_RELAXED)) continue;
+		if (fed_connect(peer, NODE_DATA, t) != 0) break;
+		__atomic_store_n(&peer->up[t], 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void sync_user(client_t *client, void *arg)
+{
+	peer_t *peer = arg;
+	uint8_t data[PRESENCE_FRAME_SIZE];
+	uint8_t frame[PACKET_HEADER_SIZE + PRESENCE_FRAME_SIZE + SIGN_SIZE];
+	data[0] = 1;
+	memcpy(data + 1, client->pk, PK_SIZE);
+	buf_append(&peer->wbuf, frame,
+			fed_frame(frame, ZSM_TYP_PRESENCE, data, PRESENCE_FRAME_SIZE));
+}
+
+static void peer_down(peer_t *peer)
+{
+	error(0, "Control link to %s:%s is down", peer->host, peer->port);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peer->control, NULL);
+	close(peer->control);
+	peer->control = -1;
+	peer->wbuf.length = 0;
+}
+
+static void peer_flush(peer_t *peer)
+{
+	if (peer->control < 0) return;
+	if (peer->wbuf.length > FED_CONTROL_LIMIT ||
+			buf_flush(peer->control, &peer->wbuf) != 0) {
+		/* Everything is sent again once it is back */
+		peer_down(peer);
+	}
+}
+
+/*
+ * Connect links to peers which are down
+ * Data links are owned by workers, each has its own to every peer
+ */
+static void fed_reconnect(void)
+{
+	for (int i = 0; i < num_peers; i++) {
+		peer_t *peer = &peers[i];
+		if (peer->control < 0 && !peer->connecting &&
+				fed_connect(peer, NODE_CONTROL, 0) == 0) {
+			peer->connecting = 1;
+		}
+		fed_connect_data(peer);
+	}
+}
+
+/*
+ * Tell peers about users which connected or left since last time, in order
+ */
+static void fed_announce(void)
+{
+	presence_t *presence = __atomic_exchange_n(&presences, NULL,
+			__ATOMIC_ACQUIRE);
+	presence_t *list = NULL;
+	while (presence) {
+		presence_t *next = presence->next;
+		presence->next = list;
+		list = presence;
+		presence = next;
+	}
+	while (list) {
+		presence_t *next = list->next;
+		uint8_t data[PRESENCE_FRAME_SIZE];
+		uint8_t frame[PACKET_HEADER_SIZE + PRESENCE_FRAME_SIZE + SIGN_SIZE];
+		data[0] = list->online;
+		memcpy(data + 1, list->pk, PK_SIZE);
+		size_t length = fed_frame(frame, ZSM_TYP_PRESENCE, data,
+				PRESENCE_FRAME_SIZE);
+		for (int i = 0; i < num_peers; i++) {
+			if (peers[i].control >= 0)
+				buf_append(&peers[i].wbuf, frame, length);
+		}
+		free(list);
+		list = next;
+	}
+	for (int i = 0; i < num_peers; i++) {
+		peer_flush(&peers[i]);
+	}
+}
+
+/*
+ * Stop watching link accepted from another node and free it, its socket is
+ * left to the caller
+ */
+static void link_remove(fed_link_t *link)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+	for (int i = 0; i < num_links; i++) {
+		if (links[i] == link) {
+			links[i] = links[--num_links];
+			break;
+		}
+	}
+	if (!link->peer) num_accepted--;
+	free(link->rbuf.data);
+	free(link);
+}
+
+static void link_close(fed_link_t *link)
+{
+	close(link->fd);
+	peer_t *peer = link->peer;
+	int pending = link->pending;
+	uint64_t node = link->node;
+	if (peer && link->kind == NODE_CONTROL) {
+		peer->connecting = 0;
+	} else if (peer) {
+		/* Connected again later */
+		__atomic_store_n(&peer->up[link->tid], 0, __ATOMIC_RELAXED);
+	}
+	link_remove(link);
+	if (pending) return;
+	int others = 0;
+	for (int i = 0; i < num_links; i++) {
+		if (!links[i]->pending && links[i]->node == node) others = 1;
+	}
+	/* A newer link of the same node already sent its users */
+	if (!others) route_forget(node);
+	error(0, "Control link from node %016llx is gone",
+			(unsigned long long) node);
+}
+
+/*
+ * Take ZSM_TYP_NODE frame of link this node opened, answering the challenge
+ * and then taking the answer of a control link
+ * Returns 0 while link is still pending
+ */
+static int link_connected(fed_link_t *link)
+{
+	peer_t *peer = link->peer;
+	uint64_t node;
+	uint8_t nonce[NODE_NONCE_SIZE];
+	if (link->pending == 1 && link->kind == NODE_CONTROL) {
+		if (node_check(link->rbuf.data, link->nonce, &node, nonce) !=
+				NODE_CONTROL) {
+			error(0, "Rejecting control link to %s:%s without valid node frame",
+					peer->host, peer->port);
+			link_close(link);
+			return -1;
+		}
+		int fd = link->fd;
+		link_remove(link);
+		peer->connecting = 0;
+		struct epoll_event event;
+		event.data.ptr = peer;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+			close(fd);
+			return -1;
+		}
+		__atomic_store_n(&peer->node, node, __ATOMIC_RELAXED);
+		peer->control = fd;
+		error(0, "Control link to %s:%s is up", peer->host, peer->port);
+		/* Presence of users connected from now on follows this */
+		dir_foreach(sync_user, peer);
+		peer_flush(peer);
+		fed_connect_data(peer);
+		return -1;
+	}
+
+	if (node_check(link->rbuf.data, NULL, &node, nonce) != NODE_CHALLENGE ||
+			node_send(link->fd, link->kind, link->nonce, nonce) != 0) {
+		link_close(link);
+		return -1;
+	}
+	if (link->kind == NODE_CONTROL) {
+		link->pending = 1;
+		link->rbuf.length = 0;
+		return 0;
+	}
+
+	client_t *client = new_client(link->fd, link->tid);
+	if (!client) {
+		link_close(link);
+		return -1;
+	}
+	int tid = link->tid;
+	client->link = LINK_OUT;
+	client->peer = peer - peers;
+	link_remove(link);
+	__atomic_add_fetch(&threads[tid].num_clients, 1, __ATOMIC_RELAXED);
+	accept_push(&threads[tid], client);
+	return -1;
+}
+
+/*
+ * Take ZSM_TYP_NODE frame of pending link, data links from other nodes go to
+ * a worker
+ * Returns 0 if link stays a control link of this thread
+ */
+static int link_node(fed_link_t *link)
+{
+	if (link->peer) return link_connected(link);
+
+	uint64_t node;
+	uint8_t nonce[NODE_NONCE_SIZE];
+	int kind = node_check(link->rbuf.data, link->nonce, &node, nonce);
+	if (kind != NODE_CONTROL && kind != NODE_DATA) {
+		error(0, "Rejecting link without valid node frame");
+		link_close(link);
+		return -1;
+	}
+
+	if (kind == NODE_DATA) {
+		int fd = link->fd;
+		link_remove(link);
+		int tid = pick_thread(fd);
+		client_t *client = NULL;
+		if (__atomic_add_fetch(&data_links, 1, __ATOMIC_RELAXED) <=
+				FED_MAX_DATA_LINKS && tid >= 0) {
+			client = new_client(fd, tid);
+		}
+		if (!client) {
+			__atomic_sub_fetch(&data_links, 1, __ATOMIC_RELAXED);
+			close(fd);
+			return -1;
+		}
+		client->link = LINK_IN;
+		__atomic_add_fetch(&threads[tid].num_clients, 1, __ATOMIC_RELAXED);
+		accept_push(&threads[tid], client);
+		return -1;
+	}
+
+	if (node_send(link->fd, NODE_CONTROL, link->nonce, nonce) != 0) {
+		link_close(link);
+		return -1;
+	}
+	link->pending = 0;
+	link->node = node;
+	link->rbuf.length = 0;
+	/* Node sends all its users again */
+	route_forget(node);
+	error(0, "Control link from node %016llx", (unsigned long long) node);
+	return 0;
+}
+
+/*
+ * Apply presence frames read from control link of another node
+ * Nothing past its ZSM_TYP_NODE frame is read from a pending link, the rest
+ * belongs to the worker if it is a data link
+ */
+static void link_read(fed_link_t *link)
+{
+	uint8_t data[4096];
+	while (1) {
+		if (link->pending && link->rbuf.length == NODE_FRAME_LEN &&
+				link_node(link) != 0) {
+			return;
+		}
+		size_t want = link->pending ? NODE_FRAME_LEN - link->rbuf.length :
+			sizeof(data);
+		ssize_t n = recv(link->fd, data, want, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			errno = 0;
+			break;
+		} else if (n <= 0 || buf_append(&link->rbuf, data, n) != 0) {
+			link_close(link);
+			return;
+		}
+	}
+	if (link->pending) return;
+
+	size_t start = 0;
+	size_t frame_len;
+	int status;
+	while ((status = parse_frame(link->rbuf.data + start,
+					link->rbuf.length - start, &frame_len)) == ZSM_STA_SUCCESS) {
+		packet_t pkt;
+		unpack_packet(&pkt, link->rbuf.data + start);
+		if (pkt.type == ZSM_TYP_PRESENCE && pkt.length == PRESENCE_FRAME_SIZE) {
+			route_update(pkt.data + 1, link->node, pkt.data[0]);
+			/* Frames stored here while user was offline follow it */
+			if (pkt.data[0]) mailbox_remote(pkt.data + 1);
+		}
+		start += frame_len;
+	}
+	if (status != ZSM_STA_READING_SOCKET) {
+		link_close(link);
+		return;
+	}
+	memmove(link->rbuf.data, link->rbuf.data + start, link->rbuf.length - start);
+	link->rbuf.length -= start;
+}
+
+/*
+ * Address is one links are taken from, only the host is compared
+ */
+static int peer_allowed(struct sockaddr_storage *addr)
+{
+	for (int i = 0; i < num_peers; i++) {
+		for (int a = 0; a < peers[i].num_addrs; a++) {
+			struct sockaddr_storage *peer = &peers[i].addrs[a];
+			if (peer->ss_family != addr->ss_family) continue;
+			if (addr->ss_family == AF_INET &&
+					memcmp(&((struct sockaddr_in *) peer)->sin_addr,
+						&((struct sockaddr_in *) addr)->sin_addr,
+						sizeof(struct in_addr)) == 0) {
+				return 1;
+			}
+			if (addr->ss_family == AF_INET6 &&
+					memcmp(&((struct sockaddr_in6 *) peer)->sin6_addr,
+						&((struct sockaddr_in6 *) addr)->sin6_addr,
+						sizeof(struct in6_addr)) == 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Take link from a peer and challenge it, its ZSM_TYP_NODE frame is read once
+ * it arrives
+ */
+static void fed_accept(void)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	int fd = accept4(listen_fd, (struct sockaddr *) &addr, &addr_len,
+			SOCK_CLOEXEC);
+	if (fd < 0) {
+		errno = 0;
+		return;
+	}
+	if (!peer_allowed(&addr)) {
+		error(0, "Rejecting link from an address which isn't a peer");
+		close(fd);
+		return;
+	}
+
+	fed_link_t *link = num_accepted < FED_MAX_LINKS ?
+		memalloc(sizeof(fed_link_t)) : NULL;
+	if (!link || link_socket(fd) != 0) {
+		free(link);
+		close(fd);
+		return;
+	}
+	memset(link, 0, sizeof(fed_link_t));
+	link->fd = fd;
+	randombytes_buf(link->nonce, sizeof(link->nonce));
+	if (node_send(fd, NODE_CHALLENGE, link->nonce, NULL) != 0 ||
+			link_watch(link) != 0) {
+		free(link);
+		close(fd);
+		return;
+	}
+	num_accepted++;
+	link_read(link);
+}
+
+/*
+ * Drop links which didn't name themselves in time
+ */
+static void fed_expire(time_t now)
+{
+	for (int i = num_links - 1; i >= 0; i--) {
+		if (links[i]->pending && links[i]->deadline < now) {
+			error(0, "Rejecting link without node frame");
+			link_close(links[i]);
+		}
+	}
+}
+
+static void *fed_worker(void *arg)
+{
+	(void) arg;
+	struct epoll_event events[MAX_EVENTS];
+	time_t retry = 0;
+	while (1) {
+		time_t now = time(NULL);
+		if (now >= retry) {
+			fed_reconnect();
+			retry = now + FED_RETRY_INTERVAL;
+		}
+		fed_expire(now);
+		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS,
+				FED_RETRY_INTERVAL * 1000);
+		for (int i = 0; i < num_events; i++) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &event_fd) {
+				uint64_t count;
+				if (read(event_fd, &count, sizeof(count)) < 0) {
+					errno = 0;
+				}
+				fed_announce();
+			} else if (ptr == &listen_fd) {
+				fed_accept();
+			} else if ((peer_t *) ptr >= peers &&
+					(peer_t *) ptr < peers + num_peers) {
+				peer_t *peer = ptr;
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					/* Nothing but closing is expected from peer */
+					uint8_t data[256];
+					ssize_t n;
+					while ((n = recv(peer->control, data, sizeof(data), 0)) > 0);
+					if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+						peer_down(peer);
+						continue;
+					}
+					errno = 0;
+				}
+				peer_flush(peer);
+			} else {
+				link_read(ptr);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add peer given as host:port
+ */
+int fed_add_peer(char *address)
+{
+	char *colon = strrchr(address, ':');
+	if (!colon || colon == address || num_peers >= FED_MAX_PEERS) return -1;
+	peer_t *peer = &peers[num_peers];
+	peer->host = strndup(address, colon - address);
+	peer->port = strdup(colon + 1);
+	if (!peer->host || !peer->port) return -1;
+	peer->node = 0;
+	peer->control = -1;
+	memset(&peer->wbuf, 0, sizeof(fed_buf_t));
+	peer->up = NULL;
+	peer->num_addrs = 0;
+	peer->connecting = 0;
+	num_peers++;
+	return 0;
+}
+
+/*
+ * Read federation key shared by all nodes, 64 hex digits in file at path
+ */
+int fed_load_key(char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) return -1;
+	char hex[FED_KEY_SIZE * 2 + 2];
+	size_t key_len = 0;
+	int status = -1;
+	if (fgets(hex, sizeof(hex), file) &&
+			sodium_hex2bin(fed_key, sizeof(fed_key), hex, strlen(hex), "\n",
+				&key_len, NULL) == 0 && key_len == FED_KEY_SIZE) {
+		keyed = 1;
+		status = 0;
+	}
+	fclose(file);
+	return status;
+}
+
+/*
+ * Start federation thread once workers are set up, listening for other nodes
+ * on port unless it is 0
+ */
+int fed_init(int port)
+{
+	if (port == 0 && num_peers == 0) return 0;
+	randombytes_buf(&node_id, sizeof(node_id));
+	if (node_id == 0) node_id = 1;
+	for (int i = 0; i < FED_ROUTE_SHARDS; i++) {
+		if (pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+			error(1, "Error on initializing mutex");
+		}
+		for (int b = 0; b < FED_ROUTE_BUCKETS; b++)
+			shards[i].buckets[b] = NULL;
+	}
+	for (int i = 0; i < num_peers; i++) {
+		peers[i].up = memalloc(num_threads * sizeof(int));
+		if (!peers[i].up) return -1;
+		memset(peers[i].up, 0, num_threads * sizeof(int));
+	}
+	/* Every peer has a control link and one per worker pending at most */
+	links = memalloc((FED_MAX_LINKS + num_peers * (num_threads + 1)) *
+			sizeof(fed_link_t *));
+	if (!links) return -1;
+	for (int i = 0; i < num_threads; i++) {
+		threads[i].links = memalloc((num_peers + 1) * sizeof(client_t *));
+		if (!threads[i].links) return -1;
+		memset(threads[i].links, 0, (num_peers + 1) * sizeof(client_t *));
+	}
+
+	epoll_fd = epoll_create1(0);
+	event_fd = eventfd(0, EFD_NONBLOCK);
+	if (epoll_fd < 0 || event_fd < 0) return -1;
+	struct epoll_event event;
+	event.data.ptr = &event_fd;
+	event.events = EPOLLIN;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event) == -1) return -1;
+
+	if (port > 0) {
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int opt = 1;
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		/* Only other nodes which know the key are let in from elsewhere */
+		addr.sin_addr.s_addr = keyed ? INADDR_ANY : htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(port);
+		if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
+					&opt, sizeof(opt)) < 0 ||
+				bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+				listen(listen_fd, MAX_CONNECTION_QUEUE) < 0) {
+			error(0, "Error listening on federation port %d", port);
+			return -1;
+		}
+		if (!keyed) {
+			error(0, "No federation key given, only listening on loopback");
+		}
+		event.data.ptr = &listen_fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+			return -1;
+		}
+	}
+
+	enabled = 1;
+	if (pthread_create(&fed_thread, NULL, fed_worker, NULL) != 0) {
+		enabled = 0;
+		return -1;
+	}
+	error(0, "Node %016llx federating on port %d with %d peers",
+			(unsigned long long) node_id, port, num_peers);
+	return 0;
+}
@@ -1,133 +1,200 @@
 #include "zmr/ht.h"
 #include "config.h"
 #include "packet.h"
+#include "util.h"
 #include "zmr/zmr.h"
 
 /*
- * FNV-1a Hash Function
+ * FNV-1a over binary public key
  */
-unsigned int fnv1a_hash(char *name)
+uint64_t pk_hash(uint8_t *pk)
 {
-    unsigned int hash = FNV_OFFSET_BASIS;
-
-	int length = strnlen(name, MAX_NAME * 2 + 1);
-    for (size_t i = 0; i < length; i++) {
-        hash ^= (unsigned char) name[i];
-        hash *= FNV_PRIME;
-    }
+	uint64_t hash = FNV_OFFSET_BASIS;
+	for (size_t i = 0; i < PK_SIZE; i++) {
+		hash ^= pk[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
 
-    return hash % TABLE_SIZE;
+/*
+ * Top 7 bits of hash, index comes from the low bits so they are independent
+ */
+static uint8_t hash_tag(uint64_t hash)
+{
+	return (uint8_t) (hash >> 57) | 0x80;
 }
 
 /*
- * Initialize the hash table
+ * Initialize the hash table with at least size slots
  */
-void hashtable_init(client_t **hash_table)
+int hashtable_init(hashtable_t *table, size_t size)
 {
-	for (int i = 0; i < TABLE_SIZE; i++)
-		hash_table[i] = NULL;
+	size_t slots = HT_MIN_SIZE;
+	while (slots < size)
+		slots *= 2;
+	table->tags = memalloc(slots);
+	table->slots = memalloc(slots * sizeof(client_t *));
+	if (!table->tags || !table->slots) {
+		free(table->tags);
+		free(table->slots);
+		table->tags = NULL;
+		table->slots = NULL;
+		return 1;
+	}
+	memset(table->tags, HT_EMPTY, slots);
+	table->size = slots;
+	table->count = 0;
+	return 0;
 }
 
 /*
  * Print the hash table
  */
-void hashtable_print(client_t **hash_table)
+void hashtable_print(hashtable_t *table)
 {
-	for (int i = 0; i < TABLE_SIZE; i++) {
-		if (hash_table[i] == NULL) {
-			printf("%i. ---\n", i);
+	for (size_t i = 0; i < table->size; i++) {
+		if (table->tags[i] == HT_EMPTY) {
+			printf("%zu. ---\n", i);
 		} else {
-			printf("%i. | Name %s\n", i, hash_table[i]->username);
+			printf("%zu. | Name %s\n", i, table->slots[i]->username);
 		}
 	}
 }
 
-/* Gets hashed name and tries to store the client struct in that place */
-int hashtable_add(client_t **hash_table, client_t *p)
+/*
+ * Place client in first free slot of its probe sequence, table must have room
+ */
+static void hashtable_place(hashtable_t *table, client_t *client, uint64_t hash)
 {
-	if (p == NULL) return 0;
-
-	int index = fnv1a_hash(p->username);
-	int initial_index = index;
+	size_t mask = table->size - 1;
+	size_t index = hash & mask;
+	while (table->tags[index] != HT_EMPTY)
+		index = (index + 1) & mask;
+	table->tags[index] = hash_tag(hash);
+	table->slots[index] = client;
+}
 
-	 /* Linear probing until an empty slot is found */
-	while (hash_table[index] != NULL) {
-		index = (index + 1) % TABLE_SIZE; /* Move to next item */
-		/* the hash table is full as no available index back to initial index, cannot fit new item */
-		if (index == initial_index) return 1;
+/*
+ * Move every client into a table of new size
+ */
+static int hashtable_resize(hashtable_t *table, size_t size)
+{
+	hashtable_t new;
+	if (hashtable_init(&new, size) != 0) return 1;
+	for (size_t i = 0; i < table->size; i++) {
+		if (table->tags[i] != HT_EMPTY)
+			hashtable_place(&new, table->slots[i], pk_hash(table->slots[i]->pk));
 	}
-
-	hash_table[index] = p;
+	new.count = table->count;
+	free(table->tags);
+	free(table->slots);
+	*table = new;
 	return 0;
 }
 
-/* Search for a client in the hash table by name */
-client_t *hashtable_search(client_t **hash_table, char *username)
+/*
+ * Slot of client with public key pk, -1 if there is none
+ */
+static long hashtable_find(hashtable_t *table, uint8_t *pk, uint64_t hash)
 {
-	int index = fnv1a_hash(username);
-	int initial_index = index;
-	
+	size_t mask = table->size - 1;
+	size_t index = hash & mask;
+	uint8_t tag = hash_tag(hash);
+
 	/* Linear probing until an empty slot or the desired item is found */
-	while (hash_table[index] != NULL) {
-		if (strncmp(hash_table[index]->username, username, MAX_NAME * 2 + 1) == 0)
-			return hash_table[index];
-	
-		index = (index + 1) % TABLE_SIZE; /* Move to the next slot */
-		/* Back to same item */
-		if (index == initial_index) break;
+	while (table->tags[index] != HT_EMPTY) {
+		if (table->tags[index] == tag &&
+				memcmp(table->slots[index]->pk, pk, PK_SIZE) == 0)
+			return index;
+		index = (index + 1) & mask;
+	}
+	return -1;
+}
+
+/*
+ * Store client, replacing one with the same public key
+ * Grows the table once it is three quarters full
+ */
+int hashtable_add(hashtable_t *table, client_t *client)
+{
+	if (client == NULL) return 0;
+
+	uint64_t hash = pk_hash(client->pk);
+	long index = hashtable_find(table, client->pk, hash);
+	if (index >= 0) {
+		table->slots[index] = client;
+		return 0;
 	}
-	
-	return NULL;
+
+	if ((table->count + 1) * 4 > table->size * 3 &&
+			hashtable_resize(table, table->size * 2) != 0) {
+		/* Cannot grow, still fine while there is a free slot */
+		if (table->count + 1 >= table->size) return 1;
+	}
+	hashtable_place(table, client, hash);
+	table->count++;
+	return 0;
 }
 
-/* Remove a client from the hash table */
-int hashtable_remove(client_t **hash_table, char *username)
+/*
+ * Search for a client in the hash table by public key
+ */
+client_t *hashtable_search(hashtable_t *table, uint8_t *pk)
 {
-    int index = fnv1a_hash(username);
-    int initial_index = index;
-
-    /* Linear probing to find the item to remove */
-    while (hash_table[index] != NULL) {
-        if (strncmp(hash_table[index]->username, username, MAX_NAME * 2 + 1) == 0) {
-            /* Found the item, remove it */
-            hash_table[index] = NULL;
-
-            /* Rehash subsequent items */
-            int next_index = (index + 1) % TABLE_SIZE;
-            while (hash_table[next_index] != NULL) {
-                client_t *temp = hash_table[next_index];
-                hash_table[next_index] = NULL;
-				/* Re-add the item */
-                hashtable_add(hash_table, temp);
-                next_index = (next_index + 1) % TABLE_SIZE;
-            }
-
-            return 1;
-        }
- 
-        index = (index + 1) % TABLE_SIZE; /* Move to the next slot */
-        if (index == initial_index) break; /* Back to the starting slot */
-    }
-
-    return 0; 
+	long index = hashtable_find(table, pk, pk_hash(pk));
+	return index >= 0 ? table->slots[index] : NULL;
 }
 
-int hashtable_length(client_t **hash_table)
+/*
+ * Remove client from the hash table if it is the one stored under its key
+ * Later clients of the cluster are shifted back into the hole
+ */
+int hashtable_remove(hashtable_t *table, client_t *client)
+{
+	long found = hashtable_find(table, client->pk, pk_hash(client->pk));
+	if (found < 0 || table->slots[found] != client) return 0;
+
+	size_t mask = table->size - 1;
+	size_t hole = found;
+	size_t index = (hole + 1) & mask;
+	while (table->tags[index] != HT_EMPTY) {
+		size_t home = pk_hash(table->slots[index]->pk) & mask;
+		/* Entry may move back if hole lies between its home and it */
+		if (((index - home) & mask) >= ((index - hole) & mask)) {
+			table->tags[hole] = table->tags[index];
+			table->slots[hole] = table->slots[index];
+			hole = index;
+		}
+		index = (index + 1) & mask;
+	}
+	table->tags[hole] = HT_EMPTY;
+	table->count--;
+
+	/* Give memory back after a burst of clients left */
+	if (table->size > HT_MIN_SIZE && table->count * 8 < table->size)
+		hashtable_resize(table, table->size / 2);
+	return 1;
+}
+
+size_t hashtable_length(hashtable_t *table)
 {
-    int length = 0;
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        if (hash_table[i] != NULL) {
-            length++;  /* Increment for each non-null item */
-        }
-    }
-    return length;
+	return table->count;
 }
 
-void hashtable_free(client_t **hash_table)
+/*
+ * Free the table and every client in it
+ */
+void hashtable_free(hashtable_t *table)
 {
-	for (int i = 0; i < TABLE_SIZE; i++) {
-        if (hash_table[i] != NULL) {
-			free(hash_table[i]);
-        }
-    }
+	for (size_t i = 0; i < table->size; i++) {
+		if (table->tags[i] != HT_EMPTY)
+			free(table->slots[i]);
+	}
+	free(table->tags);
+	free(table->slots);
+	table->tags = NULL;
+	table->slots = NULL;
+	table->size = 0;
+	table->count = 0;
 }
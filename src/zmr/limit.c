@@ -0,0 +1,170 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/ht.h"
+#include "zmr/fed.h"
+#include "zmr/limit.h"
+
+#define SECOND_NS 1000000000ULL
+
+uint64_t limit_packets = LIMIT_PACKETS;
+uint64_t limit_bytes = LIMIT_BYTES;
+uint64_t user_packets = LIMIT_USER_PACKETS;
+uint64_t user_bytes = LIMIT_USER_BYTES;
+int user_connections = LIMIT_USER_CONNECTIONS;
+
+static limit_shard_t shards[LIMIT_SHARDS];
+
+static limit_shard_t *limit_shard(uint8_t *pk)
+{
+	return &shards[pk_hash(pk) % LIMIT_SHARDS];
+}
+
+/*
+ * Parse packets/s optionally followed by ,bytes/s
+ * Returns non-zero if arg is malformed or a frame wouldn't fit in a bucket
+ */
+int parse_limit(char *arg, uint64_t *packets, uint64_t *bytes)
+{
+	char *end;
+	errno = 0;
+	uint64_t p = strtoull(arg, &end, 10);
+	if (end == arg || errno != 0) return -1;
+	uint64_t b = *bytes;
+	if (*end == ',') {
+		char *start = end + 1;
+		b = strtoull(start, &end, 10);
+		if (end == start || errno != 0) return -1;
+	}
+	if (*end || (b > 0 && b * LIMIT_BURST < MAX_FRAME_SIZE)) return -1;
+	*packets = p;
+	*bytes = b;
+	return 0;
+}
+
+/*
+ * Nanoseconds until bucket filling at rate per second has cost left
+ */
+static uint64_t bucket_wait(uint64_t *full, uint64_t now, uint64_t cost,
+		uint64_t rate)
+{
+	if (rate == 0) return 0;
+	uint64_t base = __atomic_load_n(full, __ATOMIC_RELAXED);
+	if (base < now) base = now;
+	uint64_t next = base + cost * SECOND_NS / rate;
+	uint64_t limit = now + LIMIT_BURST * SECOND_NS;
+	return next > limit ? next - limit : 0;
+}
+
+/*
+ * Take cost out of bucket, other threads may take from it at the same time
+ */
+static void bucket_take(uint64_t *full, uint64_t now, uint64_t cost,
+		uint64_t rate)
+{
+	if (rate == 0) return;
+	uint64_t old = __atomic_load_n(full, __ATOMIC_RELAXED);
+	uint64_t next;
+	do {
+		next = (old > now ? old : now) + cost * SECOND_NS / rate;
+	} while (!__atomic_compare_exchange_n(full, &old, next, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Count connection of authenticated client against its user
+ * Returns ZSM_STA_UNAUTHORISED if user has too many connections already
+ */
+int limit_join(client_t *client)
+{
+	limit_shard_t *shard = limit_shard(client->pk);
+	pthread_mutex_lock(&shard->lock);
+	limit_t **link = &shard->buckets[(pk_hash(client->pk) / LIMIT_SHARDS) %
+		LIMIT_BUCKETS];
+	for (; *link; link = &(*link)->next) {
+		if (memcmp((*link)->pk, client->pk, PK_SIZE) == 0) break;
+	}
+	limit_t *limit = *link;
+	int status = ZSM_STA_SUCCESS;
+	if (limit && user_connections > 0 && limit->refs >= user_connections) {
+		status = ZSM_STA_UNAUTHORISED;
+	} else if (limit) {
+		limit->refs++;
+	} else if ((limit = memalloc(sizeof(limit_t)))) {
+		memcpy(limit->pk, client->pk, PK_SIZE);
+		limit->refs = 1;
+		limit->bucket.packets = limit->bucket.bytes = 0;
+		limit->next = NULL;
+		*link = limit;
+	} else {
+		status = ZSM_STA_MEMORY_ALLOCATION;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (status == ZSM_STA_SUCCESS) client->limit = limit;
+	return status;
+}
+
+/*
+ * Give connection of client back to its user
+ */
+void limit_leave(client_t *client)
+{
+	limit_t *limit = client->limit;
+	if (!limit) return;
+	client->limit = NULL;
+	limit_shard_t *shard = limit_shard(limit->pk);
+	pthread_mutex_lock(&shard->lock);
+	if (--limit->refs == 0) {
+		limit_t **link = &shard->buckets[(pk_hash(limit->pk) / LIMIT_SHARDS) %
+			LIMIT_BUCKETS];
+		while (*link != limit) link = &(*link)->next;
+		*link = limit->next;
+		free(limit);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Take frame of length bytes out of the buckets of client and its user
+ * A data link from another node carries many users and has its own rates
+ * Returns 0 if it was admitted, otherwise nanoseconds until it can be
+ */
+uint64_t limit_admit(client_t *client, size_t length)
+{
+	uint64_t now = now_ns();
+	uint64_t packets = client->link != LINK_NONE ? LIMIT_LINK_PACKETS :
+		limit_packets;
+	uint64_t bytes = client->link != LINK_NONE ? LIMIT_LINK_BYTES : limit_bytes;
+	uint64_t wait = bucket_wait(&client->bucket.packets, now, 1, packets);
+	uint64_t w = bucket_wait(&client->bucket.bytes, now, length, bytes);
+	if (w > wait) wait = w;
+	limit_t *limit = client->limit;
+	if (limit) {
+		w = bucket_wait(&limit->bucket.packets, now, 1, user_packets);
+		if (w > wait) wait = w;
+		w = bucket_wait(&limit->bucket.bytes, now, length, user_bytes);
+		if (w > wait) wait = w;
+	}
+	if (wait > 0) return wait;
+
+	/* Another connection of user may have taken from its buckets meanwhile,
+	 * it only goes over by a frame */
+	bucket_take(&client->bucket.packets, now, 1, packets);
+	bucket_take(&client->bucket.bytes, now, length, bytes);
+	if (limit) {
+		bucket_take(&limit->bucket.packets, now, 1, user_packets);
+		bucket_take(&limit->bucket.bytes, now, length, user_bytes);
+	}
+	return 0;
+}
+
+void limit_init(void)
+{
+	for (int i = 0; i < LIMIT_SHARDS; i++) {
+		if (pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+			error(1, "Error on initializing mutex");
+		}
+		for (int b = 0; b < LIMIT_BUCKETS; b++)
+			shards[i].buckets[b] = NULL;
+	}
+}
@@ -0,0 +1,771 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/ht.h"
+#include "zmr/dir.h"
+#include "zmr/queue.h"
+#include "zmr/mailbox.h"
+#include "zmr/fed.h"
+
+static mailbox_shard_t shards[MAILBOX_SHARDS];
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; /* Appends and segment list */
+static segment_t *segments; /* Oldest first */
+static segment_t *head; /* Segment appended to */
+static uint64_t next_seq;
+static uint64_t next_id;
+static char mail_dir[PATH_MAX - 32]; /* Room for segment names */
+static int64_t mail_ttl;
+static int enabled = 0;
+static int forwarding; /* Users whose frames are forwarded, updated atomically */
+static pthread_t syncer;
+
+static size_t record_size(size_t length)
+{
+	return sizeof(mail_record_t) + ((length + 7) & ~(size_t) 7);
+}
+
+static mail_record_t *mail_record(mail_t *mail)
+{
+	return (mail_record_t *) (mail->seg->map + mail->offset);
+}
+
+static void segment_path(char *path, uint64_t seq)
+{
+	snprintf(path, PATH_MAX, "%s/%016llx.seg", mail_dir, (unsigned long long) seq);
+}
+
+/*
+ * Map segment file, creating it at full size when create is set
+ */
+static segment_t *segment_open(uint64_t seq, int create)
+{
+	char path[PATH_MAX];
+	segment_path(path, seq);
+
+	segment_t *seg = memalloc(sizeof(segment_t));
+	if (!seg) return NULL;
+	memset(seg, 0, sizeof(segment_t));
+	seg->seq = seq;
+	seg->fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+	if (seg->fd < 0) {
+		error(0, "Error opening mailbox segment %s", path);
+		free(seg);
+		return NULL;
+	}
+	struct stat st;
+	if ((create && ftruncate(seg->fd, MAILBOX_SEGMENT_SIZE) != 0) ||
+			fstat(seg->fd, &st) != 0 || st.st_size != MAILBOX_SEGMENT_SIZE) {
+		error(0, "Mailbox segment %s has wrong size", path);
+		close(seg->fd);
+		free(seg);
+		return NULL;
+	}
+	seg->map = mmap(NULL, MAILBOX_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, seg->fd, 0);
+	if (seg->map == MAP_FAILED) {
+		error(0, "Error mapping mailbox segment %s", path);
+		close(seg->fd);
+		free(seg);
+		return NULL;
+	}
+	return seg;
+}
+
+static void segment_free(segment_t *seg)
+{
+	char path[PATH_MAX];
+	segment_path(path, seg->seq);
+	munmap(seg->map, MAILBOX_SEGMENT_SIZE);
+	close(seg->fd);
+	unlink(path);
+	free(seg);
+}
+
+/*
+ * Copy frame to the end of the log
+ * Log lock must be held
+ */
+static mail_t *log_append(uint8_t *to, uint8_t *frame, size_t length,
+		int64_t time, uint64_t id)
+{
+	size_t size = record_size(length);
+	if (!head || head->tail + size > MAILBOX_SEGMENT_SIZE) {
+		segment_t *seg = segment_open(next_seq, 1);
+		if (!seg) return NULL;
+		next_seq++;
+		if (head) {
+			head->sealed = 1;
+			head->next = seg;
+		} else {
+			segment_t **last = &segments;
+			while (*last) last = &(*last)->next;
+			*last = seg;
+		}
+		head = seg;
+	}
+
+	mail_t *mail = memalloc(sizeof(mail_t));
+	if (!mail) return NULL;
+	mail->seg = head;
+	mail->offset = head->tail;
+	mail->next = NULL;
+
+	mail_record_t *rec = mail_record(mail);
+	rec->state = MAIL_STORED;
+	rec->time = time;
+	rec->id = id;
+	memcpy(rec->to, to, PK_SIZE);
+	memcpy((uint8_t *) (rec + 1), frame, length);
+	/* Record only counts once length is there */
+	__atomic_store_n(&rec->length, (uint32_t) length, __ATOMIC_RELEASE);
+
+	head->tail += size;
+	head->records++;
+	__atomic_add_fetch(&head->live, 1, __ATOMIC_RELAXED);
+	if (time > head->newest) head->newest = time;
+	return mail;
+}
+
+/*
+ * Record is no longer needed, segment can go once nothing in it is
+ */
+static void mail_done(mail_t *mail)
+{
+	mail_record(mail)->state = MAIL_DELIVERED;
+	__atomic_sub_fetch(&mail->seg->live, 1, __ATOMIC_RELEASE);
+	free(mail);
+}
+
+static mailbox_shard_t *mailbox_shard(uint8_t *pk)
+{
+	return &shards[pk_hash(pk) % MAILBOX_SHARDS];
+}
+
+/*
+ * Find recipient's mailbox, creating it if create is set
+ * Shard lock must be held
+ */
+static mailbox_t *mailbox_find(mailbox_shard_t *shard, uint8_t *pk,
+		int create, mailbox_t ***link)
+{
+	mailbox_t **box = &shard->buckets[(pk_hash(pk) / MAILBOX_SHARDS) %
+		MAILBOX_BUCKETS];
+	for (; *box; box = &(*box)->next) {
+		if (memcmp((*box)->pk, pk, PK_SIZE) == 0) {
+			if (link) *link = box;
+			return *box;
+		}
+	}
+	if (!create) return NULL;
+	mailbox_t *new = memalloc(sizeof(mailbox_t));
+	if (!new) return NULL;
+	memcpy(new->pk, pk, PK_SIZE);
+	new->head = new->tail = NULL;
+	new->next = NULL;
+	*box = new;
+	if (link) *link = box;
+	return new;
+}
+
+static void mailbox_append(mailbox_t *box, mail_t *mail)
+{
+	mail->next = NULL;
+	if (box->tail)
+		box->tail->next = mail;
+	else
+		box->head = mail;
+	box->tail = mail;
+}
+
+/*
+ * Store frame for a recipient which isn't connected
+ * Returns 0 once stored, 1 if recipient came online meanwhile and -1 if frame
+ * couldn't be stored
+ */
+int mailbox_store(uint8_t *to, uint8_t *frame, size_t length)
+{
+	if (!enabled) return -1;
+
+	mailbox_shard_t *shard = mailbox_shard(to);
+	pthread_mutex_lock(&shard->lock);
+	/* mailbox_take runs under the same lock after recipient is in the
+	 * directory, so either it takes this frame or we see the recipient */
+	if (dir_lookup(to)) {
+		pthread_mutex_unlock(&shard->lock);
+		return 1;
+	}
+	mailbox_t *box = mailbox_find(shard, to, 1, NULL);
+	if (!box) {
+		pthread_mutex_unlock(&shard->lock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	mail_t *mail = log_append(to, frame, length, time(NULL), next_id++);
+	pthread_mutex_unlock(&log_lock);
+	if (mail) {
+		mailbox_append(box, mail);
+	} else if (!box->head) {
+		mailbox_t **link;
+		mailbox_find(shard, to, 0, &link);
+		*link = box->next;
+		free(box);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return mail ? 0 : -1;
+}
+
+/*
+ * Move stored frames of client which just authenticated to it
+ * Client must already be in the directory
+ */
+void mailbox_take(client_t *client)
+{
+	if (!enabled) return;
+
+	mailbox_shard_t *shard = mailbox_shard(client->pk);
+	mailbox_t **link;
+	pthread_mutex_lock(&shard->lock);
+	mailbox_t *box = mailbox_find(shard, client->pk, 0, &link);
+	if (box) {
+		*link = box->next;
+		client->mail = box->head;
+		free(box);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Put frames back in front of recipient's mailbox
+ */
+static void mailbox_prepend(uint8_t *pk, mail_t *list)
+{
+	mailbox_shard_t *shard = mailbox_shard(pk);
+	pthread_mutex_lock(&shard->lock);
+	mailbox_t *box = mailbox_find(shard, pk, 1, NULL);
+	if (box) {
+		mail_t *last = list;
+		while (last->next) last = last->next;
+		last->next = box->head;
+		if (!box->head) box->tail = last;
+		box->head = list;
+	} else {
+		while (list) {
+			mail_t *next = list->next;
+			mail_done(list);
+			list = next;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Queue next batch of client's stored frames, copied into one buffer
+ * Frames are only taken while the queue is short so a large backlog is
+ * streamed as the client reads it
+ */
+void mailbox_fill(thread_t *thread, client_t *client)
+{
+	size_t limit = max_queue / 2 < MAILBOX_BATCH ? max_queue / 2 : MAILBOX_BATCH;
+	if (client->out_bytes >= limit) return;
+	int64_t now = time(NULL);
+
+	size_t total = 0;
+	for (mail_t *mail = client->mail; mail; mail = mail->next) {
+		size_t length = mail_record(mail)->length;
+		if (total > 0 && client->out_bytes + total + length > limit) break;
+		total += length;
+	}
+	buf_t *buf = buf_new(thread, total);
+	if (!buf) return;
+
+	size_t used = 0;
+	while (client->mail && used < total) {
+		mail_t *mail = client->mail;
+		mail_record_t *rec = mail_record(mail);
+		if (rec->time + mail_ttl < now) {
+			used += rec->length;
+			client->mail = mail->next;
+			mail_done(mail);
+			continue;
+		}
+		uint8_t *frame = buf->data + used;
+		memcpy(frame, (uint8_t *) (rec + 1), rec->length);
+		/* Frame stays in client->mail for a later fill */
+		out_t *out = out_new(thread, buf, frame, rec->length);
+		if (!out) break;
+		used += rec->length;
+		client->mail = mail->next;
+		/* Record is only delivered once frame was written */
+		out->mail = mail;
+		enqueue(thread, client, out);
+	}
+	buf_release(buf);
+}
+
+/*
+ * Queued stored frame was written to its recipient
+ */
+void mailbox_sent(mail_t *mail)
+{
+	mail_done(mail);
+}
+
+/*
+ * Queued stored frame was thrown away before it was written, it is put back
+ * in front of its recipient's mailbox
+ */
+void mailbox_unsent(mail_t *mail)
+{
+	mail->next = NULL;
+	mailbox_prepend(mail_record(mail)->to, mail);
+}
+
+/*
+ * Put frames client didn't get before disconnecting back in front of its
+ * mailbox, those queued but not written included
+ */
+void mailbox_return(client_t *client)
+{
+	/* Queued ones are older than those not queued yet */
+	mail_t *list = NULL, **tail = &list;
+	for (out_t *out = client->out_head; out; out = out->next) {
+		if (!out->mail) continue;
+		*tail = out->mail;
+		tail = &out->mail->next;
+		out->mail = NULL;
+	}
+	*tail = client->mail;
+	client->mail = NULL;
+	if (list) mailbox_prepend(client->pk, list);
+}
+
+/*
+ * Store frame for a user on another node whose stored frames are still being
+ * forwarded, so it arrives after them
+ * Returns 1 once stored, 0 if frame can be forwarded right away
+ */
+int mailbox_defer(uint8_t *to, uint8_t *frame, size_t length)
+{
+	if (!enabled || !__atomic_load_n(&forwarding, __ATOMIC_RELAXED)) return 0;
+
+	mailbox_shard_t *shard = mailbox_shard(to);
+	pthread_mutex_lock(&shard->lock);
+	mailbox_t *box = mailbox_find(shard, to, 0, NULL);
+	mail_t *mail = NULL;
+	if (box) {
+		pthread_mutex_lock(&log_lock);
+		mail = log_append(to, frame, length, time(NULL), next_id++);
+		pthread_mutex_unlock(&log_lock);
+		if (mail) mailbox_append(box, mail);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return mail != NULL;
+}
+
+/*
+ * Push user onto thread's stack of users whose frames are forwarded
+ * Returns 1 if stack was empty
+ */
+static int forward_push(thread_t *thread, presence_t *presence)
+{
+	presence_t *head = __atomic_load_n(&thread->forwards, __ATOMIC_RELAXED);
+	do {
+		presence->next = head;
+	} while (!__atomic_compare_exchange_n(&thread->forwards, &head, presence, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return head == NULL;
+}
+
+/*
+ * User connected to another node, hand it to the thread forwarding its stored
+ * frames if it has any
+ * Called by federation thread, or by a worker whose data link was dropped
+ */
+void mailbox_remote(uint8_t *pk)
+{
+	if (!enabled) return;
+
+	mailbox_shard_t *shard = mailbox_shard(pk);
+	pthread_mutex_lock(&shard->lock);
+	mailbox_t *box = mailbox_find(shard, pk, 0, NULL);
+	pthread_mutex_unlock(&shard->lock);
+	if (!box) return;
+
+	presence_t *presence = memalloc(sizeof(presence_t));
+	if (!presence) return;
+	memcpy(presence->pk, pk, PK_SIZE);
+	presence->online = 1;
+	__atomic_add_fetch(&forwarding, 1, __ATOMIC_RELAXED);
+	thread_t *thread = &threads[pk_hash(pk) % num_threads];
+	if (forward_push(thread, presence)) {
+		thread_wake(thread);
+	}
+}
+
+/*
+ * Queue next batch of user's stored frames on this thread's data link to the
+ * node it is connected to
+ * That node can't tell how fast the user reads, so a batch is only as large
+ * as mailbox_fill() queues at a time and batches are FORWARD_TICK apart. The
+ * mailbox stays until its last batch is taken, mailbox_defer() keeps frames
+ * sent meanwhile behind it.
+ * Returns 1 if frames are left for a later batch
+ */
+static int mailbox_send(thread_t *thread, uint8_t *pk)
+{
+	ssize_t room = fed_room(thread, pk);
+	if (room <= 0) return room == 0;
+	size_t limit = max_queue / 2 < MAILBOX_BATCH ? max_queue / 2 : MAILBOX_BATCH;
+	if ((size_t) room < limit) limit = room;
+
+	mailbox_shard_t *shard = mailbox_shard(pk);
+	mailbox_t **link;
+	mail_t *mail = NULL, **tail = &mail;
+	size_t total = 0;
+	pthread_mutex_lock(&shard->lock);
+	/* User came back to this node, mailbox_take has the frames */
+	mailbox_t *box = dir_lookup(pk) ? NULL : mailbox_find(shard, pk, 0, &link);
+	while (box && box->head && (total == 0 ||
+				total + mail_record(box->head)->length <= limit)) {
+		total += mail_record(box->head)->length;
+		*tail = box->head;
+		tail = &box->head->next;
+		box->head = box->head->next;
+	}
+	*tail = NULL;
+	int more = box && box->head;
+	if (box && !more) {
+		*link = box->next;
+		free(box);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	int64_t now = time(NULL);
+	while (mail) {
+		mail_record_t *rec = mail_record(mail);
+		if (rec->time + mail_ttl >= now) {
+			out_t *out = out_copy(thread, (uint8_t *) (rec + 1), rec->length);
+			if (!out) break;
+			if (!fed_forward(thread, pk, out)) {
+				out_free(thread, out);
+				break;
+			}
+		}
+		mail_t *next = mail->next;
+		mail_done(mail);
+		mail = next;
+	}
+	if (!mail) return more;
+	mailbox_prepend(pk, mail);
+	return 1;
+}
+
+/*
+ * Forward stored frames of users who connected to another node
+ */
+void mailbox_forward(thread_t *thread)
+{
+	uint64_t now = now_ns();
+	if (now - thread->forward_time < (uint64_t) FORWARD_TICK * 1000000) return;
+	thread->forward_time = now;
+
+	presence_t *presence = __atomic_exchange_n(&thread->forwards, NULL,
+			__ATOMIC_ACQUIRE);
+	while (presence) {
+		presence_t *next = presence->next;
+		if (mailbox_send(thread, presence->pk)) {
+			forward_push(thread, presence);
+		} else {
+			__atomic_sub_fetch(&forwarding, 1, __ATOMIC_RELAXED);
+			free(presence);
+		}
+		presence = next;
+	}
+}
+
+/*
+ * Write appended records to disk, many stores share one msync
+ */
+static void mailbox_sync(void)
+{
+	segment_t *dirty[8];
+	size_t tails[8];
+	int count = 0;
+
+	pthread_mutex_lock(&log_lock);
+	for (segment_t *seg = segments; seg && count < 8; seg = seg->next) {
+		if (seg->synced < seg->tail) {
+			dirty[count] = seg;
+			tails[count] = seg->tail;
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&log_lock);
+
+	long page = sysconf(_SC_PAGESIZE);
+	for (int i = 0; i < count; i++) {
+		/* Only this thread frees segments, they stay mapped */
+		size_t start = dirty[i]->synced & ~(size_t) (page - 1);
+		if (msync(dirty[i]->map + start, tails[i] - start, MS_SYNC) != 0) {
+			error(0, "Error syncing mailbox segment %llu",
+					(unsigned long long) dirty[i]->seq);
+			continue;
+		}
+		dirty[i]->synced = tails[i];
+	}
+}
+
+/*
+ * Drop expired frames from index and move live frames out of mostly
+ * delivered segments, then delete segments nothing refers to
+ */
+static void mailbox_maintain(void)
+{
+	int64_t now = time(NULL);
+	int victims = 0;
+
+	pthread_mutex_lock(&log_lock);
+	for (segment_t *seg = segments; seg; seg = seg->next) {
+		if (!seg->sealed) continue;
+		int live = __atomic_load_n(&seg->live, __ATOMIC_ACQUIRE);
+		if (live == 0) continue;
+		if (seg->newest + mail_ttl < now) {
+			seg->expired = 1;
+			victims++;
+		} else if (live * MAILBOX_COMPACT_RATIO < seg->records) {
+			seg->compacting = 1;
+			victims++;
+		}
+	}
+	pthread_mutex_unlock(&log_lock);
+
+	for (int i = 0; victims && i < MAILBOX_SHARDS; i++) {
+		mailbox_shard_t *shard = &shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for (int b = 0; b < MAILBOX_BUCKETS; b++) {
+			mailbox_t **box = &shard->buckets[b];
+			while (*box) {
+				mail_t **mail = &(*box)->head;
+				mail_t *last = NULL;
+				while (*mail) {
+					segment_t *seg = (*mail)->seg;
+					if (seg->expired) {
+						mail_t *done = *mail;
+						*mail = done->next;
+						mail_done(done);
+						continue;
+					}
+					if (seg->compacting) {
+						mail_record_t *rec = mail_record(*mail);
+						pthread_mutex_lock(&log_lock);
+						mail_t *moved = log_append(rec->to,
+								(uint8_t *) (rec + 1), rec->length,
+								rec->time, rec->id);
+						pthread_mutex_unlock(&log_lock);
+						if (moved) {
+							/* Keeps its place in the mailbox */
+							moved->next = (*mail)->next;
+							mail_done(*mail);
+							*mail = moved;
+						}
+					}
+					last = *mail;
+					mail = &(*mail)->next;
+				}
+				(*box)->tail = last;
+				if (!(*box)->head) {
+					mailbox_t *empty = *box;
+					*box = empty->next;
+					free(empty);
+				} else {
+					box = &(*box)->next;
+				}
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	pthread_mutex_lock(&log_lock);
+	segment_t **seg = &segments;
+	while (*seg) {
+		(*seg)->compacting = 0;
+		if ((*seg)->sealed &&
+				__atomic_load_n(&(*seg)->live, __ATOMIC_ACQUIRE) == 0) {
+			segment_t *done = *seg;
+			*seg = done->next;
+			segment_free(done);
+		} else {
+			seg = &(*seg)->next;
+		}
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+static void *mailbox_worker(void *arg)
+{
+	(void) arg;
+	time_t maintained = 0;
+	struct timespec interval = {
+		.tv_sec = MAILBOX_SYNC_INTERVAL / 1000,
+		.tv_nsec = (MAILBOX_SYNC_INTERVAL % 1000) * 1000000L
+	};
+
+	while (1) {
+		nanosleep(&interval, NULL);
+		mailbox_sync();
+		if (time(NULL) - maintained >= MAILBOX_MAINTAIN_INTERVAL) {
+			mailbox_maintain();
+			maintained = time(NULL);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Order of records in a recipient's mailbox, a moved record is stored after
+ * newer ones
+ */
+static uint64_t mail_id(mail_t *mail)
+{
+	return mail_record(mail)->id;
+}
+
+/*
+ * Stable merge sort of mail list by id
+ */
+static mail_t *mail_sort(mail_t *list)
+{
+	if (!list || !list->next) return list;
+	mail_t *slow = list, *fast = list->next;
+	while (fast && fast->next) {
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	mail_t *right = slow->next;
+	slow->next = NULL;
+	mail_t *left = mail_sort(list);
+	right = mail_sort(right);
+
+	mail_t merged, *tail = &merged;
+	while (left && right) {
+		if (mail_id(right) < mail_id(left)) {
+			tail->next = right;
+			right = right->next;
+		} else {
+			tail->next = left;
+			left = left->next;
+		}
+		tail = tail->next;
+	}
+	tail->next = left ? left : right;
+	return merged.next;
+}
+
+/*
+ * Index records still waiting in segment left by a previous run
+ */
+static void segment_recover(segment_t *seg, int64_t now)
+{
+	size_t offset = 0;
+	while (offset + sizeof(mail_record_t) <= MAILBOX_SEGMENT_SIZE) {
+		mail_record_t *rec = (mail_record_t *) (seg->map + offset);
+		size_t frame_len;
+		if (rec->length == 0) break;
+		if (offset + record_size(rec->length) > MAILBOX_SEGMENT_SIZE ||
+				parse_frame((uint8_t *) (rec + 1), rec->length,
+					&frame_len) != ZSM_STA_SUCCESS ||
+				frame_len != rec->length) {
+			/* Torn write at crash, rest of segment is unusable */
+			error(0, "Mailbox segment %llu is corrupt at %zu",
+					(unsigned long long) seg->seq, offset);
+			break;
+		}
+		if (rec->id >= next_id) next_id = rec->id + 1;
+		if (rec->time > seg->newest) seg->newest = rec->time;
+		seg->records++;
+		if (rec->state == MAIL_STORED && rec->time + mail_ttl >= now) {
+			mail_t *mail = memalloc(sizeof(mail_t));
+			mailbox_t *box = mail ? mailbox_find(mailbox_shard(rec->to),
+					rec->to, 1, NULL) : NULL;
+			if (box) {
+				mail->seg = seg;
+				mail->offset = offset;
+				mailbox_append(box, mail);
+				seg->live++;
+			} else {
+				free(mail);
+			}
+		}
+		offset += record_size(rec->length);
+	}
+	seg->tail = seg->synced = offset;
+	seg->sealed = 1;
+}
+
+/*
+ * Open mailbox in dir and load what previous runs left, frames are kept for
+ * ttl seconds
+ */
+int mailbox_init(char *dir, int64_t ttl)
+{
+	snprintf(mail_dir, sizeof(mail_dir), "%s", dir);
+	mail_ttl = ttl;
+	for (int i = 0; i < MAILBOX_SHARDS; i++) {
+		if (pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+			error(1, "Error on initializing mutex");
+		}
+		for (int b = 0; b < MAILBOX_BUCKETS; b++)
+			shards[i].buckets[b] = NULL;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/", mail_dir);
+	mkdir_p(path);
+	DIR *d = opendir(mail_dir);
+	if (!d) {
+		error(0, "Cannot open mailbox directory %s", mail_dir);
+		return -1;
+	}
+	/* Load segments in order, list is kept sorted by seq */
+	struct dirent *entry;
+	int64_t now = time(NULL);
+	while ((entry = readdir(d))) {
+		unsigned long long seq;
+		char suffix[8];
+		if (sscanf(entry->d_name, "%16llx.%7s", &seq, suffix) != 2 ||
+				strcmp(suffix, "seg") != 0) continue;
+		/* Never reuse the name of a segment, even one that can't be read */
+		if (seq >= next_seq) next_seq = seq + 1;
+		segment_t *seg = segment_open(seq, 0);
+		if (!seg) continue;
+		segment_t **link = &segments;
+		while (*link && (*link)->seq < seq) link = &(*link)->next;
+		seg->next = *link;
+		*link = seg;
+	}
+	closedir(d);
+
+	size_t stored = 0;
+	for (segment_t *seg = segments; seg; seg = seg->next) {
+		segment_recover(seg, now);
+		stored += seg->live;
+	}
+	for (int i = 0; i < MAILBOX_SHARDS; i++) {
+		for (int b = 0; b < MAILBOX_BUCKETS; b++) {
+			for (mailbox_t *box = shards[i].buckets[b]; box; box = box->next) {
+				box->head = mail_sort(box->head);
+				box->tail = box->head;
+				while (box->tail->next) box->tail = box->tail->next;
+			}
+		}
+	}
+
+	if (pthread_create(&syncer, NULL, mailbox_worker, NULL) != 0) {
+		error(0, "Error on creating mailbox thread");
+		return -1;
+	}
+	enabled = 1;
+	error(0, "Mailbox at %s, %zu stored frames", mail_dir, stored);
+	return 0;
+}
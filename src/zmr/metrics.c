@@ -0,0 +1,308 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/verify.h"
+#include "zmr/metrics.h"
+
+static int metrics_fd = -1;
+static pthread_t server;
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Counters have a single writer, so a plain add stored atomically is enough
+ * for the metrics thread to never see a torn value
+ */
+void metric_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void metric_sub(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter - n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Values below 2 * HIST_SUB have a bucket each, then every power of 2 is
+ * split in HIST_SUB buckets
+ */
+static int hist_bucket(uint64_t value)
+{
+	if (value < 2 * HIST_SUB) return value;
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+/*
+ * Highest value counted in bucket
+ */
+static uint64_t hist_value(int bucket)
+{
+	if (bucket < 2 * HIST_SUB) return bucket;
+	int shift = bucket / HIST_SUB - 1;
+	uint64_t sub = bucket % HIST_SUB + HIST_SUB;
+	return ((sub + 1) << shift) - 1;
+}
+
+void hist_record(hist_t *hist, uint64_t ns)
+{
+	int bucket = hist_bucket(ns);
+	metric_add(&hist->buckets[bucket], 1);
+	metric_add(&hist->count, 1);
+	metric_add(&hist->sum, ns);
+	if (ns > hist->max) __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(hist_t *into, hist_t *hist)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		into->buckets[i] += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+	into->count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	into->sum += __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	if (max > into->max) into->max = max;
+}
+
+/*
+ * Value below which quantile q of recorded values are
+ * Buckets are copied one at a time, so count is recomputed from them
+ */
+static uint64_t hist_quantile(hist_t *hist, double q)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		total += hist->buckets[i];
+	if (total == 0) return 0;
+
+	uint64_t rank = (uint64_t) (q * total + 0.5);
+	if (rank == 0) rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			uint64_t value = hist_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+/*
+ * Field at offset of every thread's metrics, labelled with thread
+ */
+static void print_metric(FILE *out, char *name, char *type, char *help,
+		size_t offset)
+{
+	fprintf(out, "# HELP zmr_%s %s\n# TYPE zmr_%s %s\n", name, help, name, type);
+	for (int i = 0; i < num_threads; i++) {
+		uint64_t *value = (uint64_t *) ((uint8_t *) &threads[i].metrics + offset);
+		fprintf(out, "zmr_%s{thread=\"%d\"} %llu\n", name, i,
+				(unsigned long long) __atomic_load_n(value, __ATOMIC_RELAXED));
+	}
+}
+
+/*
+ * Histogram of every thread merged, as a summary in seconds
+ */
+static void print_summary(FILE *out, char *name, char *help, hist_t *hist)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	fprintf(out, "# HELP zmr_%s %s\n# TYPE zmr_%s summary\n", name, help, name);
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		fprintf(out, "zmr_%s{quantile=\"%g\"} %.9f\n", name, quantiles[i],
+				hist_quantile(hist, quantiles[i]) / 1e9);
+	}
+	fprintf(out, "zmr_%s_sum %.9f\n", name, hist->sum / 1e9);
+	fprintf(out, "zmr_%s_count %llu\n", name, (unsigned long long) hist->count);
+}
+
+static void print_pool(FILE *out, char *name, size_t offset)
+{
+	for (int i = 0; i < num_threads; i++) {
+		pool_t *pool = (pool_t *) ((uint8_t *) &threads[i] + offset);
+		size_t gets = __atomic_load_n(&pool->gets, __ATOMIC_RELAXED);
+		size_t puts = __atomic_load_n(&pool->puts, __ATOMIC_RELAXED);
+		size_t slabs = __atomic_load_n(&pool->slab_count, __ATOMIC_RELAXED);
+		fprintf(out, "zmr_pool_gets_total{thread=\"%d\",pool=\"%s\"} %zu\n",
+				i, name, gets);
+		fprintf(out, "zmr_pool_in_use{thread=\"%d\",pool=\"%s\"} %zu\n",
+				i, name, gets - puts);
+		fprintf(out, "zmr_pool_slabs{thread=\"%d\",pool=\"%s\"} %zu\n",
+				i, name, slabs);
+	}
+}
+
+#define COUNTER(name, field, help) \
+	print_metric(out, name, "counter", help, offsetof(metrics_t, field))
+#define GAUGE(name, field, help) \
+	print_metric(out, name, "gauge", help, offsetof(metrics_t, field))
+
+/*
+ * Write every metric in Prometheus text format
+ */
+static void metrics_print(FILE *out)
+{
+	fprintf(out, "# HELP zmr_clients Connections owned by thread\n"
+			"# TYPE zmr_clients gauge\n");
+	for (int i = 0; i < num_threads; i++) {
+		fprintf(out, "zmr_clients{thread=\"%d\"} %d\n", i,
+				__atomic_load_n(&threads[i].num_clients, __ATOMIC_RELAXED));
+	}
+	COUNTER("connections_total", connections, "Connections taken over by thread");
+	COUNTER("auths_ok_total", auths_ok, "Clients authenticated");
+	COUNTER("auths_failed_total", auths_failed, "Failed authentications");
+	COUNTER("packets_in_total", packets_in, "Frames received");
+	COUNTER("packets_out_total", packets_out, "Frames written");
+	COUNTER("bytes_in_total", bytes_in, "Bytes received");
+	COUNTER("bytes_out_total", bytes_out, "Bytes written");
+	COUNTER("verify_failures_total", verify_failures,
+			"Messages with bad signature or format");
+	COUNTER("unknown_recipients_total", unknown_recipients,
+			"Messages for recipients not connected");
+	COUNTER("mailbox_stored_total", mailbox_stored,
+			"Messages stored for offline recipients");
+	COUNTER("fanout_frames_total", fanout_frames,
+			"Channel messages relayed to a member");
+	COUNTER("forwarded_total", forwarded,
+			"Messages forwarded to other nodes");
+	COUNTER("handshake_timeouts_total", handshake_timeouts,
+			"Clients dropped for not answering the challenge in time");
+	COUNTER("idle_timeouts_total", idle_timeouts,
+			"Clients dropped for staying silent after a ping");
+	COUNTER("throttled_total", throttled,
+			"Times a connection went over a rate limit and stopped being read");
+	COUNTER("limit_rejects_total", limit_rejects,
+			"Connections rejected as their user had too many");
+	GAUGE("queued_frames", queued_frames, "Frames waiting to be written");
+	GAUGE("queued_bytes", queued_bytes, "Bytes waiting to be written");
+
+	hist_t *hist = memalloc(sizeof(hist_t));
+	if (!hist) return;
+	memset(hist, 0, sizeof(hist_t));
+	for (int i = 0; i < num_threads; i++)
+		hist_merge(hist, &threads[i].metrics.verify);
+	for (int i = 0; i < num_verifiers; i++)
+		hist_merge(hist, &verifiers[i].verify);
+	print_summary(out, "verify_seconds", "Signature check time", hist);
+
+	memset(hist, 0, sizeof(hist_t));
+	for (int i = 0; i < num_threads; i++)
+		hist_merge(hist, &threads[i].metrics.lookup);
+	print_summary(out, "lookup_seconds", "Recipient lookup time", hist);
+
+	memset(hist, 0, sizeof(hist_t));
+	for (int i = 0; i < num_threads; i++)
+		hist_merge(hist, &threads[i].metrics.relay);
+	print_summary(out, "relay_seconds",
+			"Time from receiving a message to writing it to recipient", hist);
+	free(hist);
+
+	fprintf(out, "# HELP zmr_pool_gets_total Blocks taken from pool\n"
+			"# TYPE zmr_pool_gets_total counter\n"
+			"# HELP zmr_pool_in_use Blocks not put back yet\n"
+			"# TYPE zmr_pool_in_use gauge\n"
+			"# HELP zmr_pool_slabs Slabs allocated by pool\n"
+			"# TYPE zmr_pool_slabs gauge\n");
+	print_pool(out, "rbufs", offsetof(thread_t, rbufs));
+	print_pool(out, "smalls", offsetof(thread_t, smalls));
+	print_pool(out, "outs", offsetof(thread_t, outs));
+	print_pool(out, "fanouts", offsetof(thread_t, fanout_pool));
+	fprintf(out, "# HELP zmr_pool_mallocs_total Buffers too big for any pool\n"
+			"# TYPE zmr_pool_mallocs_total counter\n"
+			"zmr_pool_mallocs_total %zu\n",
+			__atomic_load_n(&pool_mallocs, __ATOMIC_RELAXED));
+}
+
+/*
+ * Every connection gets the full text, then it is closed
+ */
+static void *metrics_worker(void *arg)
+{
+	while (1) {
+		int fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			error(0, "Error accepting metrics connection");
+			sleep(1);
+			continue;
+		}
+		/* Reader which doesn't read can't hold the next one up for long */
+		struct timeval timeout = { .tv_sec = METRICS_SEND_TIMEOUT };
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		char *text = NULL;
+		size_t length = 0;
+		FILE *out = open_memstream(&text, &length);
+		if (out) {
+			metrics_print(out);
+			fclose(out);
+			size_t sent = 0;
+			while (sent < length) {
+				ssize_t n = send(fd, text + sent, length - sent, MSG_NOSIGNAL);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) break;
+				sent += n;
+			}
+			free(text);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * Listen on Unix socket at path, a stale socket left there is replaced
+ */
+int metrics_init(char *path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		error(0, "Metrics socket path %s is too long", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			error(0, "%s exists and is not a socket", path);
+			return 1;
+		}
+		unlink(path);
+	}
+	mkdir_p(path);
+
+	metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (metrics_fd < 0) {
+		error(0, "Error creating metrics socket");
+		return 1;
+	}
+	if (bind(metrics_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+			chmod(path, 0600) != 0 ||
+			listen(metrics_fd, METRICS_BACKLOG) != 0) {
+		error(0, "Error listening on metrics socket %s", path);
+		close(metrics_fd);
+		metrics_fd = -1;
+		return 1;
+	}
+	if (pthread_create(&server, NULL, metrics_worker, NULL) != 0) {
+		error(0, "Error creating metrics thread");
+		close(metrics_fd);
+		metrics_fd = -1;
+		return 1;
+	}
+	return 0;
+}
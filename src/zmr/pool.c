@@ -0,0 +1,106 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/pool.h"
+
+/* Keeps payload aligned like malloc does */
+#define POOL_HEADER ((sizeof(pool_block_t) + 15) & ~(size_t) 15)
+
+size_t pool_mallocs = 0;
+
+/*
+ * Set up empty pool of size byte blocks, no memory is taken until first get
+ * so slabs end up local to the thread using them
+ */
+void pool_init(pool_t *pool, size_t size)
+{
+	size_t stride = POOL_HEADER + ((size + 15) & ~(size_t) 15);
+	pool->size = size;
+	pool->per_slab = POOL_SLAB_BYTES / stride > 0 ? POOL_SLAB_BYTES / stride : 1;
+	pool->free = NULL;
+	pool->returned = NULL;
+	pool->slabs = NULL;
+	pool->slab_count = 0;
+	pool->gets = 0;
+	pool->puts = 0;
+}
+
+/*
+ * Allocate one more slab and put all of its blocks on the free list
+ */
+static int pool_grow(pool_t *pool)
+{
+	size_t stride = POOL_HEADER + ((pool->size + 15) & ~(size_t) 15);
+	uint8_t *slab = memalloc(POOL_HEADER + pool->per_slab * stride);
+	if (!slab) return 1;
+	*(void **) slab = pool->slabs;
+	pool->slabs = slab;
+	pool->slab_count++;
+
+	for (size_t i = 0; i < pool->per_slab; i++) {
+		pool_block_t *block = (pool_block_t *) (slab + POOL_HEADER + i * stride);
+		block->pool = pool;
+		block->next = pool->free;
+		pool->free = block;
+	}
+	return 0;
+}
+
+/*
+ * Take a block, only called by the owner of pool
+ * Blocks other threads put back are reused before growing
+ */
+void *pool_get(pool_t *pool)
+{
+	if (!pool->free) {
+		pool->free = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+		if (!pool->free && pool_grow(pool) != 0) return NULL;
+	}
+	pool_block_t *block = pool->free;
+	pool->free = block->next;
+	pool->gets++;
+	return (uint8_t *) block + POOL_HEADER;
+}
+
+/*
+ * Block which doesn't fit any pool, pool_put frees it
+ */
+void *pool_malloc(size_t size)
+{
+	pool_block_t *block = memalloc(POOL_HEADER + size);
+	if (!block) return NULL;
+	block->pool = NULL;
+	__atomic_add_fetch(&pool_mallocs, 1, __ATOMIC_RELAXED);
+	return (uint8_t *) block + POOL_HEADER;
+}
+
+/*
+ * Give block back to the pool it came from, callable from any thread
+ */
+void pool_put(void *ptr)
+{
+	pool_block_t *block = (pool_block_t *) ((uint8_t *) ptr - POOL_HEADER);
+	pool_t *pool = block->pool;
+	if (!pool) {
+		free(block);
+		return;
+	}
+	__atomic_add_fetch(&pool->puts, 1, __ATOMIC_RELAXED);
+	pool_block_t *head = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+	do {
+		block->next = head;
+	} while (!__atomic_compare_exchange_n(&pool->returned, &head, block, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Print allocation counts, read racily so numbers may be slightly behind
+ */
+void pool_print(pool_t *pool, char *name)
+{
+	size_t gets = __atomic_load_n(&pool->gets, __ATOMIC_RELAXED);
+	size_t puts = __atomic_load_n(&pool->puts, __ATOMIC_RELAXED);
+	size_t slabs = __atomic_load_n(&pool->slab_count, __ATOMIC_RELAXED);
+	fprintf(stderr, "%s: %zu byte blocks, %zu gets, %zu puts, %zu in use, "
+			"%zu slabs (%zu blocks)\n", name, pool->size, gets, puts,
+			gets - puts, slabs, slabs * pool->per_slab);
+}
@@ -0,0 +1,297 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/queue.h"
+#include "zmr/mailbox.h"
+
+/*
+ * Allocate block with a single reference held by caller
+ * Taken from one of thread's pools unless it is bigger than a receive buffer
+ */
+buf_t *buf_new(thread_t *thread, size_t size)
+{
+	buf_t *buf;
+	if (size <= SMALL_BUFFER_SIZE)
+		buf = pool_get(&thread->smalls);
+	else if (size <= RECV_BUFFER_SIZE)
+		buf = pool_get(&thread->rbufs);
+	else
+		buf = pool_malloc(sizeof(buf_t) + size);
+	if (!buf) return NULL;
+	buf->refs = 1;
+	buf->size = size;
+	return buf;
+}
+
+void buf_hold(buf_t *buf)
+{
+	__atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop a reference, last one gives the block back to its pool
+ * Blocks are released by whichever thread wrote the last frame in it
+ */
+void buf_release(buf_t *buf)
+{
+	if (buf && __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		pool_put(buf);
+	}
+}
+
+/*
+ * Queue entry referencing frame inside buf, no bytes are copied
+ */
+out_t *out_new(thread_t *thread, buf_t *buf, uint8_t *frame, size_t length)
+{
+	out_t *out = pool_get(&thread->outs);
+	if (!out) return NULL;
+	buf_hold(buf);
+	out->next = NULL;
+	out->client = NULL;
+	out->buf = buf;
+	out->data = frame;
+	out->length = length;
+	out->sent = 0;
+	out->stamp = 0;
+	out->mail = NULL;
+	return out;
+}
+
+/*
+ * Queue entry with its own copy of frame, for packets built by server
+ */
+out_t *out_copy(thread_t *thread, uint8_t *frame, size_t length)
+{
+	buf_t *buf = buf_new(thread, length);
+	if (!buf) return NULL;
+	memcpy(buf->data, frame, length);
+	out_t *out = out_new(thread, buf, buf->data, length);
+	buf_release(buf);
+	return out;
+}
+
+/*
+ * Copy frame with its header written in version, for recipients speaking
+ * another one than its sender. Data and signature are left as they are.
+ * Returns what is to be queued instead, NULL if there was no memory
+ */
+out_t *out_convert(thread_t *thread, out_t *out, int version)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, out->data);
+	uint8_t header[PACKET_HEADER_MAX];
+	size_t header_len = pack_header(header, version, pkt.type, pkt.flags,
+			pkt.length, pkt.id);
+	uint8_t *body = out->data + frame_header_size(out->data);
+	size_t body_len = out->length - (body - out->data);
+
+	buf_t *buf = buf_new(thread, header_len + body_len);
+	out_t *converted = NULL;
+	if (buf) {
+		memcpy(buf->data, header, header_len);
+		memcpy(buf->data + header_len, body, body_len);
+		converted = out_new(thread, buf, buf->data, header_len + body_len);
+		buf_release(buf);
+	}
+	if (converted) {
+		converted->stamp = out->stamp;
+		converted->mail = out->mail;
+		out->mail = NULL;
+	}
+	out_free(thread, out);
+	return converted;
+}
+
+/*
+ * Release frame and give entry back to the thread which allocated it
+ * A stored frame which wasn't written goes back to the mailbox
+ */
+void out_free(thread_t *thread, out_t *out)
+{
+	if (out->mail) mailbox_unsent(out->mail);
+	buf_release(out->buf);
+	pool_put(out);
+}
+
+/*
+ * Append frame to client's queue, caller decides when to flush
+ */
+void queue_push(thread_t *thread, client_t *client, out_t *out)
+{
+	metric_add(&thread->metrics.queued_frames, 1);
+	metric_add(&thread->metrics.queued_bytes, out->length);
+	out->next = NULL;
+	if (client->out_tail)
+		client->out_tail->next = out;
+	else
+		client->out_head = out;
+	client->out_tail = out;
+	client->out_bytes += out->length;
+}
+
+/*
+ * Point iov at the unwritten part of up to max queued frames
+ * Returns number of iovecs filled
+ */
+int queue_iov(client_t *client, struct iovec *iov, int max)
+{
+	int iovcnt = 0;
+	for (out_t *out = client->out_head; out && iovcnt < max; out = out->next) {
+		iov[iovcnt].iov_base = out->data + out->sent;
+		iov[iovcnt].iov_len = out->length - out->sent;
+		iovcnt++;
+	}
+	return iovcnt;
+}
+
+/*
+ * Pop fully written entries, remember offset into partial one
+ */
+void queue_sent(thread_t *thread, client_t *client, size_t bytes_sent)
+{
+	client->out_bytes -= bytes_sent;
+	metric_add(&thread->metrics.bytes_out, bytes_sent);
+	metric_sub(&thread->metrics.queued_bytes, bytes_sent);
+	uint64_t now = 0;
+	while (bytes_sent > 0) {
+		out_t *out = client->out_head;
+		size_t left = out->length - out->sent;
+		if (bytes_sent < left) {
+			out->sent += bytes_sent;
+			break;
+		}
+		bytes_sent -= left;
+		client->out_head = out->next;
+		metric_add(&thread->metrics.packets_out, 1);
+		metric_sub(&thread->metrics.queued_frames, 1);
+		if (out->stamp) {
+			if (!now) now = now_ns();
+			hist_record(&thread->metrics.relay, now - out->stamp);
+		}
+		if (out->mail) {
+			mailbox_sent(out->mail);
+			out->mail = NULL;
+		}
+		out_free(thread, out);
+	}
+	if (!client->out_head)
+		client->out_tail = NULL;
+}
+
+/*
+ * Write as much of the queue as socket takes with one writev per batch
+ * Returns ZSM_STA_SUCCESS when queue is empty or socket is full, EPOLLOUT
+ * resumes flushing once it drains
+ */
+int queue_flush(thread_t *thread, client_t *client)
+{
+	while (client->out_head) {
+		struct iovec iov[FLUSH_IOV];
+		int iovcnt = queue_iov(client, iov, FLUSH_IOV);
+
+		ssize_t bytes_sent = writev(client->fd, iov, iovcnt);
+		if (bytes_sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				errno = 0;
+				return ZSM_STA_SUCCESS;
+			}
+			if (errno == EINTR) continue;
+			return ZSM_STA_WRITING_SOCKET;
+		}
+
+		queue_sent(thread, client, bytes_sent);
+		if (client->out_head && client->out_head->sent > 0) {
+			/* Short write, socket buffer is full */
+			return ZSM_STA_SUCCESS;
+		}
+	}
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Throw away everything queued for client
+ */
+void queue_clear(thread_t *thread, client_t *client)
+{
+	out_t *out = client->out_head;
+	while (out) {
+		out_t *next = out->next;
+		metric_sub(&thread->metrics.queued_frames, 1);
+		out_free(thread, out);
+		out = next;
+	}
+	metric_sub(&thread->metrics.queued_bytes, client->out_bytes);
+	client->out_head = client->out_tail = NULL;
+	client->out_bytes = 0;
+}
+
+/*
+ * Number of frames queued for client
+ */
+size_t queue_length(client_t *client)
+{
+	size_t length = 0;
+	for (out_t *out = client->out_head; out; out = out->next) {
+		length++;
+	}
+	return length;
+}
+
+/*
+ * Push entry on a lock-free stack many threads may push to
+ * Returns 1 if stack was empty, consumer has to be woken up then
+ */
+int out_push(out_t **stack, out_t *out)
+{
+	out_t *head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+	do {
+		out->next = head;
+	} while (!__atomic_compare_exchange_n(stack, &head, out, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return head == NULL;
+}
+
+/*
+ * Take every entry of stack, reversed to keep per producer order
+ */
+out_t *out_take(out_t **stack)
+{
+	out_t *out = __atomic_exchange_n(stack, NULL, __ATOMIC_ACQUIRE);
+	out_t *list = NULL;
+	while (out) {
+		out_t *next = out->next;
+		out->next = list;
+		list = out;
+		out = next;
+	}
+	return list;
+}
+
+/*
+ * Wake thread up from epoll_wait or io_uring_enter
+ */
+void thread_wake(thread_t *thread)
+{
+	uint64_t one = 1;
+	if (write(thread->event_fd, &one, sizeof(one)) != sizeof(one)) {
+		error(0, "Error waking up thread %d", thread->id);
+	}
+}
+
+/*
+ * Hand frame for client to the thread owning it, callable from any thread
+ * Owner is only woken up when its inbox was empty
+ */
+void inbox_push(thread_t *thread, client_t *client, out_t *out)
+{
+	out->client = client;
+	if (out_push(&thread->inbox, out)) {
+		thread_wake(thread);
+	}
+}
+
+out_t *inbox_take(thread_t *thread)
+{
+	return out_take(&thread->inbox);
+}
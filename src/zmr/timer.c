@@ -0,0 +1,148 @@
+#include <stddef.h>
+
+#include "zmr/timer.h"
+#include "zmr/metrics.h"
+
+#define TICK_NS ((uint64_t) TIMER_TICK * 1000000)
+
+/*
+ * Current time in ticks of the monotonic clock
+ */
+uint64_t timer_ticks(void)
+{
+	return now_ns() / TICK_NS;
+}
+
+void wheel_init(wheel_t *wheel)
+{
+	wheel->now = timer_ticks();
+	wheel->count = 0;
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+			wheel->slots[level][slot] = NULL;
+	}
+}
+
+void timeout_init(timeout_t *timeout, timeout_fn fn)
+{
+	timeout->expires = 0;
+	timeout->fn = fn;
+	timeout->next = NULL;
+	timeout->pprev = NULL;
+}
+
+/*
+ * Put timeout in the slot of the lowest level whose span still reaches it
+ */
+static void wheel_place(wheel_t *wheel, timeout_t *timeout)
+{
+	uint64_t delta = timeout->expires > wheel->now ?
+		timeout->expires - wheel->now : 0;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 &&
+			delta >= 1ULL << (WHEEL_BITS * (level + 1))) {
+		level++;
+	}
+	int slot = (timeout->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	timeout_t **head = &wheel->slots[level][slot];
+	timeout->next = *head;
+	if (*head) (*head)->pprev = &timeout->next;
+	timeout->pprev = head;
+	*head = timeout;
+}
+
+static void wheel_unlink(timeout_t *timeout)
+{
+	*timeout->pprev = timeout->next;
+	if (timeout->next) timeout->next->pprev = timeout->pprev;
+	timeout->next = NULL;
+	timeout->pprev = NULL;
+}
+
+/*
+ * Set timeout to go off at tick expires, replaces the one set before
+ * Due ticks are run at the earliest on the next tick
+ */
+void timeout_set(wheel_t *wheel, timeout_t *timeout, uint64_t expires)
+{
+	if (timeout->pprev) {
+		wheel_unlink(timeout);
+	} else {
+		wheel->count++;
+	}
+	if (expires <= wheel->now) expires = wheel->now + 1;
+	if (expires - wheel->now > WHEEL_MAX_TICKS) expires = wheel->now + WHEEL_MAX_TICKS;
+	timeout->expires = expires;
+	wheel_place(wheel, timeout);
+}
+
+void timeout_cancel(wheel_t *wheel, timeout_t *timeout)
+{
+	if (!timeout->pprev) return;
+	wheel_unlink(timeout);
+	wheel->count--;
+}
+
+/*
+ * Spread slot of level over the levels below, returns slot index
+ */
+static int wheel_cascade(wheel_t *wheel, int level)
+{
+	int slot = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	timeout_t *timeout = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+	while (timeout) {
+		timeout_t *next = timeout->next;
+		wheel_place(wheel, timeout);
+		timeout = next;
+	}
+	return slot;
+}
+
+/*
+ * Advance wheel to tick now calling every timeout due with arg, in order of
+ * ticks. A timeout is unset when it is called, it may set itself again.
+ */
+void wheel_run(wheel_t *wheel, uint64_t now, void *arg)
+{
+	while (wheel->now < now) {
+		if (wheel->count == 0) {
+			wheel->now = now;
+			break;
+		}
+		wheel->now++;
+		if ((wheel->now & (WHEEL_SLOTS - 1)) == 0) {
+			/* Levels above go on while the one below wrapped too */
+			for (int level = 1; level < WHEEL_LEVELS &&
+					wheel_cascade(wheel, level) == 0; level++);
+		}
+
+		timeout_t **head = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+		while (*head) {
+			timeout_t *timeout = *head;
+			wheel_unlink(timeout);
+			wheel->count--;
+			timeout->fn(arg, timeout);
+		}
+	}
+}
+
+/*
+ * Milliseconds until the wheel has to be run again, -1 if nothing is set
+ * Timeouts beyond level 0 wake it up when level 0 wraps to cascade them
+ */
+int wheel_timeout(wheel_t *wheel)
+{
+	if (wheel->count == 0) return -1;
+	uint64_t ticks = WHEEL_SLOTS - (wheel->now & (WHEEL_SLOTS - 1));
+	for (uint64_t i = 1; i < ticks; i++) {
+		if (wheel->slots[0][(wheel->now + i) & (WHEEL_SLOTS - 1)]) {
+			ticks = i;
+			break;
+		}
+	}
+	uint64_t due = (wheel->now + ticks) * TICK_NS;
+	uint64_t ns = now_ns();
+	if (due <= ns) return 0;
+	return (int) ((due - ns + 999999) / 1000000);
+}
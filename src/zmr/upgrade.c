@@ -0,0 +1,616 @@
+#define _GNU_SOURCE /* pipe2, MSG_CMSG_CLOEXEC */
+
+#include <limits.h>
+#include <sys/syscall.h>
+
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/dir.h"
+#include "zmr/queue.h"
+#include "zmr/uring.h"
+#include "zmr/mailbox.h"
+#include "zmr/upgrade.h"
+
+extern char **environ;
+
+int upgrading = 0; /* Set by main thread while workers stop for a handover */
+static int pipe_fds[2] = { -1, -1 }; /* Signals wake main thread */
+static char exe_path[PATH_MAX];
+static char **exe_argv;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER; /* Workers wait */
+static pthread_cond_t parked_cond = PTHREAD_COND_INITIALIZER; /* Main waits */
+static int parked = 0; /* Workers parked in this generation */
+static int generation = 0; /* Bumped to let parked workers run another round */
+static int *listeners; /* Handed over by replaced process, by LISTENER_* */
+static int num_listeners = 0;
+static client_t *resumed; /* Handed over clients until workers take them */
+
+/*
+ * Remember how this process was started, a new one is exec'd the same way
+ */
+void upgrade_init(char **argv)
+{
+	exe_argv = argv;
+	if (pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+		error(0, "Error setting up signal pipe, SIGUSR1 and SIGUSR2 are "
+				"ignored and the log isn't flushed on shutdown");
+		pipe_fds[0] = pipe_fds[1] = -1;
+		return;
+	}
+	ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+	if (len < 0) {
+		error(0, "Error setting up hot upgrade, SIGUSR2 is ignored");
+		len = 0;
+	}
+	/* Path of the binary, a new build moved there is what gets exec'd */
+	exe_path[len] = '\0';
+}
+
+/*
+ * Called from signal handler, which can't do more than write the signal to
+ * the pipe, the main thread handles it
+ */
+void upgrade_signal(int signal)
+{
+	int saved = errno;
+	char byte = signal;
+	if (pipe_fds[1] < 0 && signal != SIGUSR1 && signal != SIGUSR2 &&
+			signal != SIGPIPE) {
+		/* Nobody would hear of shutdown, log is left unflushed */
+		_exit(1);
+	}
+	if (pipe_fds[1] >= 0 && write(pipe_fds[1], &byte, 1) < 0) {
+		/* Pipe is full, the same signals are pending already */
+	}
+	errno = saved;
+}
+
+/*
+ * Quiet thread has nothing in flight towards other threads, verifiers or the
+ * kernel, each authorised client is fully described by its buffers
+ */
+static int thread_quiet(thread_t *thread)
+{
+	if (__atomic_load_n(&thread->inbox, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&thread->verified, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&thread->migrated, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&thread->accepted, __ATOMIC_ACQUIRE) ||
+			thread->moving || thread->fanouts || thread->dirty) {
+		return 0;
+	}
+	if (thread->ring && thread->ring->accepting) return 0;
+	for (client_t *client = thread->authorised; client;
+			client = client->auth_next) {
+		if (client->ops > 0) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Called at the end of a round while an upgrade is going on or was given up
+ * Thread stops reading its clients, once it is quiet it sleeps until the
+ * main thread lets it run another round or resume
+ */
+void upgrade_park(thread_t *thread)
+{
+	if (!__atomic_load_n(&upgrading, __ATOMIC_ACQUIRE)) {
+		thaw_thread(thread);
+		return;
+	}
+	if (!thread->frozen) freeze_thread(thread);
+	if (!thread_quiet(thread)) return;
+
+	/* Directory references must not be held while sleeping */
+	dir_offline(thread->id);
+	pthread_mutex_lock(&park_lock);
+	int gen = generation;
+	parked++;
+	pthread_cond_signal(&parked_cond);
+	while (__atomic_load_n(&upgrading, __ATOMIC_RELAXED) && gen == generation) {
+		pthread_cond_wait(&park_cond, &park_lock);
+	}
+	pthread_mutex_unlock(&park_lock);
+	dir_online(thread->id);
+	if (!__atomic_load_n(&upgrading, __ATOMIC_ACQUIRE)) thaw_thread(thread);
+}
+
+/*
+ * Whether anything was handed to a thread after it parked
+ */
+static int threads_idle(void)
+{
+	for (int i = 0; i < num_threads; i++) {
+		thread_t *thread = &threads[i];
+		if (__atomic_load_n(&thread->inbox, __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&thread->verified, __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&thread->migrated, __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&thread->accepted, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Wait until every worker parked and none of them got anything meanwhile
+ * Workers run another round whenever one did
+ * Returns non-zero if they didn't within UPGRADE_TIMEOUT
+ */
+static int park_workers(void)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += UPGRADE_TIMEOUT;
+
+	pthread_mutex_lock(&park_lock);
+	__atomic_store_n(&upgrading, 1, __ATOMIC_RELEASE);
+	parked = 0;
+	for (int i = 0; i < num_threads; i++) {
+		thread_wake(&threads[i]);
+	}
+	while (1) {
+		while (parked < num_threads) {
+			if (pthread_cond_timedwait(&parked_cond, &park_lock,
+						&deadline) == ETIMEDOUT) {
+				pthread_mutex_unlock(&park_lock);
+				return -1;
+			}
+		}
+		if (threads_idle()) break;
+		parked = 0;
+		generation++;
+		pthread_cond_broadcast(&park_cond);
+		for (int i = 0; i < num_threads; i++) {
+			thread_wake(&threads[i]);
+		}
+	}
+	pthread_mutex_unlock(&park_lock);
+	return 0;
+}
+
+/*
+ * Let parked workers go back to reading their clients
+ */
+static void resume_workers(void)
+{
+	pthread_mutex_lock(&park_lock);
+	__atomic_store_n(&upgrading, 0, __ATOMIC_RELEASE);
+	parked = 0;
+	generation++;
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+	for (int i = 0; i < num_threads; i++) {
+		thread_wake(&threads[i]);
+	}
+}
+
+/*
+ * Exec binary with the other end of a unix socket as UPGRADE_FD
+ * Returns its pid, -1 on error
+ */
+static pid_t spawn(int *sock)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+		return -1;
+	}
+	/* Only async-signal-safe calls are allowed between fork and exec, so
+	 * everything the child needs is prepared before */
+	size_t count = 0;
+	while (environ[count]) count++;
+	char **env = memalloc((count + 2) * sizeof(char *));
+	if (!env) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	char var[sizeof(UPGRADE_ENV) + 16];
+	snprintf(var, sizeof(var), "%s=%d", UPGRADE_ENV, UPGRADE_FD);
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+			env[n++] = environ[i];
+	}
+	env[n++] = var;
+	env[n] = NULL;
+	long max_fd = sysconf(_SC_OPEN_MAX);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		/* Sockets of clients are passed on the socket, they mustn't be
+		 * inherited or a dropped client would stay open */
+		if (fds[1] == UPGRADE_FD) {
+			fcntl(UPGRADE_FD, F_SETFD, 0);
+		} else if (dup2(fds[1], UPGRADE_FD) < 0) {
+			_exit(127);
+		}
+		if (syscall(SYS_close_range, UPGRADE_FD + 1, ~0U, 0) != 0) {
+			for (long fd = UPGRADE_FD + 1; fd < max_fd; fd++) close(fd);
+		}
+		execve(exe_path, exe_argv, env);
+		_exit(127);
+	}
+	free(env);
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return -1;
+	}
+	*sock = fds[0];
+	return pid;
+}
+
+/*
+ * Send record, with fd attached unless it is -1
+ */
+static int send_record(int sock, upgrade_record_t *record, int fd)
+{
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { record, sizeof(upgrade_record_t) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.space;
+		msg.msg_controllen = sizeof(control.space);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	ssize_t sent;
+	while ((sent = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR);
+	return sent == sizeof(upgrade_record_t) ? 0 : -1;
+}
+
+static int send_bytes(int sock, uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		size_t n = length < UPGRADE_CHUNK ? length : UPGRADE_CHUNK;
+		ssize_t sent = send(sock, data, n, 0);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent != (ssize_t) n) return -1;
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * Send socket of client with what it sent that wasn't handled, then what is
+ * queued for it, partial frame first
+ */
+static int send_client(int sock, client_t *client)
+{
+	upgrade_record_t record;
+	memset(&record, 0, sizeof(record));
+	record.kind = UPGRADE_CLIENT;
+	size_t in_len = client->rlen - client->rstart;
+	record.in_len = in_len + client->held_len;
+	for (out_t *out = client->out_head; out; out = out->next) {
+		record.out_len += out->length - out->sent;
+	}
+	memcpy(record.pk, client->pk, PK_SIZE);
+	record.version = client->version;
+	if (client->ws) {
+		record.websocket = 1;
+		record.ws = *client->ws;
+	}
+
+	if (send_record(sock, &record, client->fd) != 0 ||
+			send_bytes(sock, client->rbuf->data + client->rstart, in_len) != 0 ||
+			send_bytes(sock, client->held, client->held_len) != 0) {
+		return -1;
+	}
+	for (out_t *out = client->out_head; out; out = out->next) {
+		if (send_bytes(sock, out->data + out->sent, out->length - out->sent) != 0)
+			return -1;
+		/* New process writes it, it must not find it in the mailbox too */
+		if (out->mail) {
+			mailbox_sent(out->mail);
+			out->mail = NULL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hand listeners and authorised clients to a new process, exits once it
+ * took them over
+ * Returns non-zero if it didn't, nothing was closed here then
+ */
+static int handover(int *fds, int count)
+{
+	int sock;
+	pid_t pid = spawn(&sock);
+	if (pid < 0) {
+		error(0, "Error starting new process");
+		return -1;
+	}
+
+	upgrade_record_t record;
+	memset(&record, 0, sizeof(record));
+	record.kind = UPGRADE_HELLO;
+	record.in_len = UPGRADE_VERSION;
+	int status = send_record(sock, &record, -1);
+	record.kind = UPGRADE_LISTENER;
+	for (int i = 0; i < count && status == 0; i++) {
+		record.in_len = i;
+		if (fds[i] >= 0) status = send_record(sock, &record, fds[i]);
+	}
+	for (int i = 0; i < num_threads && status == 0; i++) {
+		record.in_len = LISTENER_THREAD(i);
+		if (threads[i].listen_fd >= 0)
+			status = send_record(sock, &record, threads[i].listen_fd);
+	}
+	int clients = 0;
+	for (int i = 0; i < num_threads && status == 0; i++) {
+		client_t *client = threads[i].authorised;
+		for (; client && status == 0; client = client->auth_next) {
+			status = send_client(sock, client);
+			clients++;
+		}
+	}
+	record.kind = UPGRADE_DONE;
+	if (status == 0) status = send_record(sock, &record, -1);
+
+	/* New process acks once it read everything */
+	struct pollfd pfd = { sock, POLLIN, 0 };
+	char ack;
+	if (status == 0 && (poll(&pfd, 1, UPGRADE_TIMEOUT * 1000) != 1 ||
+				recv(sock, &ack, 1, 0) != 1)) {
+		status = -1;
+	}
+	if (status != 0) {
+		error(0, "New process %d did not take over", pid);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		close(sock);
+		return -1;
+	}
+	error(0, "Handed %d clients over to process %d", clients, pid);
+	fflush(stdout);
+	log_flush();
+	/* Closing the socket tells new process mailbox and ports are free */
+	_exit(0);
+}
+
+/*
+ * Replace this process by a fresh exec of its binary
+ * Returns if upgrade failed, workers carry on then
+ */
+static void upgrade_run(int *fds, int count)
+{
+	error(0, "Upgrade requested, stopping workers");
+	if (park_workers() != 0) {
+		error(0, "Workers did not stop in time");
+	} else {
+		handover(fds, count);
+	}
+	resume_workers();
+	error(0, "Upgrade failed, carrying on");
+}
+
+/*
+ * Block main thread until one of the listeners it accepts on is readable,
+ * running an upgrade whenever one is requested meanwhile
+ * fds are numbered as LISTENER_*, -1 for ones this process doesn't have
+ * Returns index of the readable one, never if there is none
+ */
+int upgrade_wait(int *fds, int count)
+{
+	struct pollfd pfds[1 + count];
+	while (1) {
+		pfds[0].fd = pipe_fds[0];
+		pfds[0].events = POLLIN;
+		for (int i = 0; i < count; i++) {
+			pfds[1 + i].fd = fds[i];
+			pfds[1 + i].events = POLLIN;
+		}
+		if (poll(pfds, 1 + count, -1) < 0) {
+			if (errno != EINTR) error(0, "Error polling listener");
+			errno = 0;
+			continue;
+		}
+		if (pfds[0].revents & POLLIN) {
+			char bytes[16];
+			ssize_t n;
+			int pools = 0, upgrade = 0, shutdown = 0, pipes = 0;
+			while ((n = read(pipe_fds[0], bytes, sizeof(bytes))) > 0) {
+				for (ssize_t i = 0; i < n; i++) {
+					if (bytes[i] == SIGUSR1) pools = 1;
+					else if (bytes[i] == SIGUSR2) upgrade = 1;
+					else if (bytes[i] == SIGPIPE) pipes = 1;
+					else shutdown = 1;
+				}
+			}
+			errno = 0;
+			if (pipes) error(0, "SIGPIPE received");
+			/* Log is flushed before exiting */
+			if (shutdown) error(1, "Shutdown signal received");
+			if (pools) print_pools();
+			if (upgrade && exe_path[0]) upgrade_run(fds, count);
+			continue;
+		}
+		for (int i = 0; i < count; i++) {
+			if (pfds[1 + i].revents) return i;
+		}
+	}
+}
+
+/*
+ * Receive record, fd is set to the one attached if any
+ */
+static int recv_record(int sock, upgrade_record_t *record, int *fd)
+{
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { record, sizeof(upgrade_record_t) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.space;
+	msg.msg_controllen = sizeof(control.space);
+
+	ssize_t got;
+	while ((got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	*fd = -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (got > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if (got != sizeof(upgrade_record_t)) {
+		if (*fd >= 0) close(*fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Client for socket fd of record, with the bytes following it
+ */
+static client_t *recv_client(int sock, upgrade_record_t *record, int fd)
+{
+	size_t length = (size_t) record->in_len + record->out_len;
+	client_t *client = new_client(fd, -1);
+	resume_t *resume = memalloc(sizeof(resume_t) + length);
+	if (!client || !resume) goto failure;
+	resume->in_len = record->in_len;
+	resume->out_len = record->out_len;
+	size_t got = 0;
+	while (got < length) {
+		/* Messages are never longer than what is left */
+		ssize_t n = recv(sock, resume->data + got, length - got, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) goto failure;
+		got += n;
+	}
+	if (record->websocket) {
+		if (!(client->ws = memalloc(sizeof(ws_t)))) goto failure;
+		*client->ws = record->ws;
+		client->ws->http = NULL;
+	}
+	memcpy(client->pk, record->pk, PK_SIZE);
+	client->version = record->version;
+	client->resume = resume;
+	return client;
+
+failure:
+	close(fd);
+	if (client) ws_free(client);
+	free(client);
+	free(resume);
+	return NULL;
+}
+
+/*
+ * Take state over from the process which exec'd this one, if any
+ * Waits for it to exit, so it runs before mailbox and ports are opened
+ * Returns non-zero if state couldn't be read, old process carries on then
+ */
+int upgrade_receive(void)
+{
+	char *var = getenv(UPGRADE_ENV);
+	if (!var) return 0;
+	int sock = atoi(var);
+	unsetenv(UPGRADE_ENV);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	client_t *tail = NULL;
+	int count = 0, listening = 0, status = -1;
+	while (1) {
+		upgrade_record_t record;
+		int fd;
+		if (recv_record(sock, &record, &fd) != 0) break;
+		if (record.kind == UPGRADE_HELLO) {
+			if (record.in_len == UPGRADE_VERSION) continue;
+			error(0, "Replaced process has upgrade version %u, not %d",
+					record.in_len, UPGRADE_VERSION);
+		} else if (record.kind == UPGRADE_LISTENER && fd >= 0) {
+			int index = record.in_len;
+			int *grown = index < num_listeners ? listeners :
+				realloc(listeners, (index + 1) * sizeof(int));
+			if (grown) {
+				listeners = grown;
+				while (num_listeners <= index) listeners[num_listeners++] = -1;
+				listeners[index] = fd;
+				listening++;
+				continue;
+			}
+		} else if (record.kind == UPGRADE_CLIENT && fd >= 0) {
+			client_t *client = recv_client(sock, &record, fd);
+			if (client) {
+				if (tail)
+					tail->accept_next = client;
+				else
+					resumed = client;
+				tail = client;
+				count++;
+				continue;
+			}
+			fd = -1;
+		} else if (record.kind == UPGRADE_DONE) {
+			status = 0;
+		}
+		if (fd >= 0) close(fd);
+		break;
+	}
+
+	char byte = 1;
+	if (status == 0 && send(sock, &byte, 1, 0) != 1) status = -1;
+	/* Old process exits right after the ack */
+	ssize_t n;
+	while (status == 0 && (n = recv(sock, &byte, 1, 0)) != 0) {
+		if (n < 0 && errno != EINTR) break;
+	}
+	close(sock);
+	errno = 0;
+	if (status == 0) {
+		error(0, "Took over %d listeners and %d clients", listening, count);
+	}
+	return status;
+}
+
+/*
+ * Listener index handed over by replaced process, -1 if there is none
+ */
+int upgrade_listener(int index)
+{
+	return index < num_listeners ? listeners[index] : -1;
+}
+
+/*
+ * Hand clients taken over to workers, they resume them without a handshake
+ */
+void upgrade_resume(void)
+{
+	client_t *client = resumed;
+	resumed = NULL;
+	while (client) {
+		client_t *next = client->accept_next;
+		int tid = pick_thread(client->fd);
+		if (tid < 0) {
+			error(0, "All threads are full, dropping client");
+			close(client->fd);
+			free(client->resume);
+			free(client);
+		} else {
+			client->tid = tid;
+			__atomic_add_fetch(&threads[tid].num_clients, 1, __ATOMIC_RELAXED);
+			accept_push(&threads[tid], client);
+		}
+		client = next;
+	}
+}
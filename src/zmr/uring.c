@@ -0,0 +1,556 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/dir.h"
+#include "zmr/queue.h"
+#include "zmr/uring.h"
+#include "zmr/ws.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+		unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Pack request kind into the low bits of an aligned pointer
+ */
+static uint64_t uring_data(void *ptr, int kind)
+{
+	return (uint64_t) (uintptr_t) ptr | kind;
+}
+
+/*
+ * Publish prepared entries and let kernel consume them
+ * Waits for at least min_complete completions
+ */
+static int uring_submit(uring_t *ring, unsigned min_complete)
+{
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	while (1) {
+		int ret = sys_io_uring_enter(ring->fd, ring->to_submit, min_complete,
+				min_complete ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				errno = 0;
+				if (min_complete) return 0;
+				continue;
+			}
+			return -1;
+		}
+		ring->to_submit -= ret;
+		/* iovecs are copied by kernel once submitted */
+		if (ring->to_submit == 0) ring->iov_used = 0;
+		return 0;
+	}
+}
+
+/*
+ * Get a zeroed submission entry, submitting queued ones if ring is full
+ */
+static struct io_uring_sqe *uring_sqe(uring_t *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries) {
+		uring_submit(ring, 0);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+	}
+	unsigned index = ring->sq_local_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+/*
+ * Give buffer back to kernel, visible after uring_publish_buffers
+ */
+static void uring_recycle(uring_t *ring, unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	ring->br_tail++;
+}
+
+static void uring_publish_buffers(uring_t *ring)
+{
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Arm multishot receive, it keeps completing until socket closes or the
+ * buffer ring runs dry
+ */
+static int uring_recv(uring_t *ring, client_t *client)
+{
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	if (!sqe) return ZSM_STA_READING_SOCKET;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = uring_data(client, URING_RECV);
+	client->ops++;
+	client->receiving = 1;
+	return ZSM_STA_SUCCESS;
+}
+
+static void uring_read_event(thread_t *thread)
+{
+	uring_t *ring = thread->ring;
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	if (!sqe) return;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = thread->event_fd;
+	sqe->addr = (uint64_t) (uintptr_t) &ring->event_count;
+	sqe->len = sizeof(ring->event_count);
+	sqe->user_data = uring_data(thread, URING_EVENT);
+}
+
+/*
+ * Arm multishot accept on thread's own listener
+ */
+static void uring_accept(thread_t *thread)
+{
+	struct io_uring_sqe *sqe = uring_sqe(thread->ring);
+	if (!sqe) return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = thread->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = uring_data(thread, URING_ACCEPT);
+	thread->ring->accepting = 1;
+}
+
+static void uring_timeout(thread_t *thread, int timeout)
+{
+	uring_t *ring = thread->ring;
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	if (!sqe) return;
+	/* Armed timeout isn't shortened when an earlier one is set later */
+	if (timeout > RATE_TICK) timeout = RATE_TICK;
+	ring->tick.tv_sec = timeout / 1000;
+	ring->tick.tv_nsec = (timeout % 1000) * 1000000L;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t) (uintptr_t) &ring->tick;
+	sqe->len = 1;
+	sqe->user_data = uring_data(thread, URING_TIMEOUT);
+	ring->timeout_armed = 1;
+}
+
+/*
+ * Queue a writev of client's queue, one write per client is in flight
+ */
+int uring_flush(thread_t *thread, client_t *client)
+{
+	uring_t *ring = thread->ring;
+	/* Frozen thread leaves queues as they are for the new process */
+	if (client->sending || !client->out_head || thread->frozen)
+		return ZSM_STA_SUCCESS;
+
+	if (ring->iov_used + FLUSH_IOV > URING_IOV) {
+		uring_submit(ring, 0);
+		if (ring->iov_used + FLUSH_IOV > URING_IOV) {
+			/* Still not submitted, retry next round */
+			mark_dirty(thread, client);
+			return ZSM_STA_SUCCESS;
+		}
+	}
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	if (!sqe) {
+		mark_dirty(thread, client);
+		return ZSM_STA_SUCCESS;
+	}
+	struct iovec *iov = &ring->iov[ring->iov_used];
+	int iovcnt = queue_iov(client, iov, FLUSH_IOV);
+	ring->iov_used += iovcnt;
+
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = client->fd;
+	sqe->addr = (uint64_t) (uintptr_t) iov;
+	sqe->len = iovcnt;
+	sqe->user_data = uring_data(client, URING_SEND);
+	client->sending = 1;
+	client->ops++;
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Request of client finished, release client if it was the last one of a
+ * dropped client
+ */
+static void uring_done(thread_t *thread, client_t *client)
+{
+	client->ops--;
+	if (client->state == CLIENT_CLOSED && client->ops == 0) {
+		release_client(thread, client);
+	}
+}
+
+static void uring_handle_recv(thread_t *thread, client_t *client,
+		struct io_uring_cqe *cqe)
+{
+	uring_t *ring = thread->ring;
+	int more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && client->state != CLIENT_CLOSED) {
+			uint8_t *data = ring->buffers + (size_t) bid * URING_BUFFER_SIZE;
+			metric_add(&thread->metrics.bytes_in, cqe->res);
+			int status = feed_client(thread, client, data, cqe->res);
+			if (status == ZSM_STA_CLOSED_CONNECTION) {
+				/* WebSocket client sent close */
+				if (client->state == CLIENT_AUTHORISED)
+					error(0, "Client %s closed connection", client->username);
+				drop_client(thread, client);
+			} else if (status != ZSM_STA_SUCCESS) {
+				if (client->state == CLIENT_AUTHORISED)
+					error(0, "Error reading from client %s", client->username);
+				drop_client(thread, client);
+			}
+		}
+		uring_recycle(ring, bid);
+	}
+
+	if (client->state != CLIENT_CLOSED) {
+		if (cqe->res == 0) {
+			if (client->state == CLIENT_AUTHORISED)
+				error(0, "Client %s closed connection", client->username);
+			drop_client(thread, client);
+		} else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+				cqe->res != -ECANCELED) {
+			drop_client(thread, client);
+		}
+	}
+
+	if (!more) {
+		/* Multishot ended, rearm unless connection is gone or paused.
+		 * Running out of provided buffers ends it too */
+		client->receiving = 0;
+		if (client->state != CLIENT_CLOSED && !client_paused(thread, client) &&
+				uring_recv(ring, client) != ZSM_STA_SUCCESS) {
+			drop_client(thread, client);
+		}
+		uring_done(thread, client);
+	}
+}
+
+static void uring_handle_send(thread_t *thread, client_t *client,
+		struct io_uring_cqe *cqe)
+{
+	client->sending = 0;
+	if (client->state != CLIENT_CLOSED) {
+		if (cqe->res == -ECANCELED) {
+			/* Frozen for an upgrade, nothing was written */
+		} else if (cqe->res < 0) {
+			error(0, "Error writing to client %s", client->username);
+			drop_client(thread, client);
+		} else {
+			queue_sent(thread, client, cqe->res);
+			if (client->out_head || client->mail) mark_dirty(thread, client);
+		}
+	}
+	uring_done(thread, client);
+}
+
+/*
+ * Cancel request with user data target, client is kept until it went through
+ */
+static void uring_cancel(thread_t *thread, uint64_t target, client_t *client)
+{
+	struct io_uring_sqe *sqe = uring_sqe(thread->ring);
+	if (!sqe) return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = uring_data(client, URING_CANCEL);
+	if (client) client->ops++;
+}
+
+/*
+ * Cancel receive of throttled client, data still completing until the
+ * cancel went through is held
+ */
+void uring_pause(thread_t *thread, client_t *client)
+{
+	if (!client->receiving) return;
+	/* Without an entry held data only grows until the throttle goes off */
+	uring_cancel(thread, uring_data(client, URING_RECV), client);
+}
+
+/*
+ * Handle data held while client was throttled and receive again
+ */
+int uring_resume(thread_t *thread, client_t *client)
+{
+	uint8_t *held = client->held;
+	size_t held_len = client->held_len;
+	client->held = NULL;
+	client->held_len = 0;
+	int status = ZSM_STA_SUCCESS;
+	if (held) {
+		status = append_client(thread, client, held, held_len);
+		free(held);
+	}
+	if (status == ZSM_STA_SUCCESS && client->state != CLIENT_CLOSED &&
+			!client->throttled && !client->receiving) {
+		status = uring_recv(thread->ring, client);
+	}
+	return status;
+}
+
+/*
+ * Start receiving from new client and challenge it
+ */
+static void uring_add_client(thread_t *thread, client_t *client)
+{
+	client->rbuf = buf_new(thread, RECV_BUFFER_SIZE);
+	if (!client->rbuf || uring_recv(thread->ring, client) != ZSM_STA_SUCCESS) {
+		close(client->fd);
+		__atomic_sub_fetch(&thread->num_clients, 1, __ATOMIC_RELAXED);
+		buf_release(client->rbuf);
+		ws_free(client);
+		free(client);
+	} else {
+		start_client(thread, client);
+	}
+}
+
+static void uring_handle_accept(thread_t *thread, struct io_uring_cqe *cqe)
+{
+	if (cqe->res >= 0) {
+		client_t *client = accept_client(thread, cqe->res);
+		if (client) uring_add_client(thread, client);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE) return;
+	thread->ring->accepting = 0;
+	if (cqe->res == -EINVAL) {
+		error(0, "Thread %d cannot accept with io_uring", thread->id);
+	} else if (!thread->frozen) {
+		/* Stopped on an error such as running out of fds, rearm */
+		uring_accept(thread);
+	}
+}
+
+/*
+ * Cancel accept, receives and writes of authorised clients for an upgrade
+ * Completions still coming until cancels went through are held or queued
+ */
+void uring_freeze(thread_t *thread)
+{
+	if (thread->ring->accepting) {
+		uring_cancel(thread, uring_data(thread, URING_ACCEPT), NULL);
+	}
+	for (client_t *client = thread->authorised; client;
+			client = client->auth_next) {
+		uring_pause(thread, client);
+		if (client->sending)
+			uring_cancel(thread, uring_data(client, URING_SEND), client);
+	}
+}
+
+/*
+ * Upgrade was given up, accept again, clients are resumed by thaw_thread
+ */
+void uring_thaw(thread_t *thread)
+{
+	/* Otherwise accept is armed again once its cancel completed */
+	if (thread->listen_fd >= 0 && !thread->ring->accepting) {
+		uring_accept(thread);
+	}
+}
+
+/*
+ * Set up rings and provided buffers of thread
+ * Returns non-zero if kernel doesn't support what the backend needs
+ */
+int uring_init(thread_t *thread)
+{
+	uring_t *ring = memalloc(sizeof(uring_t));
+	if (!ring) return -1;
+	memset(ring, 0, sizeof(uring_t));
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		free(ring);
+		return -1;
+	}
+	/* iovecs live in a scratch array reused after every submit */
+	if (!(params.features & IORING_FEAT_SUBMIT_STABLE)) {
+		close(ring->fd);
+		free(ring);
+		return -1;
+	}
+
+	ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) goto failure;
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) goto failure;
+	}
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto failure;
+
+	uint8_t *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned *) (sq + params.sq_off.ring_entries);
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	/* Provided buffer ring, kernel picks a buffer for every receive */
+	ring->br_len = URING_BUFFERS * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED) goto failure;
+	ring->buffers = memalloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+	if (!ring->buffers) goto failure;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) ring->br;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto failure;
+	for (unsigned short bid = 0; bid < URING_BUFFERS; bid++) {
+		uring_recycle(ring, bid);
+	}
+	uring_publish_buffers(ring);
+
+	thread->ring = ring;
+	errno = 0;
+	return 0;
+
+failure:
+	thread->ring = ring;
+	uring_free(thread);
+	return -1;
+}
+
+void uring_free(thread_t *thread)
+{
+	uring_t *ring = thread->ring;
+	if (!ring) return;
+	if (ring->br && ring->br != MAP_FAILED) munmap(ring->br, ring->br_len);
+	free(ring->buffers);
+	if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	free(ring);
+	thread->ring = NULL;
+}
+
+/*
+ * Worker loop of io_uring backend
+ */
+void uring_worker(thread_t *thread)
+{
+	uring_t *ring = thread->ring;
+
+	uring_read_event(thread);
+	if (thread->listen_fd >= 0) {
+		uring_accept(thread);
+	}
+	while (1) {
+		int timeout = round_timeout(thread);
+		if (timeout > 0 && !ring->timeout_armed) {
+			uring_timeout(thread, timeout);
+		}
+
+		/* Directory references must not be held while sleeping, work
+		 * left over from last round goes on without waiting */
+		dir_offline(thread->id);
+		int status = uring_submit(ring, timeout == 0 ? 0 : 1);
+		dir_online(thread->id);
+		if (status != 0) {
+			error(0, "io_uring_enter");
+			pthread_exit(&thread->thread);
+		}
+		start_round(thread);
+
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+			int kind = cqe->user_data & URING_KIND_MASK;
+			void *ptr = (void *) (uintptr_t) (cqe->user_data &
+					~(uint64_t) URING_KIND_MASK);
+
+			switch (kind) {
+				case URING_RECV:
+					uring_handle_recv(thread, ptr, cqe);
+					break;
+				case URING_SEND:
+					uring_handle_send(thread, ptr, cqe);
+					break;
+				case URING_EVENT:
+					/* Counter is reset, inbox and accepted clients are
+					 * taken below */
+					uring_read_event(thread);
+					break;
+				case URING_TIMEOUT:
+					ring->timeout_armed = 0;
+					break;
+				case URING_ACCEPT:
+					uring_handle_accept(thread, cqe);
+					break;
+				case URING_CANCEL:
+					/* Cancels of thread's own requests have no client */
+					if (ptr) uring_done(thread, ptr);
+					break;
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		uring_publish_buffers(ring);
+
+		client_t *client = take_accepted(thread);
+		while (client) {
+			client_t *next = client->accept_next;
+			uring_add_client(thread, client);
+			client = next;
+		}
+		finish_round(thread);
+	}
+}
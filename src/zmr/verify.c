@@ -0,0 +1,99 @@
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/queue.h"
+#include "zmr/verify.h"
+
+int num_verifiers = 0; /* 0 checks signatures on I/O threads */
+verifier_t *verifiers;
+static unsigned int next_verifier = 0;
+
+/*
+ * Check every job handed over, results go back to the connection's owner
+ */
+static void *verify_worker(void *arg)
+{
+	verifier_t *verifier = arg;
+
+	while (1) {
+		uint64_t count;
+		/* Blocks until a thread pushes to an empty stack */
+		if (read(verifier->event_fd, &count, sizeof(count)) < 0) {
+			if (errno == EINTR) continue;
+			error(0, "Error reading verifier %d eventfd", verifier->id);
+			return NULL;
+		}
+
+		out_t *job = out_take(&verifier->jobs);
+		while (job) {
+			out_t *next = job->next;
+			packet_t pkt;
+			unpack_packet(&pkt, job->data);
+			uint64_t start = now_ns();
+			job->status = check_packet(&pkt);
+			hist_record(&verifier->verify, now_ns() - start);
+			thread_t *owner = &threads[job->client->tid];
+			if (out_push(&owner->verified, job)) {
+				thread_wake(owner);
+			}
+			job = next;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start count verifier threads
+ */
+int verify_init(int count)
+{
+	verifiers = memalloc(count * sizeof(verifier_t));
+	if (!verifiers) return -1;
+	for (int i = 0; i < count; i++) {
+		verifiers[i].id = i;
+		verifiers[i].jobs = NULL;
+		memset(&verifiers[i].verify, 0, sizeof(hist_t));
+		verifiers[i].event_fd = eventfd(0, 0);
+		if (verifiers[i].event_fd < 0) {
+			error(0, "Error on creating eventfd");
+			return -1;
+		}
+		if (pthread_create(&verifiers[i].thread, NULL, verify_worker,
+					&verifiers[i]) != 0) {
+			error(0, "Error on creating verifier thread");
+			return -1;
+		}
+	}
+	num_verifiers = count;
+	return 0;
+}
+
+/*
+ * Hand message frame of client to its verifier, called by owning thread
+ * Client stays allocated until the job is back, counted in ops
+ */
+void verify_push(client_t *client, out_t *out)
+{
+	if (client->verifier < 0) {
+		/* Sticks to connection so its frames are checked in order */
+		client->verifier = __atomic_fetch_add(&next_verifier, 1,
+				__ATOMIC_RELAXED) % num_verifiers;
+	}
+	verifier_t *verifier = &verifiers[client->verifier];
+	out->client = client;
+	client->ops++;
+	if (out_push(&verifier->jobs, out)) {
+		uint64_t one = 1;
+		if (write(verifier->event_fd, &one, sizeof(one)) != sizeof(one)) {
+			error(0, "Error waking up verifier %d", verifier->id);
+		}
+	}
+}
+
+/*
+ * Take verified frames handed back to thread, in order per connection
+ */
+out_t *verify_take(thread_t *thread)
+{
+	return out_take(&thread->verified);
+}
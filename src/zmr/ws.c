@@ -0,0 +1,402 @@
+#include <strings.h>
+
+#include "packet.h"
+#include "util.h"
+#include "zmr/zmr.h"
+#include "zmr/queue.h"
+#include "zmr/ws.h"
+
+int ws_port = WS_PORT; /* 0 for no WebSocket listener */
+
+static uint32_t rotl(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+/*
+ * Mix 64 byte block into SHA-1 state
+ */
+static void sha1_block(uint32_t *h, const uint8_t *block)
+{
+	uint32_t w[80];
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+			(uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+	}
+	for (int i = 16; i < 80; i++)
+		w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (int i = 0; i < 80; i++) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		uint32_t t = rotl(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotl(b, 30);
+		b = a;
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+/*
+ * SHA-1 as the handshake requires it, libsodium has none
+ */
+static void sha1(const uint8_t *data, size_t length, uint8_t *digest)
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+		0xC3D2E1F0 };
+	uint8_t block[64];
+	size_t i = 0;
+	for (; i + 64 <= length; i += 64) sha1_block(h, data + i);
+
+	size_t rest = length - i;
+	memset(block, 0, sizeof(block));
+	memcpy(block, data + i, rest);
+	block[rest] = 0x80;
+	if (rest >= 56) {
+		sha1_block(h, block);
+		memset(block, 0, sizeof(block));
+	}
+	uint64_t bits = (uint64_t) length * 8;
+	for (int j = 0; j < 8; j++) block[63 - j] = bits >> (8 * j);
+	sha1_block(h, block);
+
+	for (int j = 0; j < 5; j++) {
+		digest[4 * j] = h[j] >> 24;
+		digest[4 * j + 1] = h[j] >> 16;
+		digest[4 * j + 2] = h[j] >> 8;
+		digest[4 * j + 3] = h[j];
+	}
+}
+
+/*
+ * Copy value of header name in request to value, names are case-insensitive
+ * Returns NULL if request has no such header or value doesn't fit
+ */
+static char *http_header(char *request, const char *name, char *value,
+		size_t size)
+{
+	size_t len = strlen(name);
+	for (char *line = strstr(request, "\r\n"); line;
+			line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, name, len) != 0 || line[len] != ':') continue;
+
+		char *start = line + len + 1;
+		while (*start == ' ' || *start == '\t') start++;
+		char *end = strstr(start, "\r\n");
+		if (!end) return NULL;
+		size_t n = end - start;
+		while (n > 0 && (start[n - 1] == ' ' || start[n - 1] == '\t')) n--;
+		if (n >= size) return NULL;
+		memcpy(value, start, n);
+		value[n] = '\0';
+		return value;
+	}
+	return NULL;
+}
+
+/*
+ * Queue bytes as they are, for the HTTP reply and control frames
+ */
+static void ws_raw(thread_t *thread, client_t *client, uint8_t *data,
+		size_t length)
+{
+	out_t *out = out_copy(thread, data, length);
+	if (!out) return;
+	queue_push(thread, client, out);
+	mark_dirty(thread, client);
+}
+
+/*
+ * Write header of unmasked frame, returns its length
+ */
+static size_t ws_header(uint8_t *head, int opcode, size_t length)
+{
+	head[0] = 0x80 | opcode;
+	if (length < 126) {
+		head[1] = length;
+		return 2;
+	}
+	if (length <= 0xFFFF) {
+		head[1] = 126;
+		head[2] = length >> 8;
+		head[3] = length;
+		return 4;
+	}
+	head[1] = 127;
+	for (int i = 0; i < 8; i++) head[2 + i] = (uint64_t) length >> (56 - 8 * i);
+	return 10;
+}
+
+static void ws_control(thread_t *thread, client_t *client, int opcode,
+		uint8_t *payload, size_t length)
+{
+	uint8_t frame[WS_HEADER_MAX + WS_CONTROL_MAX];
+	size_t head_len = ws_header(frame, opcode, length);
+	memcpy(frame + head_len, payload, length);
+	ws_raw(thread, client, frame, head_len + length);
+}
+
+/*
+ * Answer upgrade request with an error and have client dropped
+ */
+static ssize_t ws_refuse(thread_t *thread, client_t *client, const char *status)
+{
+	char response[128];
+	int len = snprintf(response, sizeof(response),
+			"HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+			status);
+	ws_raw(thread, client, (uint8_t *) response, len);
+	flush_client(thread, client);
+	return -1;
+}
+
+/*
+ * Collect upgrade request and answer it once it is complete
+ * Returns bytes of data it took, the rest are frames, -1 if client is refused
+ */
+static ssize_t ws_http(thread_t *thread, client_t *client, uint8_t *data,
+		size_t length)
+{
+	ws_t *ws = client->ws;
+	size_t old = ws->http_len;
+	size_t n = WS_HTTP_MAX - old < length ? WS_HTTP_MAX - old : length;
+	memcpy(ws->http + old, data, n);
+	ws->http_len += n;
+	ws->http[ws->http_len] = '\0';
+
+	/* End of request may straddle the previous read */
+	char *end = strstr(ws->http + (old > 3 ? old - 3 : 0), "\r\n\r\n");
+	if (!end) {
+		if (ws->http_len < WS_HTTP_MAX) return length;
+		error(0, "WebSocket upgrade request too long");
+		return ws_refuse(thread, client, "431 Request Header Fields Too Large");
+	}
+	size_t taken = end + 4 - ws->http - old;
+	/* Keep line end of last header for http_header */
+	end[2] = '\0';
+
+	char value[64], key[64];
+	if (strncmp(ws->http, "GET ", 4) != 0 ||
+			!http_header(ws->http, "Upgrade", value, sizeof(value)) ||
+			strcasecmp(value, "websocket") != 0) {
+		return ws_refuse(thread, client, "426 Upgrade Required");
+	}
+	if (!http_header(ws->http, "Sec-WebSocket-Key", key, sizeof(key)) ||
+			!http_header(ws->http, "Sec-WebSocket-Version", value,
+				sizeof(value)) || strcmp(value, "13") != 0) {
+		error(0, "Malformed WebSocket upgrade request");
+		return ws_refuse(thread, client, "400 Bad Request");
+	}
+
+	char source[sizeof(key) + sizeof(WS_GUID)];
+	uint8_t digest[20];
+	char accept[sodium_base64_ENCODED_LEN(20, sodium_base64_VARIANT_ORIGINAL)];
+	int len = snprintf(source, sizeof(source), "%s%s", key, WS_GUID);
+	sha1((uint8_t *) source, len, digest);
+	sodium_bin2base64(accept, sizeof(accept), digest, sizeof(digest),
+			sodium_base64_VARIANT_ORIGINAL);
+
+	char response[256];
+	len = snprintf(response, sizeof(response),
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+	ws_raw(thread, client, (uint8_t *) response, len);
+	free(ws->http);
+	ws->http = NULL;
+	ws->state = WS_OPEN;
+
+	if (send_challenge(thread, client) != ZSM_STA_SUCCESS) return -1;
+	return taken;
+}
+
+/*
+ * Bytes of frame header starting with the len bytes in head
+ */
+static int ws_header_length(uint8_t *head, int len)
+{
+	if (len < 2) return 2;
+	int need = 2 + ((head[1] & 0x80) ? 4 : 0);
+	uint8_t length = head[1] & 0x7F;
+	if (length == 126) need += 2;
+	else if (length == 127) need += 8;
+	return need;
+}
+
+/*
+ * Header of next frame is complete, payload follows
+ * Returns non-zero if client broke the protocol
+ */
+static int ws_start(ws_t *ws)
+{
+	uint8_t *head = ws->head;
+	/* No extension was negotiated and frames from clients are masked */
+	if (head[0] & 0x70 || !(head[1] & 0x80)) return -1;
+	ws->opcode = head[0] & 0x0F;
+
+	uint64_t length = head[1] & 0x7F;
+	int pos = 2;
+	if (length == 126) {
+		length = (uint64_t) head[2] << 8 | head[3];
+		pos = 4;
+	} else if (length == 127) {
+		length = 0;
+		for (int i = 0; i < 8; i++) length = length << 8 | head[2 + i];
+		if (length >> 63) return -1;
+		pos = 10;
+	}
+	memcpy(ws->mask, head + pos, sizeof(ws->mask));
+
+	if (ws->opcode == WS_OP_CLOSE || ws->opcode == WS_OP_PING ||
+			ws->opcode == WS_OP_PONG) {
+		if (!(head[0] & 0x80) || length > WS_CONTROL_MAX) return -1;
+		ws->control_len = 0;
+	} else if (ws->opcode != WS_OP_CONTINUATION && ws->opcode != WS_OP_TEXT &&
+			ws->opcode != WS_OP_BINARY) {
+		return -1;
+	}
+	ws->left = length;
+	ws->mask_pos = 0;
+	ws->head_len = 0;
+	ws->payload = 1;
+	return 0;
+}
+
+/*
+ * Payload of frame is complete, answers control frames
+ * Returns non-zero once client is to be dropped
+ */
+static int ws_end(thread_t *thread, client_t *client)
+{
+	ws_t *ws = client->ws;
+	ws->payload = 0;
+	if (ws->opcode == WS_OP_PING) {
+		ws_control(thread, client, WS_OP_PONG, ws->control, ws->control_len);
+	} else if (ws->opcode == WS_OP_CLOSE) {
+		/* Echo status code, reason is optional */
+		ws_control(thread, client, WS_OP_CLOSE, ws->control,
+				ws->control_len >= 2 ? 2 : 0);
+		ws->state = WS_CLOSING;
+		flush_client(thread, client);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Make client speak WebSocket, it is upgraded before it gets its challenge
+ */
+int ws_attach(client_t *client)
+{
+	ws_t *ws = memalloc(sizeof(ws_t));
+	if (!ws) return -1;
+	memset(ws, 0, sizeof(ws_t));
+	ws->http = memalloc(WS_HTTP_MAX + 1);
+	if (!ws->http) {
+		free(ws);
+		return -1;
+	}
+	ws->state = WS_HTTP;
+	client->ws = ws;
+	return 0;
+}
+
+void ws_free(client_t *client)
+{
+	if (!client->ws) return;
+	free(client->ws->http);
+	free(client->ws);
+	client->ws = NULL;
+}
+
+/*
+ * Turn bytes received from WebSocket client into packet bytes, in place
+ * Payload of data frames is unmasked to the start of data, control frames
+ * are answered
+ * Returns how many packet bytes data holds now, -1 if client has to be dropped
+ */
+ssize_t ws_input(thread_t *thread, client_t *client, uint8_t *data,
+		size_t length)
+{
+	ws_t *ws = client->ws;
+	size_t in = 0, out = 0;
+	if (ws->state == WS_HTTP) {
+		ssize_t taken = ws_http(thread, client, data, length);
+		if (taken < 0) return -1;
+		in = taken;
+	}
+	while (in < length) {
+		if (ws->state != WS_OPEN) return -1;
+		if (!ws->payload) {
+			/* Header may be split between reads */
+			ws->head[ws->head_len++] = data[in++];
+			if (ws->head_len < ws_header_length(ws->head, ws->head_len))
+				continue;
+			if (ws_start(ws) != 0) {
+				error(0, "WebSocket client broke framing");
+				return -1;
+			}
+			if (ws->left == 0 && ws_end(thread, client) != 0) return -1;
+			continue;
+		}
+
+		size_t n = length - in < ws->left ? length - in : ws->left;
+		int control = ws->opcode & 0x8;
+		uint8_t *to = control ? ws->control + ws->control_len : data + out;
+		for (size_t i = 0; i < n; i++)
+			to[i] = data[in + i] ^ ws->mask[(ws->mask_pos + i) & 3];
+		ws->mask_pos = (ws->mask_pos + n) & 3;
+		if (control) ws->control_len += n;
+		else out += n;
+		in += n;
+		ws->left -= n;
+		if (ws->left == 0 && ws_end(thread, client) != 0) return -1;
+	}
+	return out;
+}
+
+/*
+ * Wrap frame queued for client into a binary message, its header is queued
+ * on its own so the frame is written from where it is without a copy
+ * Returns what is to be queued after the header, NULL if frame was dropped
+ */
+out_t *ws_frame(thread_t *thread, client_t *client, out_t *out)
+{
+	if (client->ws->state != WS_OPEN) {
+		/* Client either isn't upgraded yet or is closing */
+		out_free(thread, out);
+		return NULL;
+	}
+	uint8_t head[WS_HEADER_MAX];
+	out_t *header = out_copy(thread, head,
+			ws_header(head, WS_OP_BINARY, out->length));
+	if (!header) {
+		out_free(thread, out);
+		return NULL;
+	}
+	/* Frame keeps its stamp and stored frame, both count once it was
+	 * written in full */
+	queue_push(thread, client, header);
+	return out;
+}
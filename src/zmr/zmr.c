@@ -1,102 +1,1446 @@
+#define _GNU_SOURCE /* accept4, CPU affinity */
+
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <stddef.h>
+
 #include "packet.h"
 #include "util.h"
 #include "config.h"
 #include "zmr/ht.h"
 #include "zmr/zmr.h"
+#include "zmr/dir.h"
+#include "zmr/queue.h"
+#include "zmr/uring.h"
+#include "zmr/mailbox.h"
+#include "zmr/verify.h"
+#include "zmr/metrics.h"
+#include "zmr/channel.h"
+#include "zmr/fed.h"
+#include "zmr/limit.h"
+#include "zmr/upgrade.h"
+#include "zmr/ws.h"
 
-thread_t threads[MAX_THREADS];
-int num_thread = 0;
+thread_t *threads;
+int num_threads = 0; /* Online CPUs unless set with -t */
+int max_clients = MAX_CLIENTS_PER_THREAD;
+int *cpu_threads; /* Thread pinned to each CPU, -1 if none */
 int debug = 0;
+int backend = BACKEND_EPOLL;
+int reuseport = 0;
+int port = PORT; /* Clients connect to */
+int fed_port = 0; /* Other nodes connect to, 0 for none */
+char *mailbox_dir = NULL; /* Default under SERVER_DATA_DIR */
+char *metrics_path = NULL; /* Default SERVER_METRICS_SOCKET */
+char *log_path = NULL; /* stderr unless set with -o */
+int64_t mailbox_ttl = MAILBOX_TTL;
+int verifier_count = -1; /* Half of workers unless set with -v */
+size_t max_queue = OUT_QUEUE_LIMIT;
+int idle_timeout = IDLE_TIMEOUT; /* 0 never pings or drops silent clients */
+
+/*
+ * Add client to the thread's list of queues to flush this round
+ */
+void mark_dirty(thread_t *thread, client_t *client)
+{
+	if (client->dirty) return;
+	client->dirty = 1;
+	client->dirty_next = thread->dirty;
+	thread->dirty = client;
+}
+
+/*
+ * Add client to the thread's list of authorised clients
+ */
+void authorised_add(thread_t *thread, client_t *client)
+{
+	client->auth_next = thread->authorised;
+	if (thread->authorised) thread->authorised->auth_pprev = &client->auth_next;
+	client->auth_pprev = &thread->authorised;
+	thread->authorised = client;
+}
+
+void authorised_remove(client_t *client)
+{
+	*client->auth_pprev = client->auth_next;
+	if (client->auth_next) client->auth_next->auth_pprev = client->auth_pprev;
+	client->auth_next = NULL;
+	client->auth_pprev = NULL;
+}
+
+/*
+ * Check authorised client for silence, counted from when it was last heard
+ * Only v2 clients are known to answer ZSM_TYP_PING, older zen can't parse a
+ * header only frame, so v1 clients are left to TCP keepalive
+ */
+void watch_idle(thread_t *thread, client_t *client)
+{
+	client->pinged = 0;
+	if (idle_timeout > 0 && client->version > 1) {
+		timeout_set(&thread->wheel, &client->timer,
+				client->active + TIMER_SECONDS(idle_timeout));
+	} else {
+		timeout_cancel(&thread->wheel, &client->timer);
+	}
+}
+
+/*
+ * Have the kernel probe a v1 client silent for idle_timeout, the connection
+ * fails once it didn't answer for about PING_TIMEOUT
+ */
+static void watch_keepalive(client_t *client)
+{
+	if (idle_timeout <= 0 || client->version > 1) return;
+	int on = 1, idle = idle_timeout, count = KEEPALIVE_PROBES;
+	int interval = PING_TIMEOUT / KEEPALIVE_PROBES;
+	if (setsockopt(client->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0 ||
+			setsockopt(client->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0 ||
+			setsockopt(client->fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+				sizeof(interval)) != 0 ||
+			setsockopt(client->fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) != 0) {
+		error(0, "Error enabling keepalive of client %s", client->username);
+	}
+}
+
+/*
+ * Close connection, client is released once no I/O refers to it anymore
+ */
+void drop_client(thread_t *thread, client_t *client)
+{
+	if (client->state == CLIENT_CLOSED) return;
+
+	if (thread->ring) {
+		/* Completes multishot receive still armed on socket */
+		shutdown(client->fd, SHUT_RDWR);
+	} else {
+		epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	}
+	close(client->fd);
+	timeout_cancel(&thread->wheel, &client->timer);
+	timeout_cancel(&thread->wheel, &client->throttle);
+	if (client->state == CLIENT_AUTHORISED) {
+		hashtable_remove(&thread->table, client);
+		authorised_remove(client);
+		limit_leave(client);
+		/* Newer connection of the same user keeps it online */
+		if (dir_remove(thread->id, client)) {
+			fed_presence(client->pk, 0);
+		}
+		/* Frames stored after this go behind the ones returned */
+		mailbox_return(client);
+	} else if (client->state == CLIENT_LINK) {
+		link_dropped(thread, client);
+	}
+	client->state = CLIENT_CLOSED;
+	__atomic_sub_fetch(&thread->num_clients, 1, __ATOMIC_RELAXED);
+	if (client->ops == 0) {
+		release_client(thread, client);
+	}
+}
+
+/*
+ * Free everything owned by closed client
+ * Client itself is retired as frames for it may still be in the inbox
+ * or its events may come later in the same round
+ */
+void release_client(thread_t *thread, client_t *client)
+{
+	queue_clear(thread, client);
+	buf_release(client->rbuf);
+	client->rbuf = NULL;
+	free(client->held);
+	client->held = NULL;
+	ws_free(client);
+	dir_retire(thread->id, client);
+}
+
+/*
+ * Queue frame for client owned by this thread
+ * Slow clients whose queue grows past max_queue are dropped
+ */
+void enqueue(thread_t *thread, client_t *client, out_t *out)
+{
+	if (client->state == CLIENT_CLOSED) {
+		out_free(thread, out);
+		return;
+	}
+	if (client->state == CLIENT_MOVING &&
+			__atomic_load_n(&client->tid, __ATOMIC_RELAXED) == thread->id) {
+		/* Old owner may still queue frames, keep these until it is done
+		 * with client, new owner wraps them for WebSocket clients */
+		out->next = NULL;
+		if (client->parked_tail)
+			client->parked_tail->next = out;
+		else
+			client->parked = out;
+		client->parked_tail = out;
+		return;
+	}
+	/* Links and clients which didn't answer in v2 get v1 frames */
+	if (frame_version(out->data) != client->version &&
+			!(out = out_convert(thread, out, client->version))) return;
+	if (client->ws && !(out = ws_frame(thread, client, out))) return;
+	if (client->state == CLIENT_MOVING) {
+		/* Only new owner can drop client */
+		queue_push(thread, client, out);
+		return;
+	}
+	/* Links carry frames of many clients */
+	size_t limit = client->link != LINK_NONE ? FED_QUEUE_LIMIT : max_queue;
+	if (client->out_bytes + out->length > limit) {
+		error(0, "Client %s is not reading, dropping it", client->username);
+		/* Queued with the rest, stored frames go back to the mailbox in
+		 * order */
+		queue_push(thread, client, out);
+		drop_client(thread, client);
+		return;
+	}
+	queue_push(thread, client, out);
+	mark_dirty(thread, client);
+}
+
+/*
+ * Queue header-only status packet to client
+ */
+void send_status(thread_t *thread, client_t *client, uint8_t status)
+{
+	reply_status(thread, client, status, 0);
+}
+
+/*
+ * Queue status answering frame id of client, v1 clients only get status
+ */
+void reply_status(thread_t *thread, client_t *client, uint8_t status, uint64_t id)
+{
+	uint8_t header[PACKET_HEADER_MAX];
+	size_t header_len = pack_header(header, client->version, status, 0, 0, id);
+
+	out_t *out = out_copy(thread, header, header_len);
+	if (!out) return;
+	enqueue(thread, client, out);
+}
+
+/*
+ * Write queue of client now, for replies sent right before dropping it
+ */
+void flush_client(thread_t *thread, client_t *client)
+{
+	/* Don't interleave with an io_uring write in flight */
+	if (client->sending) return;
+	if (queue_flush(thread, client) != ZSM_STA_SUCCESS) {
+		error(0, "Could not write to client");
+	}
+}
+
+/*
+ * Queue challenge for newly accepted client
+ */
+int send_challenge(thread_t *thread, client_t *client)
+{
+	uint8_t frame[PACKET_HEADER_SIZE + CHALLENGE_SIZE + SIGN_SIZE];
+	uint32_t length = CHALLENGE_SIZE;
+
+	randombytes_buf(client->challenge, CHALLENGE_SIZE);
+
+	frame[0] = ZSM_TYP_AUTH;
+	memcpy(&frame[sizeof(uint8_t)], &length, sizeof(length));
+	memcpy(&frame[PACKET_HEADER_SIZE], client->challenge, CHALLENGE_SIZE);
+	/* Sending fake signature as structure requires it, it advertises v2 */
+	memset(&frame[PACKET_HEADER_SIZE + CHALLENGE_SIZE], 0, SIGN_SIZE);
+	frame[PACKET_HEADER_SIZE + CHALLENGE_SIZE] = ZSM_V2;
+
+	out_t *out = out_copy(thread, frame, sizeof(frame));
+	if (!out) return ZSM_STA_MEMORY_ALLOCATION;
+	enqueue(thread, client, out);
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Check signed challenge in authentication frame and register client
+ */
+int authenticate_client(thread_t *thread, client_t *client, uint8_t *frame)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, frame);
+
+	/* Public key is sent padded to size of signature */
+	if (pkt.type != ZSM_TYP_AUTH || pkt.length < PK_SIZE || pkt.length > SIGN_SIZE) {
+		error(0, "Invalid authentication packet, type %d length %d",
+				pkt.type, pkt.length);
+		metric_add(&thread->metrics.auths_failed, 1);
+		send_status(thread, client, ZSM_STA_UNAUTHORISED);
+		flush_client(thread, client);
+		return ZSM_STA_ERROR_AUTHENTICATE;
+	}
+	/* Client is answered in the version it chose from then on */
+	client->version = pkt.version;
+
+	uint8_t *pk_bin = pkt.data;
+	if (crypto_sign_verify_detached(pkt.signature, client->challenge,
+				CHALLENGE_SIZE, pk_bin) != 0) {
+		error(0, "Incorrect signature, could not authenticate client");
+		metric_add(&thread->metrics.auths_failed, 1);
+		send_status(thread, client, ZSM_STA_UNAUTHORISED);
+		flush_client(thread, client);
+		return ZSM_STA_ERROR_AUTHENTICATE;
+	}
+
+	memcpy(client->pk, pk_bin, PK_SIZE);
+	sodium_bin2hex(client->username, sizeof(client->username), pk_bin, PK_SIZE);
+	int status = limit_join(client);
+	if (status == ZSM_STA_UNAUTHORISED) {
+		error(0, "%s has too many connections, rejecting client",
+				client->username);
+		metric_add(&thread->metrics.limit_rejects, 1);
+		send_status(thread, client, ZSM_STA_UNAUTHORISED);
+		flush_client(thread, client);
+		return ZSM_STA_ERROR_AUTHENTICATE;
+	} else if (status != ZSM_STA_SUCCESS) {
+		return status;
+	}
+	if (dir_add(thread->id, client) != 0) {
+		error(0, "Could not register client in directory");
+		limit_leave(client);
+		return ZSM_STA_MEMORY_ALLOCATION;
+	}
+	client->state = CLIENT_AUTHORISED;
+	watch_idle(thread, client);
+	watch_keepalive(client);
+	metric_add(&thread->metrics.auths_ok, 1);
+	fed_presence(client->pk, 1);
+	hashtable_add(&thread->table, client);
+	authorised_add(thread, client);
+	/* Thread stopped receiving from authorised clients for an upgrade */
+	if (thread->frozen && thread->ring) uring_pause(thread, client);
+	send_status(thread, client, ZSM_STA_AUTHORISED);
+	/* Backlog is queued behind status as the queue drains */
+	mailbox_take(client);
+
+	error(0, "%s connected", client->username);
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Hand frame to the thread owning recipient to
+ * Frames for recipients which aren't connected go to the mailbox
+ * Returns ZSM_STA_UNKNOWN_USER if frame had nowhere to go
+ */
+int route_to(thread_t *thread, uint8_t *to, out_t *out)
+{
+	/* Only formatted if it is logged */
+	char hex[PK_SIZE * 2 + 1];
+	uint64_t start = now_ns();
+	client_t *recipient = dir_lookup(to);
+	hist_record(&thread->metrics.lookup, now_ns() - start);
+	/* Frames which came from another node stay here */
+	int remote = !recipient && !(out->client && out->client->link != LINK_NONE);
+	if (remote && mailbox_defer(to, out->data, out->length)) {
+		log_debug("Stored packet to %s behind its forwarded ones",
+				sodium_bin2hex(hex, sizeof(hex), to, PK_SIZE));
+		metric_add(&thread->metrics.mailbox_stored, 1);
+		out_free(thread, out);
+		return ZSM_STA_SUCCESS;
+	}
+	if (remote && fed_forward(thread, to, out)) {
+		log_debug("Forwarded packet to %s",
+				sodium_bin2hex(hex, sizeof(hex), to, PK_SIZE));
+		return ZSM_STA_SUCCESS;
+	}
+	if (!recipient) {
+		metric_add(&thread->metrics.unknown_recipients, 1);
+		int stored = mailbox_store(to, out->data, out->length);
+		if (stored == 0) {
+			log_debug("%s is offline, stored packet",
+					sodium_bin2hex(hex, sizeof(hex), to, PK_SIZE));
+			metric_add(&thread->metrics.mailbox_stored, 1);
+			out_free(thread, out);
+			return ZSM_STA_SUCCESS;
+		} else if (stored == 1) {
+			recipient = dir_lookup(to);
+		}
+	}
+	if (recipient) {
+		log_debug("Relaying packet to %s",
+				sodium_bin2hex(hex, sizeof(hex), to, PK_SIZE));
+		/* Recipient's queue references frame inside sender's receive buffer */
+		int tid = __atomic_load_n(&recipient->tid, __ATOMIC_ACQUIRE);
+		if (tid == thread->id) {
+			enqueue(thread, recipient, out);
+		} else {
+			inbox_push(&threads[tid], recipient, out);
+		}
+		return ZSM_STA_SUCCESS;
+	}
+	error(0, "%s not found", sodium_bin2hex(hex, sizeof(hex), to, PK_SIZE));
+	out_free(thread, out);
+	return ZSM_STA_UNKNOWN_USER;
+}
+
+/*
+ * Hand checked message frame to the thread owning its recipient
+ * Returns status the sender is acknowledged with
+ */
+int route_frame(thread_t *thread, out_t *out)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, out->data);
+
+	/* Message relay */
+	uint8_t *to = pkt.data + MAX_NAME;
+	if (to[0] == '\0') {
+		error(0, "Wrong recipient");
+		out_free(thread, out);
+		return ZSM_STA_UNKNOWN_USER;
+	}
+	return route_to(thread, to, out);
+}
+
+/*
+ * Route message frame once its signature was checked, tell sender if it was
+ * tampered with
+ */
+void verified_frame(thread_t *thread, client_t *client, out_t *out)
+{
+	/* Frame may be gone once it was routed */
+	packet_t pkt;
+	unpack_packet(&pkt, out->data);
+	if (out->status != ZSM_STA_SUCCESS) {
+		error(0, "Error verifying packet");
+		metric_add(&thread->metrics.verify_failures, 1);
+		if (out->status == ZSM_STA_ERROR_INTEGRITY) {
+			reply_status(thread, client, ZSM_STA_ERROR_INTEGRITY, pkt.id);
+		}
+		out_free(thread, out);
+		return;
+	}
+	if (pkt.type == ZSM_TYP_CHANNEL) {
+		channel_manage(thread, client, out);
+	} else if (pkt.type == ZSM_TYP_CHANNEL_MESSAGE) {
+		channel_send(thread, client, out);
+	} else {
+		int status = route_frame(thread, out);
+		if (pkt.flags & ZSM_FLAG_ACK) reply_status(thread, client, status, pkt.id);
+	}
+}
+
+/*
+ * Verify message frame, on the verifier pool if there is one
+ * Only returns error if connection of sender should be dropped
+ */
+int relay_frame(thread_t *thread, client_t *client, uint8_t *frame,
+		size_t frame_len)
+{
+	packet_t pkt;
+	unpack_packet(&pkt, frame);
+	if (debug) print_packet(&pkt);
+
+	out_t *out = out_new(thread, client->rbuf, frame, frame_len);
+	if (!out) return ZSM_STA_SUCCESS;
+	out->stamp = now_ns();
+	if (num_verifiers > 0) {
+		verify_push(client, out);
+	} else {
+		out->status = check_packet(&pkt);
+		hist_record(&thread->metrics.verify, now_ns() - out->stamp);
+		verified_frame(thread, client, out);
+	}
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Stop reading client until its rate limits let the next frame in
+ */
+void throttle_client(thread_t *thread, client_t *client, uint64_t wait)
+{
+	client->throttled = 1;
+	metric_add(&thread->metrics.throttled, 1);
+	uint64_t ticks = (wait + TIMER_TICK * 1000000ULL - 1) /
+		(TIMER_TICK * 1000000ULL);
+	timeout_set(&thread->wheel, &client->throttle, thread->wheel.now + ticks);
+	if (thread->ring) {
+		uring_pause(thread, client);
+	} else {
+		struct epoll_event event;
+		event.data.ptr = client;
+		event.events = EPOLLOUT | EPOLLET;
+		epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+	}
+}
+
+/*
+ * Handle every complete frame in receive buffer in place
+ * A partial frame at the end waits at rstart for the rest of it
+ */
+int process_frames(thread_t *thread, client_t *client)
+{
+	int status = ZSM_STA_SUCCESS;
+
+	/* Idle timeout checks this lazily instead of being set again, unless
+	 * client was pinged and has the shorter ping timeout */
+	client->active = thread->wheel.now;
+	if (client->pinged) watch_idle(thread, client);
+	while (client->state != CLIENT_CLOSED) {
+		size_t frame_len;
+		uint8_t *frame = client->rbuf->data + client->rstart;
+		status = parse_frame(frame, client->rlen - client->rstart, &frame_len);
+		if (status == ZSM_STA_READING_SOCKET) {
+			status = ZSM_STA_SUCCESS;
+			break;
+		} else if (status != ZSM_STA_SUCCESS) {
+			send_status(thread, client, status);
+			flush_client(thread, client);
+			break;
+		}
+
+		/* Before anything is spent on frame, it waits in receive buffer
+		 * while client is throttled */
+		if (client->state == CLIENT_AUTHORISED || client->link == LINK_IN) {
+			uint64_t wait = limit_admit(client, frame_len);
+			if (wait > 0) {
+				throttle_client(thread, client, wait);
+				break;
+			}
+		}
+
+		metric_add(&thread->metrics.packets_in, 1);
+		client->packets++;
+		if (client->state == CLIENT_HANDSHAKE) {
+			status = authenticate_client(thread, client, frame);
+		} else if (client->state == CLIENT_LINK) {
+			status = link_frame(thread, client, frame, frame_len);
+		} else if (frame_type(frame) == ZSM_TYP_PING) {
+			packet_t pkt;
+			unpack_packet(&pkt, frame);
+			reply_status(thread, client, ZSM_TYP_PONG, pkt.id);
+		} else if (frame_type(frame) == ZSM_TYP_PONG) {
+			/* Answer to our ping, hearing from client was all it took */
+		} else {
+			status = relay_frame(thread, client, frame, frame_len);
+		}
+		if (status != ZSM_STA_SUCCESS) break;
+		client->rstart += frame_len;
+	}
+	return status;
+}
+
+/*
+ * Make sure the frame starting at rstart fits in receive buffer
+ * Frames already handled may still be queued for other clients, so a shared
+ * buffer is never written before rlen. Only the partial frame is copied to a
+ * fresh buffer then, at most once per buffer.
+ */
+int prepare_rbuf(thread_t *thread, client_t *client)
+{
+	buf_t *rbuf = client->rbuf;
+	size_t pending = client->rlen - client->rstart;
+	int shared = __atomic_load_n(&rbuf->refs, __ATOMIC_ACQUIRE) > 1;
+
+	if (!shared && pending == 0) {
+		client->rstart = client->rlen = 0;
+		return ZSM_STA_SUCCESS;
+	}
+	if (client->rstart + MAX_FRAME_SIZE <= rbuf->size) {
+		return ZSM_STA_SUCCESS;
+	}
+
+	if (shared) {
+		buf_t *fresh = buf_new(thread, RECV_BUFFER_SIZE);
+		if (!fresh) return ZSM_STA_MEMORY_ALLOCATION;
+		memcpy(fresh->data, rbuf->data + client->rstart, pending);
+		buf_release(rbuf);
+		client->rbuf = fresh;
+	} else {
+		memmove(rbuf->data, rbuf->data + client->rstart, pending);
+	}
+	client->rstart = 0;
+	client->rlen = pending;
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Socket is edge-triggered, read until kernel has nothing left
+ * Each recv can carry many frames, all of them are handled before next recv
+ */
+int read_client(thread_t *thread, client_t *client)
+{
+	while (client->state != CLIENT_CLOSED && !client_paused(thread, client)) {
+		int status = prepare_rbuf(thread, client);
+		if (status != ZSM_STA_SUCCESS) return status;
+
+		ssize_t bytes_read = recv(client->fd, client->rbuf->data + client->rlen,
+				client->rbuf->size - client->rlen, 0);
+		if (bytes_read == 0) {
+			return ZSM_STA_CLOSED_CONNECTION;
+		} else if (bytes_read < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				errno = 0;
+				return ZSM_STA_SUCCESS;
+			}
+			if (errno == EINTR) continue;
+			return ZSM_STA_READING_SOCKET;
+		}
+		metric_add(&thread->metrics.bytes_in, bytes_read);
+		if (client->ws) {
+			bytes_read = ws_input(thread, client,
+					client->rbuf->data + client->rlen, bytes_read);
+			if (bytes_read < 0) return ZSM_STA_CLOSED_CONNECTION;
+		}
+		client->rlen += bytes_read;
+
+		status = process_frames(thread, client);
+		if (status != ZSM_STA_SUCCESS) return status;
+	}
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Handle bytes received elsewhere (io_uring provided buffers), WebSocket
+ * framing is taken off in place first
+ */
+int feed_client(thread_t *thread, client_t *client, uint8_t *data, size_t length)
+{
+	if (client->ws) {
+		ssize_t n = ws_input(thread, client, data, length);
+		if (n < 0) return ZSM_STA_CLOSED_CONNECTION;
+		length = n;
+	}
+	return append_client(thread, client, data, length);
+}
+
+/*
+ * Append packet bytes to receive buffer and handle the frames they complete
+ */
+int append_client(thread_t *thread, client_t *client, uint8_t *data,
+		size_t length)
+{
+	while (length > 0 && client->state != CLIENT_CLOSED) {
+		if (client_paused(thread, client)) {
+			/* Receive buffer may be full, keep the rest aside until
+			 * client is resumed */
+			uint8_t *held = realloc(client->held, client->held_len + length);
+			if (!held) return ZSM_STA_MEMORY_ALLOCATION;
+			memcpy(held + client->held_len, data, length);
+			client->held = held;
+			client->held_len += length;
+			break;
+		}
+		int status = prepare_rbuf(thread, client);
+		if (status != ZSM_STA_SUCCESS) return status;
+
+		size_t room = client->rbuf->size - client->rlen;
+		size_t n = length < room ? length : room;
+		memcpy(client->rbuf->data + client->rlen, data, n);
+		client->rlen += n;
+		data += n;
+		length -= n;
+
+		status = process_frames(thread, client);
+		if (status != ZSM_STA_SUCCESS) return status;
+	}
+	return ZSM_STA_SUCCESS;
+}
+
+/*
+ * Throttle of client went off, handle the frames it left and read it again
+ */
+void throttle_timeout(void *arg, timeout_t *timeout)
+{
+	thread_t *thread = (thread_t *) arg;
+	client_t *client = (client_t *) ((uint8_t *) timeout -
+			offsetof(client_t, throttle));
+	/* Inbound data links are throttled too */
+	if (client->state != CLIENT_AUTHORISED && client->state != CLIENT_LINK)
+		return;
+
+	client->throttled = 0;
+	int status = process_frames(thread, client);
+	/* Frozen thread reads it again once upgrade was given up */
+	if (status == ZSM_STA_SUCCESS && !client->throttled && !thread->frozen) {
+		if (thread->ring) {
+			status = uring_resume(thread, client);
+		} else {
+			/* Modifying edge-triggered registration reports data that
+			 * came meanwhile */
+			struct epoll_event event;
+			event.data.ptr = client;
+			event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, client->fd,
+						&event) == -1) {
+				status = ZSM_STA_READING_SOCKET;
+			}
+		}
+	}
+	if (status != ZSM_STA_SUCCESS && client->state != CLIENT_CLOSED) {
+		error(0, "Error reading from client %s", client->username);
+		drop_client(thread, client);
+	}
+}
+
+/*
+ * Timeout of client went off
+ * Handshakes not finished in time are dropped. A v2 client silent for
+ * idle_timeout is pinged and dropped if it stays silent for PING_TIMEOUT,
+ * otherwise the timeout is set again from when it was last heard.
+ */
+void client_timeout(void *arg, timeout_t *timeout)
+{
+	thread_t *thread = (thread_t *) arg;
+	client_t *client = (client_t *) ((uint8_t *) timeout -
+			offsetof(client_t, timer));
+	uint64_t now = thread->wheel.now;
+
+	if (client->state == CLIENT_HANDSHAKE) {
+		error(0, "Handshake timed out, dropping client");
+		metric_add(&thread->metrics.handshake_timeouts, 1);
+		drop_client(thread, client);
+	} else if (client->state != CLIENT_AUTHORISED || idle_timeout <= 0) {
+		return;
+	} else if (client->active + TIMER_SECONDS(idle_timeout) > now) {
+		watch_idle(thread, client);
+	} else if (!client->pinged) {
+		client->pinged = now;
+		timeout_set(&thread->wheel, &client->timer,
+				now + TIMER_SECONDS(PING_TIMEOUT));
+		send_status(thread, client, ZSM_TYP_PING);
+	} else {
+		error(0, "Client %s did not answer ping, dropping it",
+				client->username);
+		metric_add(&thread->metrics.idle_timeouts, 1);
+		drop_client(thread, client);
+	}
+}
+
+/*
+ * Work shared by all backends before handling I/O of a round
+ */
+void start_round(thread_t *thread)
+{
+	wheel_run(&thread->wheel, timer_ticks(), thread);
+}
+
+/*
+ * Handle epoll event of client
+ */
+void handle_client(thread_t *thread, client_t *client, uint32_t events)
+{
+	if (client->state == CLIENT_CLOSED) return;
+	if (client->state != CLIENT_AUTHORISED && (events & (EPOLLERR | EPOLLHUP))) {
+		drop_client(thread, client);
+		return;
+	}
+	if (events & EPOLLOUT && client->out_head) {
+		mark_dirty(thread, client);
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		int status = read_client(thread, client);
+		if (status == ZSM_STA_CLOSED_CONNECTION) {
+			if (client->state == CLIENT_AUTHORISED)
+				error(0, "Client %s closed connection", client->username);
+			drop_client(thread, client);
+		} else if (status != ZSM_STA_SUCCESS) {
+			if (client->state != CLIENT_AUTHORISED)
+				error(0, "Error authenticating with client");
+			else
+				error(0, "Error reading from client %s", client->username);
+			drop_client(thread, client);
+		}
+	}
+}
+
+/*
+ * Register client handed over by the process this one replaced, which had
+ * authenticated it. Frames it had queued go out first, then the bytes it
+ * had received are handled.
+ */
+void resume_client(thread_t *thread, client_t *client)
+{
+	resume_t *resume = client->resume;
+	client->resume = NULL;
+	metric_add(&thread->metrics.connections, 1);
+	client->active = thread->wheel.now;
+	sodium_bin2hex(client->username, sizeof(client->username), client->pk,
+			PK_SIZE);
+	int status = limit_join(client);
+	if (status == ZSM_STA_SUCCESS && dir_add(thread->id, client) != 0) {
+		limit_leave(client);
+		status = ZSM_STA_MEMORY_ALLOCATION;
+	}
+	out_t *out = NULL;
+	if (status == ZSM_STA_SUCCESS && resume->out_len > 0) {
+		out = out_copy(thread, resume->data + resume->in_len, resume->out_len);
+		/* Client would miss the rest of a partly written frame */
+		if (!out) status = ZSM_STA_MEMORY_ALLOCATION;
+	}
+	if (status != ZSM_STA_SUCCESS) {
+		error(0, "Could not resume client %s", client->username);
+		free(resume);
+		drop_client(thread, client);
+		return;
+	}
+	client->state = CLIENT_AUTHORISED;
+	watch_idle(thread, client);
+	fed_presence(client->pk, 1);
+	hashtable_add(&thread->table, client);
+	authorised_add(thread, client);
+	if (out) {
+		/* Already framed for WebSocket clients */
+		queue_push(thread, client, out);
+		mark_dirty(thread, client);
+	}
+	mailbox_take(client);
+
+	status = append_client(thread, client, resume->data, resume->in_len);
+	free(resume);
+	if (status != ZSM_STA_SUCCESS && client->state != CLIENT_CLOSED) {
+		error(0, "Error reading from client %s", client->username);
+		drop_client(thread, client);
+	}
+}
+
+/*
+ * Start handshake of client taken over from accept loop
+ */
+void start_client(thread_t *thread, client_t *client)
+{
+	if (client->link != LINK_NONE) {
+		link_started(thread, client);
+		return;
+	}
+	if (client->resume) {
+		resume_client(thread, client);
+		return;
+	}
+	client->state = CLIENT_HANDSHAKE;
+	metric_add(&thread->metrics.connections, 1);
+	client->active = thread->wheel.now;
+	timeout_set(&thread->wheel, &client->timer,
+			thread->wheel.now + TIMER_SECONDS(HANDSHAKE_TIMEOUT));
+	/* WebSocket clients get it once they are upgraded */
+	if (client->ws) return;
+	if (send_challenge(thread, client) != ZSM_STA_SUCCESS) {
+		drop_client(thread, client);
+	}
+}
+
+/*
+ * Allocate client for accepted socket, owned by thread tid
+ */
+client_t *new_client(int clientfd, int tid)
+{
+	client_t *client = memalloc(sizeof(client_t));
+	if (!client) return NULL;
+	memset(client, 0, sizeof(client_t));
+	client->fd = clientfd;
+	client->tid = tid;
+	client->state = CLIENT_CHALLENGE;
+	client->version = 1;
+	client->verifier = -1;
+	timeout_init(&client->timer, client_timeout);
+	timeout_init(&client->throttle, throttle_timeout);
+	return client;
+}
+
+/*
+ * Load of thread in packets per second, readable from any thread
+ */
+long thread_load(thread_t *thread)
+{
+	long clients = __atomic_load_n(&thread->num_clients, __ATOMIC_RELAXED);
+	long rate = __atomic_load_n(&thread->rate, __ATOMIC_RELAXED);
+	uint64_t queued = __atomic_load_n(&thread->metrics.queued_bytes,
+			__ATOMIC_RELAXED);
+	return clients * LOAD_CLIENT + rate + (long) (queued / LOAD_QUEUE_UNIT);
+}
+
+/*
+ * Whether a thread with load is worth taking work from compared to least
+ */
+int is_hotspot(long load, long least)
+{
+	return load > least + LOAD_MARGIN && load * 100 > least * LOAD_RATIO;
+}
+
+/*
+ * Thread with the lowest load which still has room for a client
+ * Returns NULL if every thread is full
+ */
+thread_t *least_loaded(void)
+{
+	thread_t *least = NULL;
+	long least_load = 0;
+	for (int i = 0; i < num_threads; i++) {
+		if (__atomic_load_n(&threads[i].num_clients, __ATOMIC_RELAXED) >=
+				max_clients) {
+			continue;
+		}
+		long load = thread_load(&threads[i]);
+		if (!least || load < least_load) {
+			least = &threads[i];
+			least_load = load;
+		}
+	}
+	return least;
+}
+
+/*
+ * Hand accepted client to thread, callable from accept loop
+ */
+void accept_push(thread_t *thread, client_t *client)
+{
+	client_t *head = __atomic_load_n(&thread->accepted, __ATOMIC_RELAXED);
+	do {
+		client->accept_next = head;
+	} while (!__atomic_compare_exchange_n(&thread->accepted, &head, client, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (head == NULL) {
+		uint64_t one = 1;
+		if (write(thread->event_fd, &one, sizeof(one)) != sizeof(one)) {
+			error(0, "Error waking up thread %d", thread->id);
+		}
+	}
+}
+
+/*
+ * Take connection accepted on thread's own listener
+ * Kernel spreads connections by hash only, so a full or much busier thread
+ * hands the connection to the least loaded one
+ * Returns client to be registered with the backend, NULL if it was rejected
+ * or handed over
+ */
+client_t *accept_client(thread_t *thread, int clientfd)
+{
+	thread_t *least = least_loaded();
+	if (!least) {
+		error(0, "All threads are full, rejecting connection");
+		close(clientfd);
+		return NULL;
+	}
+	thread_t *owner = thread;
+	if (__atomic_load_n(&thread->num_clients, __ATOMIC_RELAXED) >=
+			max_clients ||
+			is_hotspot(thread_load(thread), thread_load(least))) {
+		owner = least;
+	}
+	client_t *client = new_client(clientfd, owner->id);
+	if (!client) {
+		close(clientfd);
+		return NULL;
+	}
+	__atomic_add_fetch(&owner->num_clients, 1, __ATOMIC_RELAXED);
+	if (owner != thread) {
+		accept_push(owner, client);
+		return NULL;
+	}
+	return client;
+}
 
 /*
- * Authenticate client before starting communication
+ * Take clients accepted for thread since last round, oldest first
  */
-int authenticate_client(int clientfd, uint8_t *username)
+client_t *take_accepted(thread_t *thread)
 {
-	int send = 0;
-	/* Create a challenge */
-	uint8_t *challenge = memalloc(CHALLENGE_SIZE);
-	randombytes_buf(challenge, CHALLENGE_SIZE);
+	client_t *client = __atomic_exchange_n(&thread->accepted, NULL,
+			__ATOMIC_ACQUIRE);
+	client_t *list = NULL;
+	while (client) {
+		client_t *next = client->accept_next;
+		client->accept_next = list;
+		list = client;
+		client = next;
+	}
+	return list;
+}
 
-	/* Sending fake signature as structure requires it */
-	uint8_t *fake_sig =	create_signature(NULL, 0, NULL);
+/*
+ * Route frames verifiers are done with, they come back in order per sender
+ */
+void drain_verified(thread_t *thread)
+{
+	out_t *out = verify_take(thread);
+	while (out) {
+		out_t *next = out->next;
+		client_t *client = out->client;
+		client->ops--;
+		if (client->state == CLIENT_CLOSED) {
+			out_free(thread, out);
+			if (client->ops == 0) release_client(thread, client);
+		} else {
+			verified_frame(thread, client, out);
+		}
+		out = next;
+	}
+}
 
-	packet_t *pkt = create_packet(ZSM_TYP_AUTH, CHALLENGE_SIZE, challenge,
-			fake_sig);
+/*
+ * Move frames other threads handed over into the queues of their recipients
+ */
+void drain_inbox(thread_t *thread)
+{
+	out_t *out = inbox_take(thread);
+	while (out) {
+		out_t *next = out->next;
+		enqueue(thread, out->client, out);
+		out = next;
+	}
+}
 
-	if (send_packet(pkt, clientfd) != ZSM_STA_SUCCESS) {
-		error(0, "Could not authenticate client");
-		goto failure;
+/*
+ * Write out every queue that got new frames this round
+ */
+void flush_dirty(thread_t *thread)
+{
+	client_t *client = thread->dirty;
+	thread->dirty = NULL;
+	while (client) {
+		client_t *next = client->dirty_next;
+		client->dirty = 0;
+		if (client->state != CLIENT_CLOSED) {
+			int status;
+			do {
+				if (client->mail) mailbox_fill(thread, client);
+				status = thread->ring ? uring_flush(thread, client) :
+					queue_flush(thread, client);
+				/* epoll has no completion to resume from once queue is
+				 * empty, keep streaming backlog until socket is full */
+			} while (status == ZSM_STA_SUCCESS && !thread->ring &&
+					client->state != CLIENT_CLOSED && client->mail &&
+					!client->out_head);
+			/* Client being handed over is dropped by its new owner */
+			if (status != ZSM_STA_SUCCESS && client->state != CLIENT_MOVING) {
+				error(0, "Error writing to client %s", client->username);
+				drop_client(thread, client);
+			}
+		}
+		client = next;
 	}
-	free(fake_sig);
+}
+
+/*
+ * Start handing client over to thread to
+ * Thread stops reading it right away, but keeps writing frames routed to it
+ * until no other thread can still send them here
+ */
+void move_client(thread_t *thread, client_t *client, thread_t *to)
+{
+	epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	hashtable_remove(&thread->table, client);
+	authorised_remove(client);
+	/* New owner sets it in its own wheel */
+	timeout_cancel(&thread->wheel, &client->timer);
+	client->state = CLIENT_MOVING;
+	/* Routing threads load tid with acquire and see the new state */
+	__atomic_store_n(&client->tid, to->id, __ATOMIC_RELEASE);
+	client->moved = dir_advance();
+	client->move_next = thread->moving;
+	thread->moving = client;
+	__atomic_sub_fetch(&thread->num_clients, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->num_clients, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pass clients which were moved before grace to their new owners
+ */
+void hand_over(thread_t *thread, uint64_t grace)
+{
+	client_t **link = &thread->moving;
+	while (*link) {
+		client_t *client = *link;
+		if (client->moved > grace) {
+			link = &client->move_next;
+			continue;
+		}
+		*link = client->move_next;
+		metric_sub(&thread->metrics.queued_frames, queue_length(client));
+		metric_sub(&thread->metrics.queued_bytes, client->out_bytes);
 
-	int status;
-	if ((status = recv_packet(pkt, clientfd)) != ZSM_STA_SUCCESS) {
-		error(0, "Could not authenticate client");
-		goto failure;
+		thread_t *to = &threads[client->tid];
+		client_t *head = __atomic_load_n(&to->migrated, __ATOMIC_RELAXED);
+		do {
+			client->move_next = head;
+		} while (!__atomic_compare_exchange_n(&to->migrated, &head, client, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		if (head == NULL) thread_wake(to);
 	}
-	if (pkt->type != ZSM_TYP_AUTH) {
-		send = 1;
-		error(0, "Could not authenticate client");
-		goto failure;
+}
+
+/*
+ * Take over clients other threads handed to this one
+ * Frames routed here while old owner still had them are queued behind the
+ * ones it left
+ */
+void adopt_clients(thread_t *thread)
+{
+	client_t *client = __atomic_exchange_n(&thread->migrated, NULL,
+			__ATOMIC_ACQUIRE);
+	while (client) {
+		client_t *next = client->move_next;
+		client->move_next = NULL;
+		client->state = CLIENT_AUTHORISED;
+		watch_idle(thread, client);
+		metric_add(&thread->metrics.queued_frames, queue_length(client));
+		metric_add(&thread->metrics.queued_bytes, client->out_bytes);
+		hashtable_add(&thread->table, client);
+		authorised_add(thread, client);
+
+		out_t *out = client->parked;
+		client->parked = client->parked_tail = NULL;
+		while (out) {
+			out_t *next_out = out->next;
+			enqueue(thread, client, out);
+			out = next_out;
+		}
+
+		struct epoll_event event;
+		event.data.ptr = client;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) == -1) {
+			error(0, "Failed to add client to epoll");
+			drop_client(thread, client);
+		} else if (client->state != CLIENT_CLOSED) {
+			/* Edge-triggered registration reports data that came meanwhile,
+			 * queue may be waiting for room too */
+			mark_dirty(thread, client);
+		}
+		client = next;
 	}
+}
 
-	uint8_t pk_bin[PK_SIZE];
-	memcpy(pk_bin, pkt->data, PK_SIZE);
-	char pk_hex[PK_SIZE * 2 + 1];
-	sodium_bin2hex(pk_hex, sizeof(pk_hex), pk_bin, PK_SIZE);
+/*
+ * Update packet rate of thread, then hand clients over to the least loaded
+ * thread if this one is a hotspot
+ * Clients are moved busiest first until about half of the difference in load
+ * went over, once thread stayed a hotspot for REBALANCE_HOT intervals.
+ * Only epoll threads take part, an io_uring thread would have to cancel the
+ * receive it keeps posted.
+ */
+void rebalance(thread_t *thread)
+{
+	time_t now = time(NULL);
+	time_t elapsed = now - thread->rate_time;
+	if (elapsed < REBALANCE_INTERVAL) return;
+	uint64_t packets = thread->metrics.packets_in;
+	__atomic_store_n(&thread->rate,
+			(int) ((packets - thread->rate_packets) / elapsed), __ATOMIC_RELAXED);
+	thread->rate_packets = packets;
+	thread->rate_time = now;
 
-	if (crypto_sign_verify_detached(pkt->signature, challenge, CHALLENGE_SIZE,
-				pk_bin) != 0) {
-		send = 1;
-		free_packet(pkt);
-		error(0, "Incorrect signature, could not authenticate client");
-		goto failure;
+	thread_t *to = least_loaded();
+	long load = thread_load(thread);
+	long least = to ? thread_load(to) : 0;
+	long excess = 0;
+	if (!thread->ring && to && to != thread && !to->ring &&
+			is_hotspot(load, least)) {
+		/* Other threads measure at different times, a rate
+		 * may be one interval old */
+		if (++thread->hot >= REBALANCE_HOT) excess = (load - least) / 2;
 	} else {
-		pkt->type = ZSM_STA_AUTHORISED;
-		pkt->length = 0;
-		pkt->data = NULL;
-		pkt->signature = NULL;
-		strcpy(username, pk_hex);
-		send_packet(pkt, clientfd);
-		free_packet(pkt);
-		return ZSM_STA_SUCCESS;
+		thread->hot = 0;
+	}
+
+	/* Pick busiest clients under excess from whole table before moving any,
+	 * moving changes the table */
+	client_t *batch[REBALANCE_BATCH];
+	long costs[REBALANCE_BATCH];
+	int count = 0;
+	hashtable_t *table = &thread->table;
+	for (size_t i = 0; i < table->size; i++) {
+		client_t *client = table->slots[i];
+		if (table->tags[i] == HT_EMPTY) continue;
+		long cost = LOAD_CLIENT + client->packets / elapsed;
+		client->packets = 0;
+		if (cost > excess || client->ops > 0 || client->sending ||
+				client->throttled) {
+			continue;
+		}
+		if (count < REBALANCE_BATCH) {
+			batch[count] = client;
+			costs[count++] = cost;
+		} else {
+			int min = 0;
+			for (int j = 1; j < count; j++) {
+				if (costs[j] < costs[min]) min = j;
+			}
+			if (cost > costs[min]) {
+				batch[min] = client;
+				costs[min] = cost;
+			}
+		}
+	}
+	if (count == 0) return;
+
+	int room = max_clients - __atomic_load_n(&to->num_clients, __ATOMIC_RELAXED);
+	int moved = 0;
+	long moved_load = 0;
+	while (moved < room && moved_load < excess) {
+		int max = -1;
+		for (int j = 0; j < count; j++) {
+			if (batch[j] && costs[j] <= excess - moved_load &&
+					(max < 0 || costs[j] > costs[max])) {
+				max = j;
+			}
+		}
+		if (max < 0) break;
+		move_client(thread, batch[max], to);
+		moved_load += costs[max];
+		batch[max] = NULL;
+		moved++;
 	}
-failure:
-	if (send) {
-		/* Send error packet if there isn't any socket error */
-		packet_t *error_pkt = create_packet(ZSM_STA_UNAUTHORISED, 0, NULL, create_signature(NULL, 0, NULL));
-		send_packet(error_pkt, clientfd);
-		free_packet(error_pkt);
+	if (moved > 0) {
+		thread->hot = 0;
+		/* Other hotspots see the target's new load before it measures it */
+		__atomic_add_fetch(&to->rate, moved_load - moved * LOAD_CLIENT,
+				__ATOMIC_RELAXED);
+		error(0, "Thread %d is a hotspot at load %ld, moving %d clients to "
+				"thread %d at %ld", thread->id, load, moved, to->id, least);
 	}
-	close(clientfd);
-	return ZSM_STA_ERROR_AUTHENTICATE;
 }
 
+/*
+ * Work shared by all backends after handling I/O of a round
+ */
+void finish_round(thread_t *thread)
+{
+	/* Routing pushes to inboxes like handling reads does */
+	drain_verified(thread);
+	if (thread->fanouts) {
+		channel_work(thread);
+	}
+
+	/* Before inbox so frames parked for adopted clients go first */
+	if (__atomic_load_n(&thread->migrated, __ATOMIC_RELAXED)) {
+		adopt_clients(thread);
+	}
+
+	/* Any frame pointing to a client retired before grace was pushed
+	 * before grace was taken, so inbox must be drained in between */
+	uint64_t grace = dir_grace();
+	drain_inbox(thread);
+	if (__atomic_load_n(&thread->forwards, __ATOMIC_RELAXED)) {
+		mailbox_forward(thread);
+	}
+	flush_dirty(thread);
+	/* Same holds for frames routed by old tid of a moved client */
+	if (thread->moving) {
+		hand_over(thread, grace);
+	}
+	rebalance(thread);
+	dir_reclaim(thread->id, grace);
+	if (thread->frozen || __atomic_load_n(&upgrading, __ATOMIC_RELAXED)) {
+		upgrade_park(thread);
+	}
+}
+
+/*
+ * Stop accepting and reading authorised clients for an upgrade, their
+ * queues are still written with epoll
+ */
+void freeze_thread(thread_t *thread)
+{
+	thread->frozen = 1;
+	if (thread->ring) {
+		uring_freeze(thread);
+	} else if (thread->listen_fd >= 0) {
+		epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, thread->listen_fd, NULL);
+	}
+}
+
+/*
+ * Upgrade was given up, accept and read again
+ * Clients are resumed by their throttle on the next tick, like throttled
+ * ones are
+ */
+void thaw_thread(thread_t *thread)
+{
+	thread->frozen = 0;
+	if (thread->ring) {
+		uring_thaw(thread);
+	} else if (thread->listen_fd >= 0) {
+		struct epoll_event event;
+		event.data.ptr = &thread->listen_fd;
+		event.events = EPOLLIN;
+		if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->listen_fd,
+					&event) == -1) {
+			error(0, "Error adding listener to epoll");
+		}
+	}
+	for (client_t *client = thread->authorised; client;
+			client = client->auth_next) {
+		if (client->out_head || client->mail) mark_dirty(thread, client);
+		if (client->throttled) continue;
+		client->throttled = 1;
+		timeout_set(&thread->wheel, &client->throttle, thread->wheel.now + 1);
+	}
+}
+
+/*
+ * Whether bytes from client have to wait, while it is throttled or its
+ * thread is frozen for an upgrade
+ */
+int client_paused(thread_t *thread, client_t *client)
+{
+	return client->throttled ||
+		(thread->frozen && client->state == CLIENT_AUTHORISED);
+}
+
+/*
+ * Timeout (ms) of waiting for events, -1 if nothing is due
+ */
+int round_timeout(thread_t *thread)
+{
+	if (thread->fanouts) return 0;
+	if (thread->moving) return MOVE_TICK;
+	if (thread->frozen) return UPGRADE_TICK;
+	if (__atomic_load_n(&thread->forwards, __ATOMIC_RELAXED)) return FORWARD_TICK;
+	int timeout = wheel_timeout(&thread->wheel);
+	if (thread->rate > 0 && (timeout < 0 || timeout > RATE_TICK))
+		timeout = RATE_TICK;
+	return timeout;
+}
+
+/*
+ * Print allocation counts of every thread's pools
+ */
+void print_pools(void)
+{
+	for (int i = 0; i < num_threads; i++) {
+		fprintf(stderr, "Thread %d\n", i);
+		pool_print(&threads[i].rbufs, "  receive buffers");
+		pool_print(&threads[i].smalls, "  small buffers");
+		pool_print(&threads[i].outs, "  queue entries");
+		pool_print(&threads[i].fanout_pool, "  channel fan-outs");
+	}
+	fprintf(stderr, "Oversized buffers: %zu\n",
+			__atomic_load_n(&pool_mallocs, __ATOMIC_RELAXED));
+}
+
+/*
+ * Only hands signal to the main thread, which logs it, prints pools, runs an
+ * upgrade or shuts down, as none of that is async-signal-safe
+ */
 void signal_handler(int signal)
 {
-	switch (signal) {
-		case SIGPIPE:
-			error(0, "SIGPIPE received");
-			break;
-		case SIGABRT:
-		case SIGINT:
-		case SIGTERM:
-			error(1, "Shutdown signal received");
-			break;
+	upgrade_signal(signal);
+}
+
+/*
+ * Register accepted client with epoll instance of thread and challenge it
+ */
+void epoll_add_client(thread_t *thread, client_t *client)
+{
+	struct epoll_event event;
+	event.data.ptr = client;
+	/* Edge-triggered, EPOLLOUT only fires when a full socket becomes
+	 * writable again */
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	client->rbuf = buf_new(thread, RECV_BUFFER_SIZE);
+	if (!client->rbuf ||
+			epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) == -1) {
+		error(0, "Failed to add client to epoll");
+		close(client->fd);
+		__atomic_sub_fetch(&thread->num_clients, 1, __ATOMIC_RELAXED);
+		buf_release(client->rbuf);
+		ws_free(client);
+		free(client);
+	} else {
+		start_client(thread, client);
+	}
+}
+
+/*
+ * Open listening socket on listen_port
+ * With reuseport each thread has its own and kernel spreads connections
+ * between them by hash of the 4-tuple
+ */
+int open_listener(int listen_port, int reuseport)
+{
+	int serverfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (serverfd < 0) {
+		error(1, "Error on opening socket");
+	}
+
+	/* Reuse address (for debug) */
+	int opt = 1;
+	if (setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+		error(1, "Error at setting SO_REUSEADDR");
+	}
+	if (reuseport && setsockopt(serverfd, SOL_SOCKET, SO_REUSEPORT, &opt,
+				sizeof(opt)) < 0) {
+		error(1, "Error at setting SO_REUSEPORT");
+	}
+
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = INADDR_ANY;
+	server_addr.sin_port = htons(listen_port);
+
+	if (bind(serverfd, (struct sockaddr *) &server_addr
+				, sizeof(server_addr)) < 0) {
+		close(serverfd);
+		error(1, "Error on bind");
+	}
+	return serverfd;
+}
+
+/*
+ * Parse CPU list such as 0-3,8 into set
+ */
+int parse_cpus(char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	char *p = list;
+	while (*p) {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p) return -1;
+		long last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p) return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+		for (long cpu = first; cpu <= last; cpu++) {
+			CPU_SET(cpu, set);
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end) {
+			return -1;
+		}
+		p = end;
 	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
 }
 
-int get_clientfd(uint8_t *username)
+/*
+ * Pick thread for connection from main accept loop
+ * Prefers the thread pinned to the CPU which received the connection so its
+ * packets are processed where they arrive, unless that thread is a hotspot,
+ * least loaded thread otherwise
+ * Returns -1 if every thread is full
+ */
+int pick_thread(int clientfd)
 {
-	for (int i = 0; i < MAX_THREADS; i++) {
-		thread_t thread = threads[i];
-		client_t *client = hashtable_search(thread.table, username);
-		if (client) {
-			return client->fd;
+	thread_t *least = least_loaded();
+	if (!least) return -1;
+#ifdef SO_INCOMING_CPU
+	int cpu;
+	socklen_t len = sizeof(cpu);
+	if (getsockopt(clientfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+			cpu >= 0 && cpu < CPU_SETSIZE && cpu_threads[cpu] >= 0) {
+		thread_t *thread = &threads[cpu_threads[cpu]];
+		if (__atomic_load_n(&thread->num_clients, __ATOMIC_RELAXED) <
+				max_clients &&
+				!is_hotspot(thread_load(thread), thread_load(least))) {
+			return thread->id;
 		}
 	}
-	return -1;
+#else
+	(void) clientfd;
+#endif
+	return least->id;
 }
 
 /*
@@ -107,55 +1451,82 @@ void *thread_worker(void *arg)
 {
 	thread_t *thread = (thread_t *)	arg;
 	struct epoll_event events[MAX_EVENTS];
+
+	/* Thread is already pinned, memory it touches first is placed on its
+	 * own NUMA node */
+	if (hashtable_init(&thread->table, HT_MIN_SIZE) != 0) {
+		error(1, "Error allocating client table");
+	}
+	wheel_init(&thread->wheel);
+	if (backend == BACKEND_URING && uring_init(thread) != 0) {
+		/* Kernel too old or io_uring disabled */
+		error(0, "io_uring unavailable, thread %d falls back to epoll",
+				thread->id);
+	}
+	if (!thread->ring && thread->listen_fd >= 0) {
+		struct epoll_event event;
+		event.data.ptr = &thread->listen_fd;
+		event.events = EPOLLIN;
+		if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->listen_fd,
+					&event) == -1) {
+			error(1, "Error adding listener to epoll");
+		}
+	}
+
+	if (thread->ring) {
+		uring_worker(thread);
+		return NULL;
+	}
 	
 	while (1) {
-		int num_events = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, -1);
+		/* Directory references must not be held while sleeping */
+		dir_offline(thread->id);
+		int num_events = epoll_wait(thread->epoll_fd, events, MAX_EVENTS,
+				round_timeout(thread));
+		dir_online(thread->id);
 		if (num_events == -1) {
+			if (errno == EINTR) continue;
 			pthread_exit(&thread->thread);
 			error(0, "epoll_wait");
 		}
+		start_round(thread);
 		for (int i = 0; i < num_events; i++) {
-			client_t *client = (client_t *) events[i].data.ptr;
-
-			if (events[i].events & EPOLLIN) {
-				/* Handle packet */
-				pthread_mutex_lock(&thread->message_lock);
-				packet_t *pkt = memalloc(sizeof(packet_t));
-				int status = verify_packet(pkt, client->fd);
-				if (debug) print_packet(pkt);
-				if (status != ZSM_STA_SUCCESS) {
-					if (status == ZSM_STA_CLOSED_CONNECTION) {
-						/* Remove from hash table */
-						epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
-						close(client->fd);
-						error(0, "Client %s closed connection", client->username);
-						hashtable_remove(thread->table, client->username);
-					} else {
-						error(0, "Error verifying packet");
-					}
-					pthread_mutex_unlock(&thread->message_lock);
-					continue;
+			if (events[i].data.ptr == thread) {
+				/* Other threads handed frames or clients over, reset counter
+				 * before taking them so a later wake up isn't lost */
+				uint64_t count;
+				if (read(thread->event_fd, &count, sizeof(count)) < 0) {
+					errno = 0;
 				}
-				
-				/* Message relay */
-				uint8_t to[MAX_NAME];
-				memcpy(to, pkt->data + MAX_NAME, MAX_NAME);
-				if (to[0] != '\0') {
-					char hex[PK_SIZE * 2 + 1];
-					sodium_bin2hex(hex, sizeof(hex), to, PK_SIZE);
-					int fd = get_clientfd(hex);
-					if (fd != -1) {
-						error(0, "Relaying packet to %s", hex);
-						send_packet(pkt, fd);
-					} else {
-						error(0, "%s not found", hex);
+				continue;
+			}
+			if (events[i].data.ptr == &thread->listen_fd) {
+				/* Listener is level-triggered, take what is ready now and
+				 * leave the rest to next round */
+				for (int j = 0; j < MAX_EVENTS; j++) {
+					int clientfd = accept4(thread->listen_fd, NULL, NULL,
+							SOCK_NONBLOCK);
+					if (clientfd < 0) {
+						errno = 0;
+						break;
 					}
-				} else {
-					error(0, "Wrong recipient");
+					client_t *client = accept_client(thread, clientfd);
+					if (client) epoll_add_client(thread, client);
 				}
-				pthread_mutex_unlock(&thread->message_lock);
+				continue;
 			}
+			client_t *client = (client_t *) events[i].data.ptr;
+
+			handle_client(thread, client, events[i].events);
+		}
+
+		client_t *client = take_accepted(thread);
+		while (client) {
+			client_t *next = client->accept_next;
+			epoll_add_client(thread, client);
+			client = next;
 		}
+		finish_round(thread);
 	}
 }
 
@@ -165,139 +1536,433 @@ int main(int argc, char **argv)
 		error(1, "Error initializing libsodium");
 	}
 	
-	if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-		/* Turns on debug flag */
-		debug = 1;
+	cpu_set_t cpus, allowed;
+	int pin = 1;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		pin = 0;
+	}
+	cpus = allowed;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "a:b:c:de:f:F:i:k:K:l:L:m:o:p:q:rs:t:v:w:")) != -1) {
+		switch (opt) {
+			case 'd':
+				/* Turns on debug flag, relayed packets are logged too */
+				debug = 1;
+				log_level = LOG_DEBUG;
+				break;
+			case 'o':
+				/* Log file, rotated once it grows past LOG_ROTATE_SIZE */
+				log_path = optarg;
+				break;
+			case 'b':
+				/* I/O backend of worker threads */
+				if (strcmp(optarg, "uring") == 0) {
+					backend = BACKEND_URING;
+				} else if (strcmp(optarg, "epoll") == 0) {
+					backend = BACKEND_EPOLL;
+				} else {
+					error(1, "Unknown backend %s, use epoll or uring", optarg);
+				}
+				break;
+			case 'r':
+				/* Every thread accepts on its own SO_REUSEPORT socket */
+				reuseport = 1;
+				break;
+			case 't':
+				/* Number of worker threads */
+				num_threads = atoi(optarg);
+				if (num_threads <= 0) {
+					error(1, "Invalid number of threads %s", optarg);
+				}
+				break;
+			case 'c':
+				/* Clients each thread takes before rejecting */
+				max_clients = atoi(optarg);
+				if (max_clients <= 0) {
+					error(1, "Invalid number of clients %s", optarg);
+				}
+				break;
+			case 'a':
+				/* CPUs workers are pinned to in order, none to not pin */
+				if (strcmp(optarg, "none") == 0) {
+					pin = 0;
+				} else if (parse_cpus(optarg, &cpus) != 0) {
+					error(1, "Invalid CPU list %s", optarg);
+				} else {
+					pin = 1;
+				}
+				break;
+			case 'm':
+				/* Directory of offline mailbox, none to drop such frames */
+				mailbox_dir = optarg;
+				break;
+			case 'e':
+				/* Seconds frames are kept for offline recipients */
+				mailbox_ttl = strtoll(optarg, NULL, 10);
+				if (mailbox_ttl <= 0) {
+					error(1, "Invalid mailbox ttl %s", optarg);
+				}
+				break;
+			case 'v':
+				/* Signature verifier threads, 0 verifies on workers */
+				verifier_count = atoi(optarg);
+				if (verifier_count < 0) {
+					error(1, "Invalid number of verifiers %s", optarg);
+				}
+				break;
+			case 's':
+				/* Unix socket metrics are served on, none to not serve them */
+				metrics_path = optarg;
+				break;
+			case 'i':
+				/* Seconds of silence before a client is pinged or probed, 0 never */
+				idle_timeout = atoi(optarg);
+				if (idle_timeout < 0) {
+					error(1, "Invalid idle timeout %s", optarg);
+				}
+				break;
+			case 'l':
+				/* Packets and bytes per second of a connection */
+				if (parse_limit(optarg, &limit_packets, &limit_bytes) != 0) {
+					error(1, "Invalid connection limit %s, use packets[,bytes]",
+							optarg);
+				}
+				break;
+			case 'L':
+				/* Packets and bytes per second of a user */
+				if (parse_limit(optarg, &user_packets, &user_bytes) != 0) {
+					error(1, "Invalid user limit %s, use packets[,bytes]",
+							optarg);
+				}
+				break;
+			case 'k':
+				/* Connections a user may have, 0 for any */
+				user_connections = atoi(optarg);
+				if (user_connections < 0) {
+					error(1, "Invalid number of connections %s", optarg);
+				}
+				break;
+			case 'q':
+				/* Bytes queued for a client before it is dropped */
+				max_queue = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				/* Port clients connect to */
+				port = atoi(optarg);
+				if (port <= 0 || port > 65535) {
+					error(1, "Invalid port %s", optarg);
+				}
+				break;
+			case 'f':
+				/* Port other nodes connect to */
+				fed_port = atoi(optarg);
+				if (fed_port <= 0 || fed_port > 65535) {
+					error(1, "Invalid federation port %s", optarg);
+				}
+				break;
+			case 'w':
+				/* Port browsers connect to with WebSocket */
+				ws_port = atoi(optarg);
+				if (ws_port <= 0 || ws_port > 65535) {
+					error(1, "Invalid WebSocket port %s", optarg);
+				}
+				break;
+			case 'F':
+				/* Node to forward to, once per peer */
+				if (fed_add_peer(optarg) != 0) {
+					error(1, "Invalid peer %s, use host:port", optarg);
+				}
+				break;
+			case 'K':
+				/* Key shared by federated nodes */
+				if (fed_load_key(optarg) != 0) {
+					error(1, "Invalid federation key file %s", optarg);
+				}
+				break;
+			default:
+				error(1, "Usage: %s [-d] [-o log_file] [-r] [-b epoll|uring] [-q max_queue_bytes] "
+						"[-t threads] [-c clients_per_thread] [-a cpu_list|none] [-i idle_seconds] "
+						"[-l packets[,bytes]] [-L user_packets[,bytes]] [-k user_connections] "
+						"[-m mailbox_dir|none] [-e mailbox_ttl] [-v verifiers] "
+						"[-s metrics_socket|none] [-p port] [-w websocket_port] "
+						"[-f federation_port] [-K federation_key_file] [-F peer_host:port]...",
+						argv[0]);
+		}
 	}
 	
+	if (pin) {
+		/* Only CPUs the process may run on */
+		CPU_AND(&cpus, &cpus, &allowed);
+		if (CPU_COUNT(&cpus) == 0) {
+			error(1, "None of the given CPUs is available");
+		}
+	}
+
+	if (log_open(log_path, LOG_ROTATE_SIZE) != 0) {
+		error(1, "Error starting logging");
+	}
+
+	/* Before anything is opened, a replaced process hands its own over */
+	upgrade_init(argv);
+	if (upgrade_receive() != 0) {
+		error(1, "Error taking over from replaced process");
+	}
+
 	signal(SIGPIPE, signal_handler);
 	signal(SIGABRT, signal_handler);
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
+	signal(SIGUSR1, signal_handler);
+	signal(SIGUSR2, signal_handler);
 
 	/* Start server and epoll */
-	int serverfd, clientfd;
+	int listeners[] = { -1, -1 }; /* By LISTENER_* */
+	int clientfd;
+	struct sockaddr_in client_addr;
+	socklen_t client_addr_len = sizeof(client_addr);
 
-	/* Create socket */
-	serverfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (serverfd < 0) {
-		error(1, "Error on opening socket");
+	if (!reuseport) {
+		listeners[LISTENER_CLIENTS] = upgrade_listener(LISTENER_CLIENTS);
+		if (listeners[LISTENER_CLIENTS] < 0)
+			listeners[LISTENER_CLIENTS] = open_listener(port, 0);
+	}
+	if (ws_port) {
+		/* Browsers are few next to native clients, main thread accepts
+		 * them even with reuseport */
+		listeners[LISTENER_WS] = upgrade_listener(LISTENER_WS);
+		if (listeners[LISTENER_WS] < 0)
+			listeners[LISTENER_WS] = open_listener(ws_port, 0);
 	}
 
-	/* Reuse address (for debug) */
-	int opt = 1;
-	if (setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-		error(1, "Error at setting SO_REUSEADDR");
+	if (num_threads == 0) {
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (num_threads <= 0) num_threads = 1;
+	}
+	threads = memalloc(num_threads * sizeof(thread_t));
+	cpu_threads = memalloc(CPU_SETSIZE * sizeof(int));
+	if (!threads || !cpu_threads) {
+		error(1, "Error allocating thread pool");
+	}
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		cpu_threads[i] = -1;
 	}
 
-	struct sockaddr_in server_addr, client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
-	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_addr.s_addr = INADDR_ANY;
-	server_addr.sin_port = htons(PORT);
+	dir_init(num_threads);
+	channel_init();
+	limit_init();
 
-	if (bind(serverfd, (struct sockaddr *) &server_addr
-				, sizeof(server_addr)) < 0) {
-		close(serverfd);
-		error(1, "Error on bind");
+	if (!mailbox_dir) {
+		char *data_dir = replace_home(SERVER_DATA_DIR);
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/mailbox", data_dir);
+		if (getenv("HOME")) free(data_dir);
+		if (mailbox_init(path, mailbox_ttl) != 0) {
+			error(0, "Offline mailbox disabled");
+		}
+	} else if (strcmp(mailbox_dir, "none") != 0 &&
+			mailbox_init(mailbox_dir, mailbox_ttl) != 0) {
+		error(0, "Offline mailbox disabled");
 	}
 
 	/* Creating thread pool */
-	for (int i = 0; i < MAX_THREADS; i++) {
+	int cpu = -1;
+	for (int i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].cpu = -1;
+		if (pin) {
+			/* Next CPU of the set, wrapping when there are more threads */
+			do {
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			} while (!CPU_ISSET(cpu, &cpus));
+			threads[i].cpu = cpu;
+			if (cpu_threads[cpu] < 0) cpu_threads[cpu] = i;
+		}
 		/* Create epoll instance for each thread */
 		threads[i].epoll_fd = epoll_create1(0);
 		if (threads[i].epoll_fd < 0) {
 			error(1, "Error on creating epoll instance");
 		}
-		hashtable_init(threads[i].table);
-		if (pthread_mutex_init(&threads[i].message_lock, NULL) != 0) { 
-			error(1, "Error on initializing mutex");
-		}	
+		threads[i].num_clients = 0;
+		memset(&threads[i].metrics, 0, sizeof(metrics_t));
+		threads[i].inbox = NULL;
+		threads[i].verified = NULL;
+		threads[i].dirty = NULL;
+		threads[i].rate = 0;
+		threads[i].rate_packets = 0;
+		threads[i].rate_time = time(NULL);
+		threads[i].hot = 0;
+		threads[i].moving = NULL;
+		threads[i].migrated = NULL;
+		threads[i].fanouts = threads[i].fanouts_tail = NULL;
+		threads[i].links = NULL;
+		threads[i].forwards = NULL;
+		threads[i].forward_time = 0;
+		threads[i].authorised = NULL;
+		threads[i].frozen = 0;
+		/* Slabs are only allocated once the thread itself uses them */
+		pool_init(&threads[i].rbufs, sizeof(buf_t) + RECV_BUFFER_SIZE);
+		pool_init(&threads[i].smalls, sizeof(buf_t) + SMALL_BUFFER_SIZE);
+		pool_init(&threads[i].outs, sizeof(out_t));
+		pool_init(&threads[i].fanout_pool, sizeof(fanout_t));
+		threads[i].accepted = NULL;
+		threads[i].ring = NULL;
+		threads[i].listen_fd = -1;
+
+		/* Wake up when other threads hand over frames */
+		threads[i].event_fd = eventfd(0, EFD_NONBLOCK);
+		if (threads[i].event_fd < 0) {
+			error(1, "Error on creating eventfd");
+		}
+		struct epoll_event event;
+		event.data.ptr = &threads[i];
+		event.events = EPOLLIN;
+		if (epoll_ctl(threads[i].epoll_fd, EPOLL_CTL_ADD, threads[i].event_fd,
+					&event) == -1) {
+			error(1, "Error adding eventfd to epoll");
+		}
+	}
+
+	if (verifier_count < 0) {
+		verifier_count = num_threads / 2;
+	}
+	if (verifier_count > 0 && verify_init(verifier_count) != 0) {
+		error(1, "Error starting verifiers");
+	}
+
+	if (!metrics_path) {
+		char *socket_path = replace_home(SERVER_METRICS_SOCKET);
+		if (metrics_init(socket_path) != 0) {
+			error(0, "Metrics socket disabled");
+		}
+		if (getenv("HOME")) free(socket_path);
+	} else if (strcmp(metrics_path, "none") != 0 &&
+			metrics_init(metrics_path) != 0) {
+		error(0, "Metrics socket disabled");
+	}
+
+	/* Links to peers are handed to workers as soon as they start */
+	if (fed_init(fed_port) != 0) {
+		error(1, "Error starting federation");
+	}
+
+	for (int i = 0; reuseport && i < num_threads; i++) {
+		/* Bound before any thread listens so none of them misses a connection */
+		threads[i].listen_fd = upgrade_listener(LISTENER_THREAD(i));
+		if (threads[i].listen_fd < 0)
+			threads[i].listen_fd = open_listener(port, 1);
+#ifdef SO_INCOMING_CPU
+		/* Kernel prefers the listener on the CPU the connection came in on */
+		if (threads[i].cpu >= 0 && setsockopt(threads[i].listen_fd, SOL_SOCKET,
+					SO_INCOMING_CPU, &threads[i].cpu, sizeof(int)) < 0) {
+			error(0, "Error at setting SO_INCOMING_CPU");
+		}
+#endif
+	}
+	for (int i = 0; reuseport && i < num_threads; i++) {
+		if (listen(threads[i].listen_fd, MAX_CONNECTION_QUEUE) < 0) {
+			error(1, "Error on listen");
+		}
+		int flags = fcntl(threads[i].listen_fd, F_GETFL, 0);
+		if (flags == -1 || fcntl(threads[i].listen_fd, F_SETFL,
+					flags | O_NONBLOCK) == -1) {
+			error(1, "Error setting listener non-blocking");
+		}
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (threads[i].cpu >= 0) {
+			/* Pinned from the start so its allocations are node local */
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(threads[i].cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
 		/* Start a new thread and pass thread_t struct to thread */
-		if (pthread_create(&threads[i].thread, NULL, thread_worker,
+		if (pthread_create(&threads[i].thread, &attr, thread_worker,
 					&threads[i]) != 0) {
 			error(1, "Error on creating threads");
+		} else if (threads[i].cpu >= 0) {
+			error(0, "Thread %d created on CPU %d", i, threads[i].cpu);
 		} else {
 			error(0, "Thread %d created", i);
 		}
+		pthread_attr_destroy(&attr);
 	}
+	upgrade_resume();
 
-	if (listen(serverfd, MAX_CONNECTION_QUEUE) < 0) {
-		close(serverfd);
-		error(1, "Error on listen");
+	for (int i = 0; i < 2; i++) {
+		if (listeners[i] >= 0 && listen(listeners[i], MAX_CONNECTION_QUEUE) < 0) {
+			error(1, "Error on listen");
+		}
 	}
-	
-	error(0, "Listening on port %d", PORT);
-
-	pthread_mutex_t table_lock;
-	if (pthread_mutex_init(&table_lock, NULL) != 0) { 
-		error(1, "Error on initializing mutex");
+	if (reuseport) {
+		error(0, "Listening on port %d with %s backend, %d SO_REUSEPORT listeners",
+				port, backend == BACKEND_URING ? "io_uring" : "epoll",
+				num_threads);
+	} else {
+		error(0, "Listening on port %d with %s backend", port,
+				backend == BACKEND_URING ? "io_uring" : "epoll");
 	}
-	/* Server loop to accept clients and load balance */
+	if (ws_port) {
+		error(0, "Listening for WebSocket clients on port %d", ws_port);
+	}
+
+	/* Server loop to accept clients and load balance, workers with their own
+	 * listeners only leave upgrades and WebSocket clients to it
+	 * Handshake is done by the worker thread so accepting never blocks on a client
+	 */
 	while (1) {
-		clientfd = accept(serverfd, (struct sockaddr *) &client_addr,
+		int ready = upgrade_wait(listeners, 2);
+		clientfd = accept(listeners[ready], (struct sockaddr *) &client_addr,
 				&client_addr_len);
 		if (clientfd < 0) {
 			error(0, "Error on accepting client");
 			continue;
 		}
-		pthread_mutex_lock(&table_lock);
 
-		/* Assign new client to a thread
-		 * Clients distributed by a rotation(round-robin)
-		 */
-		thread_t *thread = &threads[num_thread];
-		int num_clients = hashtable_length(thread->table);
-		if (num_clients >= MAX_CLIENTS_PER_THREAD) {
-			error(0, "Thread %d is already full, rejecting connection\n",
-					num_thread);
+		/* Assign new client to the least loaded thread */
+		int this_thread = pick_thread(clientfd);
+		if (this_thread < 0) {
+			error(0, "All threads are full, rejecting connection");
 			close(clientfd);
-			pthread_mutex_unlock(&table_lock);
 			continue;
 		}
+		thread_t *thread = &threads[this_thread];
 
-		client_t *client = memalloc(sizeof(client_t));
-		
-		uint8_t username[MAX_NAME * 2 + 1];
-		/* User logins, authenticate them */
-		if (authenticate_client(clientfd, username) != ZSM_STA_SUCCESS) {
-			error(0, "Error authenticating with client");
-			pthread_mutex_unlock(&table_lock);
+		int flags = fcntl(clientfd, F_GETFL, 0);
+		if (flags == -1 || fcntl(clientfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			error(0, "Error setting client socket non-blocking");
+			close(clientfd);
 			continue;
 		}
 
-		/* Add the new client to the thread's epoll instance */
-		struct epoll_event event;
-		event.data.ptr = client;
-		event.events = EPOLLIN;
-
-		if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, clientfd, &event) == -1) {
-			perror("Failed to add client to epoll");
+		client_t *client = new_client(clientfd, this_thread);
+		if (client && ready == LISTENER_WS && ws_attach(client) != 0) {
+			free(client);
+			client = NULL;
+		}
+		if (!client) {
 			close(clientfd);
-			pthread_mutex_unlock(&table_lock);
 			continue;
 		}
+		__atomic_add_fetch(&thread->num_clients, 1, __ATOMIC_RELAXED);
 
-		/* Assign fd and username to client in a thread */
-		client->fd = clientfd;
-		strcpy(client->username, username);	
-		hashtable_add(thread->table, client);
-
-		printf("%s connected\n", username);
-		
-		/* Rotate num_thread back to start if it is larder than MAX_THREADS */
-		num_thread = (num_thread + 1) % MAX_THREADS;
-		pthread_mutex_unlock(&table_lock);
+		/* Hand client to the thread, it does the handshake */
+		accept_push(thread, client);
 	}
 
 	/* End the thread */
-	for (int i = 0; i < MAX_THREADS; i++) {
-		hashtable_free(threads[i].table);
+	for (int i = 0; i < num_threads; i++) {
+		hashtable_free(&threads[i].table);
 		if (pthread_join(threads[i].thread, NULL) != 0) {
 			error(0, "pthread_join");
 		}
 	}
-	close(serverfd);
+	for (int i = 0; i < 2; i++) {
+		if (listeners[i] >= 0) close(listeners[i]);
+	}
 	return 0;
 }
@@ -0,0 +1,76 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "packet.h"
+#include "util.h"
+
+/*
+ * Print metrics of a running zmr, only the ones whose name starts with one
+ * of the given prefixes if there are any
+ */
+
+static int matches(char *line, char **prefixes, int count)
+{
+	if (count == 0) return 1;
+	/* Comments name the metric after "# HELP " or "# TYPE " */
+	if (line[0] == '#') {
+		if (strlen(line) < 7) return 0;
+		line += 7;
+	}
+	for (int i = 0; i < count; i++) {
+		size_t length = strlen(prefixes[i]);
+		if (strncmp(line, prefixes[i], length) == 0) return 1;
+		/* zmr_ may be left out */
+		if (strncmp(line, "zmr_", 4) == 0 &&
+				strncmp(line + 4, prefixes[i], length) == 0) return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+			case 's':
+				path = optarg;
+				break;
+			default:
+				error(1, "Usage: %s [-s metrics_socket] [metric_prefix...]",
+						argv[0]);
+		}
+	}
+	if (!path) path = replace_home(SERVER_METRICS_SOCKET);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		error(1, "Socket path %s is too long", path);
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		error(1, "Error creating socket");
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		error(1, "Cannot connect to %s, is zmr running?", path);
+	}
+
+	FILE *in = fdopen(fd, "r");
+	if (!in) {
+		error(1, "Error reading from %s", path);
+	}
+	char *line = NULL;
+	size_t size = 0;
+	while (getline(&line, &size, in) != -1) {
+		if (matches(line, argv + optind, argc - optind))
+			fputs(line, stdout);
+	}
+	free(line);
+	fclose(in);
+	return 0;
+}